@@ -0,0 +1,149 @@
+//
+// dns_arena.c -- Implementation of the arena allocator
+// Created on 10/15/26.
+//
+
+#include <stdlib.h>
+#include "dns_common.h"
+#include "dns_arena.h"
+
+#define ARENA_ALIGN 16    // The alignment of the allocated memory, should be power of 2
+
+/**
+ * A block of memory of the arena, the chunks are stored as linked list
+ */
+typedef struct arena_chunk {
+    struct arena_chunk *next;
+    size_t size;
+    size_t used;
+    unsigned char *data;
+} arena_chunk_t;
+
+struct dns_arena {
+    arena_chunk_t *first;       // The chunks of normal size, kept when the arena is reset
+    arena_chunk_t *current;     // The chunk currently allocated from
+    arena_chunk_t *large;       // The chunks for the large allocations, released when the arena is reset
+    size_t chunk_size;
+    size_t used;                // The bytes allocated since the last reset
+};
+
+// The arena used by DNS_alloc, every thread have its own one
+static __thread dns_arena_t *current_arena = NULL;
+
+/**
+ * Create a chunk, the chunk header and its data are allocated together
+ */
+arena_chunk_t *arena_chunk_create(size_t size) {
+    arena_chunk_t *chunk = (arena_chunk_t *) malloc(sizeof(arena_chunk_t) + ARENA_ALIGN + size);
+    if (chunk == NULL) {
+        DNS_log_error("[  dns_arena ] Cannot create arena chunk with size %lu, out of memory.", (unsigned long) size);
+        return NULL;
+    }
+
+    // Align the beginning of the data
+    size_t addr = (size_t) (chunk + 1);
+    chunk->data = (unsigned char *) ((addr + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1));
+    chunk->next = NULL;
+    chunk->size = size;
+    chunk->used = 0;
+    return chunk;
+}
+
+dns_arena_t *DNS_arena_create(size_t chunk_size) {
+    dns_arena_t *arena = (dns_arena_t *) malloc(sizeof(dns_arena_t));
+    if (arena == NULL) {
+        DNS_log_error("[  dns_arena ] Cannot create arena, out of memory.");
+        return NULL;
+    }
+
+    arena->first = arena_chunk_create(chunk_size);
+    if (arena->first == NULL) {
+        free(arena);
+        return NULL;
+    }
+    arena->current = arena->first;
+    arena->large = NULL;
+    arena->chunk_size = chunk_size;
+    arena->used = 0;
+    return arena;
+}
+
+void *DNS_arena_alloc(dns_arena_t *arena, size_t size) {
+    size = (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+    arena->used += size;
+
+    if (size > arena->chunk_size) {
+        arena_chunk_t *chunk = arena_chunk_create(size);
+        if (chunk == NULL) {
+            return NULL;
+        }
+        chunk->next = arena->large;
+        arena->large = chunk;
+        return chunk->data;
+    }
+
+    arena_chunk_t *chunk = arena->current;
+    while (chunk->used + size > chunk->size) {
+        // Move to the next chunk, which might be left from the last use of the arena
+        if (chunk->next == NULL) {
+            chunk->next = arena_chunk_create(arena->chunk_size);
+            if (chunk->next == NULL) {
+                return NULL;
+            }
+        }
+        chunk = chunk->next;
+        arena->current = chunk;
+    }
+
+    void *ptr = chunk->data + chunk->used;
+    chunk->used += size;
+    return ptr;
+}
+
+void DNS_arena_reset(dns_arena_t *arena) {
+    for (arena_chunk_t *chunk = arena->first; chunk != NULL; chunk = chunk->next) {
+        chunk->used = 0;
+    }
+    arena->current = arena->first;
+
+    arena_chunk_t *next;
+    for (arena_chunk_t *chunk = arena->large; chunk != NULL; chunk = next) {
+        next = chunk->next;
+        free(chunk);
+    }
+    arena->large = NULL;
+    arena->used = 0;
+}
+
+void DNS_arena_free(dns_arena_t *arena) {
+    DNS_arena_reset(arena);
+
+    arena_chunk_t *next;
+    for (arena_chunk_t *chunk = arena->first; chunk != NULL; chunk = next) {
+        next = chunk->next;
+        free(chunk);
+    }
+    if (current_arena == arena) {
+        current_arena = NULL;
+    }
+    free(arena);
+}
+
+size_t DNS_arena_used(dns_arena_t *arena) {
+    return arena->used;
+}
+
+void DNS_arena_set_current(dns_arena_t *arena) {
+    current_arena = arena;
+}
+
+dns_arena_t *DNS_arena_current() {
+    return current_arena;
+}
+
+void *DNS_alloc(size_t size) {
+    if (current_arena != NULL) {
+        return DNS_arena_alloc(current_arena, size);
+    }
+    return malloc(size);
+}
@@ -0,0 +1,75 @@
+//
+// dns_arena.h -- Arena (bump) allocator for the memory used during one request
+// Created on 10/15/26.
+//
+
+#ifndef PROJECT_DNS_DNS_ARENA_H
+#define PROJECT_DNS_DNS_ARENA_H
+
+#include <stddef.h>
+#include "dns_io.h"
+
+/**
+ * The arena struct, memory is allocated from chunks by increasing the used size,
+ * and all of it is released at once when the arena is reset
+ */
+typedef struct dns_arena dns_arena_t;
+
+/**
+ * Create an arena
+ * @param chunk_size The size of each chunk, allocations larger than it get a chunk of their own
+ * @return The arena, NULL if out of memory
+ */
+dns_arena_t *DNS_arena_create(size_t chunk_size);
+
+/**
+ * Allocate memory from the arena. The memory is aligned for any type and
+ * stays valid until the arena is reset
+ * @param arena The arena
+ * @param size The size of the memory
+ * @return The pointer to the memory, NULL if out of memory
+ */
+void *DNS_arena_alloc(dns_arena_t *arena, size_t size);
+
+/**
+ * Release all the memory allocated from the arena. The chunks are kept for the following
+ * allocations, so an arena used repeatedly will not allocate from the heap after warming up
+ * @param arena The arena
+ */
+void DNS_arena_reset(dns_arena_t *arena);
+
+/**
+ * Release the arena and all its chunks
+ * @param arena The arena
+ */
+void DNS_arena_free(dns_arena_t *arena);
+
+/**
+ * Get the number of bytes allocated from the arena since it was last reset
+ * @param arena The arena
+ * @return The allocated size
+ */
+size_t DNS_arena_used(dns_arena_t *arena);
+
+/**
+ * Set the arena used by {@code DNS_alloc} on the current thread
+ * @param arena The arena, NULL to allocate from the heap
+ */
+void DNS_arena_set_current(dns_arena_t *arena);
+
+/**
+ * Get the arena used by {@code DNS_alloc} on the current thread
+ * @return The arena, NULL if not set
+ */
+dns_arena_t *DNS_arena_current();
+
+/**
+ * Allocate memory for the queries, RRs and names. The memory is allocated from the current
+ * arena if it is set (and will be released when the arena is reset), otherwise from the heap
+ * (and will never be released)
+ * @param size The size of the memory
+ * @return The pointer to the memory, NULL if out of memory
+ */
+void *DNS_alloc(size_t size);
+
+#endif //PROJECT_DNS_DNS_ARENA_H
@@ -0,0 +1,709 @@
+//
+// dns_bench.c -- Load generator of the DNS servers. It keeps a number of queries in flight over UDP or TCP,
+//                either as fast as the server answers (closed loop, optionally limited to a rate) or at a
+//                fixed arrival rate whatever the server does (open loop), and reports the throughput, the
+//                latency percentiles, the timeouts and the response codes as text or JSON.
+//                In the open loop the latency is measured from the time the query is scheduled, so the
+//                queries delayed by a slow server are counted with their waiting time
+// Created on 10/15/26.
+//
+
+#define _GNU_SOURCE   // For the monotonic clock and epoll
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "dns_common.h"
+#include "dns_arena.h"
+#include "dns_query.h"
+#include "dns_histogram.h"
+
+#define BUFFER_SIZE 1024
+#define MAX_CONCURRENCY 4096
+#define UDP_SOCKETS 16              // The queries are spread over the sockets, so the workers of the server share them
+#define DEFAULT_CONCURRENCY 16
+#define DEFAULT_DURATION 10
+#define DEFAULT_TIMEOUT 1000
+#define TIMEOUT_SCAN_NS 10000000L   // The interval of checking the queries timed out
+#define MAX_CATCH_UP_NS 100000000L  // A rate-limited closed loop does not burst to catch up more than this
+#define EVENT_BATCH_SIZE 64
+#define RCODE_COUNT 16
+
+/**
+ * A name queried by the benchmark. The request is encoded once, with the TCP length prefix
+ * before it, and the ID is written before each query is sent
+ */
+typedef struct {
+    uint8 data[BUFFER_SIZE + 2];
+    int length;                     // The length of the request without the prefix
+} bench_name_t;
+
+/**
+ * One query in flight. Over TCP each slot has its own connection
+ */
+typedef struct {
+    int fd;
+    bool outstanding;
+    uint16 id;
+    long start;                     // The time the query is scheduled, in nanoseconds
+    uint8 buffer[BUFFER_SIZE + 2];  // The data received over TCP
+    int received;
+} bench_slot_t;
+
+/**
+ * The options and the results of the benchmark
+ */
+typedef struct {
+    const char *server;
+    uint16 port;
+    bool tcp;
+    int concurrency;
+    double qps;                     // The target rate, 0 for no limit
+    bool open_loop;
+    double duration;
+    unsigned long max_queries;      // 0 for no limit
+    long timeout;                   // In nanoseconds
+    double zipf;                    // The exponent of the Zipf distribution, 0 to pick the names uniformly
+    bool json;
+
+    unsigned long sent;
+    unsigned long answered;
+    unsigned long timeouts;
+    unsigned long errors;
+    unsigned long late;             // The responses received after the query timed out
+    unsigned long rcodes[RCODE_COUNT];
+    double elapsed;
+    dns_histogram_t latency;        // In nanoseconds
+} bench_t;
+
+const char *bench_rcode_names[RCODE_COUNT] = {"NOERROR", "FORMERR", "SERVFAIL", "NXDOMAIN", "NOTIMP", "REFUSED"};
+
+// The default names, which are all answered by the default records of the servers
+const char *bench_default_names[] = {"www.baidu.com A", "tieba.baidu.com A", "code.org A", "studio.code.org A",
+                                     "bupt.edu.cn MX", "www.bupt.edu.cn A", "ci.craig.co.us A", "ci.golden.co.us A"};
+
+bench_name_t *bench_names = NULL;
+int bench_name_count = 0;
+double *bench_zipf_cdf = NULL;      // The cumulative probabilities of the names in the Zipf distribution
+
+bench_slot_t bench_slots[MAX_CONCURRENCY];
+int bench_free[MAX_CONCURRENCY];    // The slots without a query in flight
+int bench_free_count = 0;
+int bench_in_flight = 0;
+int bench_slot_by_id[65536];        // The slot of the query with the ID, -1 if none
+uint16 bench_next_id = 0;
+unsigned long long bench_random_state = 88172645463325252ull;
+
+/**
+ * Get the current time of the monotonic clock
+ * @return The time in nanoseconds
+ */
+long bench_now() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+/**
+ * Get a random number in [0, 1) with xorshift
+ */
+double bench_random() {
+    bench_random_state ^= bench_random_state << 13;
+    bench_random_state ^= bench_random_state >> 7;
+    bench_random_state ^= bench_random_state << 17;
+    return (double) (bench_random_state >> 11) / (double) (1ull << 53);
+}
+
+/**
+ * Encode the request of a name and add it to the names
+ * @param line The name and the optional type like "bupt.edu.cn MX", the type is A by default
+ * @return False if the line is not valid
+ */
+bool bench_add_name(const char *line) {
+    char name[RR_STRING_LEN], type_str[16] = "A";
+    if (sscanf(line, "%127s %15s", name, type_str) < 1 || name[0] == '#') {
+        return true;    // Empty lines and comments are skipped
+    }
+    uint16 type = DNS_type_from_str(type_str);
+    if (type == 0) {
+        return false;
+    }
+
+    bench_name_t *names = realloc(bench_names, sizeof(bench_name_t) * (bench_name_count + 1));
+    if (names == NULL) {
+        DNS_log_error("[ dns_bench  ] Cannot load the names, out of memory.");
+        return false;
+    }
+    bench_names = names;
+    bench_name_t *n = &bench_names[bench_name_count];
+
+    // The packet is built in an arena released at once
+    dns_arena_t *arena = DNS_arena_create(4096);
+    DNS_arena_set_current(arena);
+    struct dns_buffer buffer;
+    DNS_buffer_init(&buffer, &n->data[2], BUFFER_SIZE);
+    bool success = DNS_buffer_write_packet(&buffer, DNS_query_create_request(name, type));
+    DNS_arena_set_current(NULL);
+    DNS_arena_free(arena);
+    if (!success) {
+        DNS_log_error("[ dns_bench  ] Invalid name '%s'.", name);
+        return false;
+    }
+
+    n->length = buffer.pos;
+    n->data[0] = (uint8) (buffer.pos >> 8);
+    n->data[1] = (uint8) buffer.pos;
+    bench_name_count++;
+    return true;
+}
+
+/**
+ * Load the names from a file, one name and its optional type per line
+ * @return False if failed
+ */
+bool bench_load_names(const char *path) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        DNS_log_error("[ dns_bench  ] Cannot open the name file '%s'.", path);
+        return false;
+    }
+    char line[256];
+    while (fgets(line, sizeof(line), file) != NULL) {
+        if (!bench_add_name(line)) {
+            fclose(file);
+            return false;
+        }
+    }
+    fclose(file);
+    return true;
+}
+
+/**
+ * Compute the cumulative probabilities of the names, the probability of the name at rank k
+ * is proportional to 1 / k^s, so the names at the top of the file are asked for most
+ */
+bool bench_init_zipf(double exponent) {
+    bench_zipf_cdf = malloc(sizeof(double) * bench_name_count);
+    if (bench_zipf_cdf == NULL) {
+        return false;
+    }
+    double sum = 0;
+    for (int i = 0; i < bench_name_count; i++) {
+        sum += 1.0 / pow(i + 1, exponent);
+        bench_zipf_cdf[i] = sum;
+    }
+    for (int i = 0; i < bench_name_count; i++) {
+        bench_zipf_cdf[i] /= sum;
+    }
+    return true;
+}
+
+/**
+ * Pick the name of the next query
+ */
+bench_name_t *bench_pick_name() {
+    double u = bench_random();
+    if (bench_zipf_cdf == NULL) {
+        return &bench_names[(int) (u * bench_name_count)];
+    }
+
+    // The first name whose cumulative probability is above the random number
+    int low = 0, high = bench_name_count - 1;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (bench_zipf_cdf[mid] > u) {
+            high = mid;
+        }
+        else {
+            low = mid + 1;
+        }
+    }
+    return &bench_names[low];
+}
+
+/**
+ * Create a socket connected to the server
+ * @return The non-blocking socket, -1 if failed
+ */
+int bench_connect(const bench_t *bench, const struct sockaddr_in *addr) {
+    int sock = socket(PF_INET, bench->tcp ? SOCK_STREAM : SOCK_DGRAM, 0);
+    if (sock < 0) {
+        return -1;
+    }
+    if (bench->tcp) {
+        int one = 1;
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    else {
+        int size = 1024 * 1024;
+        setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    }
+    if (connect(sock, (const struct sockaddr *) addr, sizeof(*addr)) < 0 ||
+        fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK) < 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+/**
+ * Send a query on the slot
+ * @param start The time the query is scheduled
+ * @return False if the query cannot be sent
+ */
+bool bench_send(bench_t *bench, int slot_index, long start) {
+    bench_slot_t *slot = &bench_slots[slot_index];
+    bench_name_t *name = bench_pick_name();
+
+    while (bench_slot_by_id[bench_next_id] >= 0) {
+        bench_next_id++;
+    }
+    uint16 id = bench_next_id++;
+    name->data[2] = (uint8) (id >> 8);
+    name->data[3] = (uint8) id;
+
+    ssize_t length = bench->tcp ? send(slot->fd, name->data, name->length + 2, MSG_NOSIGNAL)
+                                : send(slot->fd, &name->data[2], name->length, 0);
+    if (length != (bench->tcp ? name->length + 2 : name->length)) {
+        return false;
+    }
+
+    slot->outstanding = true;
+    slot->id = id;
+    slot->start = start;
+    bench_slot_by_id[id] = slot_index;
+    bench_in_flight++;
+    return true;
+}
+
+/**
+ * Finish the query in flight on the slot, the slot can be used by the next query
+ */
+void bench_release(int slot_index) {
+    bench_slot_t *slot = &bench_slots[slot_index];
+    bench_slot_by_id[slot->id] = -1;
+    slot->outstanding = false;
+    bench_in_flight--;
+    bench_free[bench_free_count++] = slot_index;
+}
+
+/**
+ * Match a response with its query and record its latency
+ * @param fd The socket the response is received on
+ */
+void bench_handle_response(bench_t *bench, int fd, ptr_t data, int length, long now) {
+    dns_header_t header;
+    struct dns_buffer buffer;
+    DNS_buffer_init(&buffer, data, length);
+    if (length < (int) sizeof(dns_header_t) || !DNS_buffer_read_DNS_header(&buffer, &header) || !header.qr) {
+        return;
+    }
+
+    int slot_index = bench_slot_by_id[header.id];
+    if (slot_index < 0 || bench_slots[slot_index].fd != fd) {
+        bench->late++;
+        return;
+    }
+    DNS_histogram_record(&bench->latency, (unsigned long) (now - bench_slots[slot_index].start));
+    bench->answered++;
+    bench->rcodes[header.rcode & (RCODE_COUNT - 1)]++;
+    bench_release(slot_index);
+}
+
+/**
+ * Receive the responses on a UDP socket
+ */
+void bench_read_udp(bench_t *bench, int fd) {
+    uint8 data[BUFFER_SIZE];
+    ssize_t length;
+    while ((length = recv(fd, data, sizeof(data), 0)) >= 0) {
+        bench_handle_response(bench, fd, data, (int) length, bench_now());
+    }
+}
+
+/**
+ * Receive the responses on the TCP connection of the slot. If the connection is closed,
+ * the query in flight fails and the slot connects again
+ */
+void bench_read_tcp(bench_t *bench, int slot_index, int epoll, const struct sockaddr_in *addr) {
+    bench_slot_t *slot = &bench_slots[slot_index];
+    ssize_t length;
+    while ((length = recv(slot->fd, &slot->buffer[slot->received], sizeof(slot->buffer) - slot->received, 0)) > 0) {
+        slot->received += (int) length;
+
+        // Handle all the messages received, a late response may come before the expected one
+        while (slot->received >= 2) {
+            int size = (slot->buffer[0] << 8) | slot->buffer[1];
+            if (size > BUFFER_SIZE) {
+                length = 0;     // The message cannot be handled, close the connection
+                break;
+            }
+            if (slot->received < size + 2) {
+                break;
+            }
+            bench_handle_response(bench, slot->fd, &slot->buffer[2], size, bench_now());
+            slot->received -= size + 2;
+            memmove(slot->buffer, &slot->buffer[size + 2], slot->received);
+        }
+        if (length == 0) {
+            break;
+        }
+    }
+    if (length < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return;
+    }
+
+    epoll_ctl(epoll, EPOLL_CTL_DEL, slot->fd, NULL);
+    close(slot->fd);
+    if (slot->outstanding) {
+        bench->errors++;
+        bench_slot_by_id[slot->id] = -1;
+        slot->outstanding = false;
+        bench_in_flight--;
+    }
+    slot->received = 0;
+    slot->fd = bench_connect(bench, addr);
+    struct epoll_event event = {.events = EPOLLIN, .data.u32 = (uint32) slot_index};
+    if (slot->fd < 0 || epoll_ctl(epoll, EPOLL_CTL_ADD, slot->fd, &event) < 0) {
+        DNS_log_error("[ dns_bench  ] Connection %d is closed by the server and cannot be reopened.", slot_index);
+        return;     // The slot is not used any more
+    }
+    bench_free[bench_free_count++] = slot_index;
+}
+
+/**
+ * Count the queries timed out, their slots are used by the following queries
+ */
+void bench_expire(bench_t *bench, long now) {
+    for (int i = 0; i < bench->concurrency; i++) {
+        if (bench_slots[i].outstanding && now - bench_slots[i].start >= bench->timeout) {
+            bench->timeouts++;
+            bench_release(i);
+        }
+    }
+}
+
+/**
+ * Get the interval before the next query of a rate-limited benchmark. The open-loop arrivals
+ * are a Poisson process, and the closed-loop queries are evenly spaced
+ * @return The interval in nanoseconds
+ */
+long bench_interval(const bench_t *bench) {
+    if (bench->open_loop) {
+        return (long) (-log(1.0 - bench_random()) / bench->qps * 1e9);
+    }
+    return (long) (1e9 / bench->qps);
+}
+
+/**
+ * Run the benchmark
+ * @return False if the sockets cannot be created
+ */
+bool bench_run(bench_t *bench, const struct sockaddr_in *addr) {
+    int epoll = epoll_create1(0);
+    if (epoll < 0) {
+        return false;
+    }
+    memset(bench_slot_by_id, -1, sizeof(bench_slot_by_id));
+
+    // Over UDP the slots share a few sockets, and the responses are matched by the ID
+    int sockets = bench->tcp ? bench->concurrency : (bench->concurrency < UDP_SOCKETS ? bench->concurrency : UDP_SOCKETS);
+    for (int i = 0; i < bench->concurrency; i++) {
+        if (i < sockets) {
+            bench_slots[i].fd = bench_connect(bench, addr);
+            struct epoll_event event = {.events = EPOLLIN, .data.u32 = (uint32) i};
+            if (bench_slots[i].fd < 0 || epoll_ctl(epoll, EPOLL_CTL_ADD, bench_slots[i].fd, &event) < 0) {
+                DNS_log_error("[ dns_bench  ] Failed to connect to %s#%hu.", bench->server, bench->port);
+                return false;
+            }
+        }
+        else {
+            bench_slots[i].fd = bench_slots[i % sockets].fd;
+        }
+        bench_free[bench_free_count++] = bench->concurrency - 1 - i;
+    }
+
+    long begin = bench_now();
+    long stop = begin + (long) (bench->duration * 1e9);
+    long next_send = begin;
+    long next_scan = begin + TIMEOUT_SCAN_NS;
+    struct epoll_event events[EVENT_BATCH_SIZE];
+
+    while (true) {
+        long now = bench_now();
+        bool sending = now < stop && (bench->max_queries == 0 || bench->sent < bench->max_queries);
+
+        // Send the queries due, as long as there are free slots
+        while (sending && bench_free_count > 0 && (bench->qps == 0 || next_send <= now)) {
+            int slot_index = bench_free[--bench_free_count];
+            if (bench_send(bench, slot_index, bench->open_loop ? next_send : now)) {
+                bench->sent++;
+            }
+            else {
+                bench->errors++;
+                bench_free[bench_free_count++] = slot_index;
+            }
+            if (bench->qps > 0) {
+                next_send += bench_interval(bench);
+                if (!bench->open_loop && now - next_send > MAX_CATCH_UP_NS) {
+                    next_send = now;
+                }
+            }
+            sending = bench->max_queries == 0 || bench->sent < bench->max_queries;
+        }
+
+        if (!sending && bench_in_flight == 0) {
+            break;
+        }
+
+        // Wait for the responses until the next query is due or the timeouts are checked
+        long wake = next_scan;
+        if (sending && bench_free_count > 0 && next_send < wake) {
+            wake = next_send;
+        }
+        int wait_ms = wake > now ? (int) ((wake - now) / 1000000) : 0;
+        int count = epoll_wait(epoll, events, EVENT_BATCH_SIZE, wait_ms);
+        for (int i = 0; i < count; i++) {
+            if (bench->tcp) {
+                bench_read_tcp(bench, (int) events[i].data.u32, epoll, addr);
+            }
+            else {
+                bench_read_udp(bench, bench_slots[events[i].data.u32].fd);
+            }
+        }
+
+        now = bench_now();
+        if (now >= next_scan) {
+            bench_expire(bench, now);
+            next_scan = now + TIMEOUT_SCAN_NS;
+        }
+    }
+
+    bench->elapsed = (double) (bench_now() - begin) / 1e9;
+    for (int i = 0; i < sockets; i++) {
+        if (bench_slots[i].fd >= 0) {
+            close(bench_slots[i].fd);
+        }
+    }
+    close(epoll);
+    return true;
+}
+
+/**
+ * Print the results of the benchmark as text
+ */
+void bench_print_text(const bench_t *bench) {
+    const dns_histogram_t *h = &bench->latency;
+    printf("Server:       %s#%hu over %s\n", bench->server, bench->port, bench->tcp ? "TCP" : "UDP");
+    if (bench->qps > 0) {
+        printf("Load:         %s loop, %d in flight at most, %.0f qps target\n", bench->open_loop ? "open" : "closed",
+               bench->concurrency, bench->qps);
+    }
+    else {
+        printf("Load:         closed loop, %d in flight\n", bench->concurrency);
+    }
+    printf("Queries:      %lu sent, %lu answered, %lu timeouts, %lu errors, %lu late\n", bench->sent,
+           bench->answered, bench->timeouts, bench->errors, bench->late);
+    printf("Throughput:   %.1f qps in %.2f s\n", bench->answered / bench->elapsed, bench->elapsed);
+    printf("Latency (us): min %.1f, mean %.1f, p50 %.1f, p90 %.1f, p99 %.1f, p99.9 %.1f, max %.1f\n",
+           h->min / 1e3, DNS_histogram_mean(h) / 1e3, DNS_histogram_percentile(h, 50) / 1e3,
+           DNS_histogram_percentile(h, 90) / 1e3, DNS_histogram_percentile(h, 99) / 1e3,
+           DNS_histogram_percentile(h, 99.9) / 1e3, h->max / 1e3);
+    printf("Rcodes:      ");
+    if (bench->answered == 0) {
+        printf(" none");
+    }
+    for (int i = 0; i < RCODE_COUNT; i++) {
+        if (bench->rcodes[i] > 0) {
+            if (bench_rcode_names[i] != NULL) {
+                printf(" %s %lu", bench_rcode_names[i], bench->rcodes[i]);
+            }
+            else {
+                printf(" RCODE%d %lu", i, bench->rcodes[i]);
+            }
+        }
+    }
+    printf("\n");
+}
+
+/**
+ * Print the results of the benchmark as JSON, the latencies are in microseconds
+ */
+void bench_print_json(const bench_t *bench) {
+    const dns_histogram_t *h = &bench->latency;
+    printf("{\"server\": \"%s\", \"port\": %hu, \"protocol\": \"%s\", \"mode\": \"%s\", \"concurrency\": %d, "
+           "\"target_qps\": %.0f, ", bench->server, bench->port, bench->tcp ? "tcp" : "udp",
+           bench->open_loop ? "open" : "closed", bench->concurrency, bench->qps);
+    printf("\"duration\": %.3f, \"sent\": %lu, \"answered\": %lu, \"timeouts\": %lu, \"errors\": %lu, \"late\": %lu, "
+           "\"qps\": %.1f, ", bench->elapsed, bench->sent, bench->answered, bench->timeouts, bench->errors,
+           bench->late, bench->answered / bench->elapsed);
+    printf("\"latency_us\": {\"min\": %.1f, \"mean\": %.1f, \"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, "
+           "\"p99.9\": %.1f, \"max\": %.1f}, ", h->min / 1e3, DNS_histogram_mean(h) / 1e3,
+           DNS_histogram_percentile(h, 50) / 1e3, DNS_histogram_percentile(h, 90) / 1e3,
+           DNS_histogram_percentile(h, 99) / 1e3, DNS_histogram_percentile(h, 99.9) / 1e3, h->max / 1e3);
+    printf("\"rcodes\": {");
+    bool first = true;
+    for (int i = 0; i < RCODE_COUNT; i++) {
+        if (bench->rcodes[i] > 0) {
+            if (bench_rcode_names[i] != NULL) {
+                printf("%s\"%s\": %lu", first ? "" : ", ", bench_rcode_names[i], bench->rcodes[i]);
+            }
+            else {
+                printf("%s\"RCODE%d\": %lu", first ? "" : ", ", i, bench->rcodes[i]);
+            }
+            first = false;
+        }
+    }
+    printf("}}\n");
+}
+
+/**
+ * Main entry of the load generator
+ * Usage: dns_bench <server> [options], the server is one of local, root, s1 to s4, or an IPv4 address
+ */
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        DNS_log_error("[ dns_bench  ] Missing server argument! Usage: dns_bench <server> [options]\n");
+        return -1;
+    }
+
+    bench_t bench;
+    memset(&bench, 0, sizeof(bench));
+    bench.port = DNS_PORT;
+    bench.concurrency = DEFAULT_CONCURRENCY;
+    bench.duration = DEFAULT_DURATION;
+    bench.timeout = DEFAULT_TIMEOUT * 1000000L;
+    const char *names_path = NULL;
+
+    const char *modes[] = {"local", "root", "s1", "s2", "s3", "s4"};
+    const char *addresses[] = {LOCAL_DNS_IP, ROOT_DNS_IP, DNS_1_IP, DNS_2_IP, DNS_3_IP, DNS_4_IP};
+    bench.server = argv[1];
+    for (int i = 0; i < (int) (sizeof(modes) / sizeof(modes[0])); i++) {
+        if (!strcmp(argv[1], modes[i])) {
+            bench.server = addresses[i];
+        }
+    }
+
+    for (int i = 2; i < argc; i++) {
+        if (!strcmp(argv[i], "--tcp")) {
+            bench.tcp = true;
+        }
+        else if (!strcmp(argv[i], "--open-loop")) {
+            bench.open_loop = true;
+        }
+        else if (!strcmp(argv[i], "--json")) {
+            bench.json = true;
+        }
+        else if (!strcmp(argv[i], "--port") && i + 1 < argc) {
+            bench.port = (uint16) atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--concurrency") && i + 1 < argc) {
+            bench.concurrency = atoi(argv[++i]);
+            if (bench.concurrency <= 0 || bench.concurrency > MAX_CONCURRENCY) {
+                DNS_log_error("[ dns_bench  ] Invalid concurrency '%s', should be between 1 and %d.\n", argv[i],
+                              MAX_CONCURRENCY);
+                return -1;
+            }
+        }
+        else if (!strcmp(argv[i], "--qps") && i + 1 < argc) {
+            bench.qps = atof(argv[++i]);
+            if (bench.qps <= 0) {
+                DNS_log_error("[ dns_bench  ] Invalid rate '%s', should be a positive number of queries per second.\n",
+                              argv[i]);
+                return -1;
+            }
+        }
+        else if (!strcmp(argv[i], "--duration") && i + 1 < argc) {
+            bench.duration = atof(argv[++i]);
+            if (bench.duration <= 0) {
+                DNS_log_error("[ dns_bench  ] Invalid duration '%s', should be a positive number of seconds.\n",
+                              argv[i]);
+                return -1;
+            }
+        }
+        else if (!strcmp(argv[i], "--queries") && i + 1 < argc) {
+            bench.max_queries = strtoul(argv[++i], NULL, 10);
+        }
+        else if (!strcmp(argv[i], "--timeout") && i + 1 < argc) {
+            bench.timeout = atol(argv[++i]) * 1000000L;
+            if (bench.timeout <= 0) {
+                DNS_log_error("[ dns_bench  ] Invalid timeout '%s', should be a positive number of milliseconds.\n",
+                              argv[i]);
+                return -1;
+            }
+        }
+        else if (!strcmp(argv[i], "--names") && i + 1 < argc) {
+            names_path = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--zipf") && i + 1 < argc) {
+            bench.zipf = atof(argv[++i]);
+            if (bench.zipf <= 0) {
+                DNS_log_error("[ dns_bench  ] Invalid Zipf exponent '%s', should be a positive number.\n", argv[i]);
+                return -1;
+            }
+        }
+        else {
+            DNS_log_error("[ dns_bench  ] Unknown option '%s', supported options: --tcp, --concurrency <N>, "
+                          "--qps <rate>, --open-loop, --duration <seconds>, --queries <N>, --timeout <ms>, "
+                          "--names <file>, --zipf <exponent>, --port <port>, --json.\n", argv[i]);
+            return -1;
+        }
+    }
+    if (bench.open_loop && bench.qps == 0) {
+        DNS_log_error("[ dns_bench  ] The rate of the open loop should be given with --qps.\n");
+        return -1;
+    }
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(bench.port);
+    if (inet_pton(AF_INET, bench.server, &addr.sin_addr) != 1) {
+        DNS_log_error("[ dns_bench  ] Invalid server '%s', should be local, root, s1 to s4 or an IPv4 address.\n",
+                      bench.server);
+        return -1;
+    }
+
+    if (names_path != NULL) {
+        if (!bench_load_names(names_path)) {
+            return -1;
+        }
+    }
+    else {
+        for (int i = 0; i < (int) (sizeof(bench_default_names) / sizeof(bench_default_names[0])); i++) {
+            bench_add_name(bench_default_names[i]);
+        }
+    }
+    if (bench_name_count == 0) {
+        DNS_log_error("[ dns_bench  ] No names to query.\n");
+        return -1;
+    }
+    if (bench.zipf > 0 && !bench_init_zipf(bench.zipf)) {
+        DNS_log_error("[ dns_bench  ] Cannot create the Zipf distribution, out of memory.\n");
+        return -1;
+    }
+    bench_random_state ^= (unsigned long long) bench_now();
+
+    DNS_histogram_reset(&bench.latency);
+    if (!bench_run(&bench, &addr)) {
+        return -1;
+    }
+
+    if (bench.json) {
+        bench_print_json(&bench);
+    }
+    else {
+        bench_print_text(&bench);
+    }
+    return 0;
+}
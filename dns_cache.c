@@ -0,0 +1,642 @@
+//
+// dns_cache.c -- Implementation of the local cache. The cache is divided into shards with their own
+//                locks, and each shard is a hash table of RRsets keyed by (lowercased name, type, class).
+//                The RRsets expire at an absolute time, and are evicted with the CLOCK algorithm
+//                when the memory limit of the shard is reached. The expired RRsets can be kept for a
+//                while to be served stale when they cannot be resolved again in time, and the RRsets
+//                near expiry can be refreshed in advance.
+//                The negative answers are cached in the same table, with the SOA record as the RRset
+// Created on 10/15/26.
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "dns_common.h"
+#include "dns_database.h"
+#include "dns_cache.h"
+#include "dns_latency.h"
+
+#define CACHE_SHARD_COUNT  16    // The number of shards, should be power of 2
+#define CACHE_INIT_BUCKETS 64    // The initial number of buckets of each shard, should be power of 2
+#define CACHE_NAME_LEN     256   // The maximum length of the names in the cache
+#define CACHE_STALE_TTL    30    // The TTL of the stale RRs served to the clients (RFC 8767)
+#define CACHE_REFRESH_RETRY 5    // The seconds before a failed refresh of an RRset is retried
+#define CACHE_PREFETCH_HITS 2    // The number of hits before an RRset is popular enough to be prefetched
+#define CACHE_NEGATIVE_MAX_TTL 900   // The maximum TTL of the negative answers
+
+/**
+ * One cached RRset
+ */
+typedef struct cache_entry {
+    char *name;                       // The lowercased owner name
+    uint16 type;
+    uint16 class;
+    dns_rr_t *rrset;                  // The RRs of this set, linked with their next field
+    bool negative;                    // Whether the entry is a negative answer, the RRset is its SOA record
+    int rcode;                        // The response code of the negative answer
+    time_t expire;                    // The absolute time when the RRset expires
+    uint32 ttl;                       // The TTL of the RRset when it was cached
+    unsigned long hits;
+    time_t refreshing;                // When the refresh of the RRset started, 0 if not refreshing
+    unsigned long size;               // The memory taken by the entry and its RRs
+    bool referenced;                  // Set when the entry is used, cleared by the CLOCK hand
+
+    struct cache_entry *next;         // The next entry in the same bucket
+    struct cache_entry *clock_prev;   // The entries of a shard form a ring for the CLOCK algorithm
+    struct cache_entry *clock_next;
+} cache_entry_t;
+
+/**
+ * One shard of the cache, protected by its own lock
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    cache_entry_t **buckets;
+    uint32 bucket_count;
+    uint32 entry_count;
+    unsigned long size;               // The memory taken by all the entries of the shard
+    cache_entry_t *hand;              // The CLOCK hand, NULL if the shard is empty
+} cache_shard_t;
+
+cache_shard_t cache_shards[CACHE_SHARD_COUNT];
+unsigned long cache_shard_max_bytes = 0;
+bool cache_persist = false;
+int cache_prefetch_percent = 0;
+int cache_stale_seconds = 0;
+
+/**
+ * Create a copy of the RR owned by the cache, the RR and its strings are allocated in one block
+ * @param rr The RR to be copied
+ * @param size The size of the allocated memory
+ * @return The copy, NULL if out of memory
+ */
+dns_rr_t *cache_rr_create(dns_rr_t *rr, unsigned long *size) {
+    size_t name_len = strlen(rr->name) + 1;
+    size_t data_len = DNS_RR_rdata_names_size(rr);
+    *size = sizeof(dns_rr_t) + name_len + data_len;
+
+    dns_rr_t *copy = (dns_rr_t *) malloc(*size);
+    if (copy == NULL) {
+        DNS_log_error("[  dns_cache ] Cannot create cache entry, out of memory.");
+        return NULL;
+    }
+
+    *copy = *rr;
+    copy->name = (ptr_t) (copy + 1);
+    memcpy(copy->name, rr->name, name_len);
+    if (data_len > 0) {
+        copy->rdata.name = copy->name + name_len;
+        DNS_RR_copy_rdata(copy, rr);
+    }
+    copy->wire = NULL;      // The TTL of the cached RRs changes, so they cannot be pre-encoded
+    copy->next = NULL;
+    return copy;
+}
+
+/**
+ * Check whether the RR belongs to the RRset
+ * @param name The lowercased name of the RRset
+ */
+bool cache_in_rrset(const dns_rr_t *rr, const char *name, uint16 type, uint16 class) {
+    char lower[CACHE_NAME_LEN];
+    DNS_name_to_lower(lower, rr->name, CACHE_NAME_LEN);
+    return rr->type == type && rr->class == class && !strcmp(lower, name);
+}
+
+/**
+ * Release the RRs created by {@code cache_rr_create} and linked with their next field
+ */
+void cache_free_rrs(dns_rr_t *rrs) {
+    dns_rr_t *next;
+    for (dns_rr_t *t = rrs; t != NULL; t = next) {
+        next = t->next;
+        free(t);
+    }
+}
+
+/**
+ * Find the entry in the shard, the shard should be locked
+ * @param name The lowercased name
+ */
+cache_entry_t *cache_find(cache_shard_t *shard, uint32 hash, const char *name, uint16 type, uint16 class) {
+    cache_entry_t *e = shard->buckets[hash & (shard->bucket_count - 1)];
+    for (; e != NULL; e = e->next) {
+        if (e->type == type && e->class == class && !strcmp(e->name, name)) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Insert the entry into the clock right behind the hand, so it will be checked last
+ */
+void cache_clock_link(cache_shard_t *shard, cache_entry_t *e) {
+    if (shard->hand == NULL) {
+        e->clock_prev = e;
+        e->clock_next = e;
+        shard->hand = e;
+    }
+    else {
+        e->clock_next = shard->hand;
+        e->clock_prev = shard->hand->clock_prev;
+        e->clock_prev->clock_next = e;
+        shard->hand->clock_prev = e;
+    }
+}
+
+/**
+ * Take the entry out of the clock, the hand is moved to the next entry if it points to the entry
+ */
+void cache_clock_unlink(cache_shard_t *shard, cache_entry_t *e) {
+    if (e->clock_next == e) {
+        shard->hand = NULL;
+    }
+    else {
+        e->clock_prev->clock_next = e->clock_next;
+        e->clock_next->clock_prev = e->clock_prev;
+        if (shard->hand == e) {
+            shard->hand = e->clock_next;
+        }
+    }
+}
+
+/**
+ * Remove the entry from the shard and release its memory, the shard should be locked
+ */
+void cache_remove(cache_shard_t *shard, cache_entry_t *e) {
+    uint32 index = DNS_name_hash(e->name, e->type, e->class) & (shard->bucket_count - 1);
+    cache_entry_t **p = &shard->buckets[index];
+    while (*p != e) {
+        p = &(*p)->next;
+    }
+    *p = e->next;
+    cache_clock_unlink(shard, e);
+    cache_free_rrs(e->rrset);
+
+    shard->entry_count--;
+    shard->size -= e->size;
+    free(e->name);
+    free(e);
+}
+
+/**
+ * Evict entries with the CLOCK algorithm until the shard have enough space.
+ * Expired entries and entries not referenced since the last pass of the hand are evicted,
+ * the shard should be locked
+ * @param size The size required by the new entry
+ */
+void cache_evict(cache_shard_t *shard, unsigned long size, time_t now) {
+    while (shard->hand != NULL && shard->size + size > cache_shard_max_bytes) {
+        cache_entry_t *e = shard->hand;
+        if (e->expire <= now || !e->referenced) {
+            cache_remove(shard, e);
+        }
+        else {
+            e->referenced = false;
+            shard->hand = e->clock_next;
+        }
+    }
+}
+
+/**
+ * Double the bucket count of the shard when there are too many entries, the shard should be locked
+ */
+void cache_resize(cache_shard_t *shard) {
+    uint32 count = shard->bucket_count * 2;
+    cache_entry_t **buckets = (cache_entry_t **) calloc(count, sizeof(cache_entry_t *));
+    if (buckets == NULL) {
+        return;
+    }
+
+    for (uint32 i = 0; i < shard->bucket_count; i++) {
+        cache_entry_t *next;
+        for (cache_entry_t *e = shard->buckets[i]; e != NULL; e = next) {
+            next = e->next;
+            uint32 index = DNS_name_hash(e->name, e->type, e->class) & (count - 1);
+            e->next = buckets[index];
+            buckets[index] = e;
+        }
+    }
+
+    free(shard->buckets);
+    shard->buckets = buckets;
+    shard->bucket_count = count;
+}
+
+/**
+ * Create an entry for a new RRset in the shard, the shard should be locked
+ * @param name The lowercased name
+ * @param copy The RRs of the RRset created by {@code cache_rr_create}, released if failed
+ * @param rr_size The size of the RRs
+ * @param ttl The TTL of the RRset
+ * @return The entry, NULL if failed
+ */
+cache_entry_t *cache_add_entry(cache_shard_t *shard, uint32 hash, const char *name, uint16 type, uint16 class,
+                               dns_rr_t *copy, unsigned long rr_size, uint32 ttl, time_t now) {
+    unsigned long size = sizeof(cache_entry_t) + strlen(name) + 1 + rr_size;
+    if (size > cache_shard_max_bytes) {
+        cache_free_rrs(copy);
+        return NULL;
+    }
+    cache_evict(shard, size, now);
+
+    cache_entry_t *e = (cache_entry_t *) malloc(sizeof(cache_entry_t));
+    if (e == NULL) {
+        DNS_log_error("[  dns_cache ] Cannot create cache entry, out of memory.");
+        cache_free_rrs(copy);
+        return NULL;
+    }
+    e->name = (char *) malloc(strlen(name) + 1);
+    strcpy(e->name, name);
+    e->type = type;
+    e->class = class;
+    e->rrset = copy;
+    e->negative = false;
+    e->rcode = R_NO_ERROR;
+    e->expire = now + ttl;
+    e->ttl = ttl;
+    e->hits = 0;
+    e->refreshing = 0;
+    e->size = size;
+    e->referenced = false;
+
+    if (shard->entry_count >= shard->bucket_count) {
+        cache_resize(shard);
+    }
+    uint32 index = hash & (shard->bucket_count - 1);
+    e->next = shard->buckets[index];
+    shard->buckets[index] = e;
+
+    cache_clock_link(shard, e);
+
+    shard->entry_count++;
+    shard->size += size;
+    return e;
+}
+
+/**
+ * Add an RR to the cache, see {@code DNS_cache_put}
+ * @param rr The RR to be cached
+ * @param now The current time
+ * @return True if the RR is added to the cache
+ */
+bool cache_insert(dns_rr_t *rr, time_t now) {
+    char name[CACHE_NAME_LEN];
+    DNS_name_to_lower(name, rr->name, CACHE_NAME_LEN);
+    uint32 hash = DNS_name_hash(name, rr->type, rr->class);
+    cache_shard_t *shard = &cache_shards[(hash >> 24) & (CACHE_SHARD_COUNT - 1)];
+
+    unsigned long rr_size;
+    dns_rr_t *copy = cache_rr_create(rr, &rr_size);
+    if (copy == NULL) {
+        return false;
+    }
+
+    pthread_mutex_lock(&shard->lock);
+
+    cache_entry_t *e = cache_find(shard, hash, name, rr->type, rr->class);
+    if (e != NULL && (e->expire <= now || e->negative)) {
+        // The expired or negative RRset will be replaced by the new one
+        cache_remove(shard, e);
+        e = NULL;
+    }
+
+    if (e != NULL) {
+        dns_rr_t *last = NULL;
+        for (dns_rr_t *t = e->rrset; t != NULL; t = t->next) {
+            if (DNS_RR_rdata_equals(t, copy)) {
+                // Duplicated RR is ignored
+                e->referenced = true;
+                pthread_mutex_unlock(&shard->lock);
+                free(copy);
+                return false;
+            }
+            last = t;
+        }
+
+        if (e->size + rr_size > cache_shard_max_bytes) {
+            // The RRset is too large for the cache, and should not be served without some of its RRs
+            cache_remove(shard, e);
+            pthread_mutex_unlock(&shard->lock);
+            free(copy);
+            return false;
+        }
+        // The RRset grows, so make room for the RR without evicting the RRset itself
+        cache_clock_unlink(shard, e);
+        cache_evict(shard, rr_size, now);
+        cache_clock_link(shard, e);
+
+        // All the RRs of an RRset should have the same TTL, the smallest one is used
+        last->next = copy;
+        if (now + rr->ttl < e->expire) {
+            e->expire = now + rr->ttl;
+            e->ttl = rr->ttl;
+        }
+        e->size += rr_size;
+        shard->size += rr_size;
+        pthread_mutex_unlock(&shard->lock);
+        return true;
+    }
+
+    bool success = cache_add_entry(shard, hash, name, rr->type, rr->class, copy, rr_size, rr->ttl, now) != NULL;
+    pthread_mutex_unlock(&shard->lock);
+    return success;
+}
+
+/**
+ * Check whether the RRset should be refreshed in advance, the RRset should be popular
+ * and in the last part of its TTL
+ */
+bool cache_should_prefetch(cache_entry_t *e, time_t now) {
+    return cache_prefetch_percent > 0 && e->hits >= CACHE_PREFETCH_HITS &&
+           (e->expire - now) * 100 <= (time_t) e->ttl * cache_prefetch_percent;
+}
+
+/**
+ * Copy the RRs of the RRset in the shard and append them to the list
+ * @param first The first node of the list
+ * @param last The last node of the list
+ * @param stale_ok Whether the RRsets expired within the serve-stale window are returned
+ * @param refresh Set if the RRset should be prefetched, can be NULL
+ */
+void cache_copy_rrset(cache_shard_t *shard, const char *name, uint16 type, uint16 class, time_t now,
+                      dns_rr_t **first, dns_rr_t **last, bool stale_ok, bool *refresh) {
+    uint32 hash = DNS_name_hash(name, type, class);
+    cache_entry_t *e = cache_find(shard, hash, name, type, class);
+    if (e == NULL) {
+        return;
+    }
+
+    bool stale = e->expire <= now;
+    if (stale && (e->negative || now >= e->expire + cache_stale_seconds)) {
+        // The negative answers are never served stale
+        cache_remove(shard, e);
+        return;
+    }
+    if ((stale && !stale_ok) || e->negative) {
+        return;
+    }
+
+    e->referenced = true;
+    e->hits++;
+    if (refresh != NULL && !stale && cache_should_prefetch(e, now) &&
+        (e->refreshing == 0 || now - e->refreshing >= CACHE_REFRESH_RETRY)) {
+        // Only one of the clients hitting the RRset starts the refresh
+        e->refreshing = now;
+        *refresh = true;
+    }
+
+    for (dns_rr_t *t = e->rrset; t != NULL; t = t->next) {
+        dns_rr_t *copy = DNS_RR_copy(t);
+        copy->ttl = stale ? CACHE_STALE_TTL : (uint32) (e->expire - now);   // The TTL counts down as the time passes
+        if (*first == NULL) {
+            *first = copy;
+        }
+        else {
+            (*last)->next = copy;
+        }
+        *last = copy;
+    }
+}
+
+bool DNS_cache_init(unsigned long max_bytes, bool persist) {
+    cache_shard_max_bytes = max_bytes / CACHE_SHARD_COUNT;
+    cache_persist = persist;
+
+    for (int i = 0; i < CACHE_SHARD_COUNT; i++) {
+        cache_shard_t *shard = &cache_shards[i];
+        pthread_mutex_init(&shard->lock, NULL);
+        shard->buckets = (cache_entry_t **) calloc(CACHE_INIT_BUCKETS, sizeof(cache_entry_t *));
+        if (shard->buckets == NULL) {
+            DNS_log_error("[  dns_cache ] Cannot create cache, out of memory.");
+            return false;
+        }
+        shard->bucket_count = CACHE_INIT_BUCKETS;
+        shard->entry_count = 0;
+        shard->size = 0;
+        shard->hand = NULL;
+    }
+
+    if (persist) {
+        int count = 0;
+        time_t now = time(NULL);
+        for (dns_rr_t *t = DNS_database_load_cache(); t != NULL; t = t->next) {
+            if (cache_insert(t, now)) {
+                count++;
+            }
+        }
+        DNS_log_info("Loaded %d records from the database into the cache", count);
+    }
+
+    return true;
+}
+
+void DNS_cache_set_prefetch(int percent) {
+    cache_prefetch_percent = percent;
+}
+
+void DNS_cache_set_serve_stale(int seconds) {
+    cache_stale_seconds = seconds;
+}
+
+void DNS_cache_get_usage(unsigned long *entries, unsigned long *bytes) {
+    *entries = 0;
+    *bytes = 0;
+    if (cache_shard_max_bytes == 0) {
+        return;
+    }
+    for (int i = 0; i < CACHE_SHARD_COUNT; i++) {
+        cache_shard_t *shard = &cache_shards[i];
+        pthread_mutex_lock(&shard->lock);
+        *entries += shard->entry_count;
+        *bytes += shard->size;
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+dns_rr_t *DNS_cache_get(char *name, int type, int class) {
+    return DNS_cache_lookup(name, type, class, NULL);
+}
+
+/**
+ * Look up the RRset and the CNAME records of the name, see {@code DNS_cache_lookup}
+ * @param stale_ok Whether the RRsets expired within the serve-stale window are returned
+ */
+dns_rr_t *cache_lookup(char *name, int type, int class, bool stale_ok, bool *refresh) {
+    unsigned long start = DNS_latency_start();
+    char lower[CACHE_NAME_LEN];
+    DNS_name_to_lower(lower, name, CACHE_NAME_LEN);
+    time_t now = time(NULL);
+    dns_rr_t *first = NULL, *last = NULL;
+
+    uint32 hash = DNS_name_hash(lower, (uint16) type, (uint16) class);
+    cache_shard_t *shard = &cache_shards[(hash >> 24) & (CACHE_SHARD_COUNT - 1)];
+    pthread_mutex_lock(&shard->lock);
+    cache_copy_rrset(shard, lower, (uint16) type, (uint16) class, now, &first, &last, stale_ok, refresh);
+    pthread_mutex_unlock(&shard->lock);
+
+    if (type != TYPE_CNAME) {
+        hash = DNS_name_hash(lower, TYPE_CNAME, (uint16) class);
+        shard = &cache_shards[(hash >> 24) & (CACHE_SHARD_COUNT - 1)];
+        pthread_mutex_lock(&shard->lock);
+        cache_copy_rrset(shard, lower, TYPE_CNAME, (uint16) class, now, &first, &last, stale_ok, refresh);
+        pthread_mutex_unlock(&shard->lock);
+    }
+
+    DNS_latency_end(LATENCY_CACHE, start);
+    return first;
+}
+
+dns_rr_t *DNS_cache_lookup(char *name, int type, int class, bool *refresh) {
+    return cache_lookup(name, type, class, false, refresh);
+}
+
+dns_rr_t *DNS_cache_get_stale(char *name, int type, int class) {
+    if (cache_stale_seconds == 0) {
+        return NULL;
+    }
+    return cache_lookup(name, type, class, true, NULL);
+}
+
+dns_rr_t *DNS_cache_get_negative(char *name, int type, int class, int *rcode) {
+    unsigned long start = DNS_latency_start();
+    char lower[CACHE_NAME_LEN];
+    DNS_name_to_lower(lower, name, CACHE_NAME_LEN);
+    time_t now = time(NULL);
+    dns_rr_t *soa = NULL;
+
+    uint32 hash = DNS_name_hash(lower, (uint16) type, (uint16) class);
+    cache_shard_t *shard = &cache_shards[(hash >> 24) & (CACHE_SHARD_COUNT - 1)];
+    pthread_mutex_lock(&shard->lock);
+    cache_entry_t *e = cache_find(shard, hash, lower, (uint16) type, (uint16) class);
+    if (e != NULL && e->negative) {
+        if (e->expire <= now) {
+            cache_remove(shard, e);
+        }
+        else {
+            e->referenced = true;
+            e->hits++;
+            *rcode = e->rcode;
+            soa = DNS_RR_copy(e->rrset);
+            if (soa != NULL) {
+                soa->ttl = (uint32) (e->expire - now);
+            }
+        }
+    }
+    pthread_mutex_unlock(&shard->lock);
+    DNS_latency_end(LATENCY_CACHE, start);
+    return soa;
+}
+
+bool DNS_cache_put_negative(char *name, int type, int class, int rcode, dns_rr_t *soa) {
+    char lower[CACHE_NAME_LEN];
+    DNS_name_to_lower(lower, name, CACHE_NAME_LEN);
+    time_t now = time(NULL);
+
+    uint32 ttl = soa->ttl < soa->rdata.soa.minimum ? soa->ttl : soa->rdata.soa.minimum;
+    if (ttl > CACHE_NEGATIVE_MAX_TTL) {
+        ttl = CACHE_NEGATIVE_MAX_TTL;
+    }
+    if (ttl == 0) {
+        return false;
+    }
+
+    unsigned long rr_size;
+    dns_rr_t *copy = cache_rr_create(soa, &rr_size);
+    if (copy == NULL) {
+        return false;
+    }
+
+    uint32 hash = DNS_name_hash(lower, (uint16) type, (uint16) class);
+    cache_shard_t *shard = &cache_shards[(hash >> 24) & (CACHE_SHARD_COUNT - 1)];
+    pthread_mutex_lock(&shard->lock);
+    cache_entry_t *e = cache_find(shard, hash, lower, (uint16) type, (uint16) class);
+    if (e != NULL) {
+        cache_remove(shard, e);
+    }
+    e = cache_add_entry(shard, hash, lower, (uint16) type, (uint16) class, copy, rr_size, ttl, now);
+    if (e != NULL) {
+        e->negative = true;
+        e->rcode = rcode;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return e != NULL;
+}
+
+bool DNS_cache_replace(dns_rr_t *rrset) {
+    char name[CACHE_NAME_LEN];
+    DNS_name_to_lower(name, rrset->name, CACHE_NAME_LEN);
+    uint16 type = rrset->type, class = rrset->class;
+    time_t now = time(NULL);
+
+    // Copy the RRs of the set before locking, the duplicated ones are skipped
+    dns_rr_t *first = NULL, *last = NULL;
+    unsigned long size = 0;
+    uint32 ttl = rrset->ttl;
+    for (dns_rr_t *t = rrset; t != NULL; t = t->next) {
+        if (!cache_in_rrset(t, name, type, class)) {
+            continue;
+        }
+        bool duplicated = false;
+        for (dns_rr_t *c = first; c != NULL && !duplicated; c = c->next) {
+            duplicated = DNS_RR_rdata_equals(c, t);
+        }
+        if (duplicated) {
+            continue;
+        }
+
+        unsigned long rr_size;
+        dns_rr_t *copy = cache_rr_create(t, &rr_size);
+        if (copy == NULL) {
+            cache_free_rrs(first);
+            return false;
+        }
+        if (first == NULL) {
+            first = copy;
+        }
+        else {
+            last->next = copy;
+        }
+        last = copy;
+        size += rr_size;
+        if (t->ttl < ttl) {
+            ttl = t->ttl;
+        }
+    }
+
+    uint32 hash = DNS_name_hash(name, type, class);
+    cache_shard_t *shard = &cache_shards[(hash >> 24) & (CACHE_SHARD_COUNT - 1)];
+    pthread_mutex_lock(&shard->lock);
+    cache_entry_t *e = cache_find(shard, hash, name, type, class);
+    if (e != NULL) {
+        cache_remove(shard, e);
+    }
+    e = cache_add_entry(shard, hash, name, type, class, first, size, ttl, now);
+    pthread_mutex_unlock(&shard->lock);
+    if (e == NULL) {
+        return false;
+    }
+
+    if (cache_persist) {
+        for (dns_rr_t *t = rrset; t != NULL; t = t->next) {
+            if (cache_in_rrset(t, name, type, class)) {
+                DNS_database_put_cache(*t);
+            }
+        }
+    }
+    return true;
+}
+
+bool DNS_cache_put(dns_rr_t rr) {
+    if (!cache_insert(&rr, time(NULL))) {
+        return false;
+    }
+
+    if (cache_persist) {
+        DNS_database_put_cache(rr);
+    }
+    return true;
+}
@@ -0,0 +1,122 @@
+//
+// dns_cache.h -- In-memory cache of the Resource Records used by the local server
+// Created on 10/15/26.
+//
+
+#ifndef PROJECT_DNS_DNS_CACHE_H
+#define PROJECT_DNS_DNS_CACHE_H
+
+#include "dns_io.h"
+
+/**
+ * Initialize the cache, should be called before the local server starts
+ * @param max_bytes The maximum memory used by the cache entries, entries will be evicted when reached
+ * @param persist Whether the cache should also be written to the database. If true, the unexpired
+ *                records in the database will be loaded into the cache during initialization
+ * @return True if the cache is successfully initialized
+ */
+bool DNS_cache_init(unsigned long max_bytes, bool persist);
+
+/**
+ * Look up the cache for the records of the given name, type and class.
+ * The CNAME records of the name will also be returned.
+ * The TTL of the returned records are the remaining time before the records expire
+ * @param name The name to be looked up, matched case-insensitively
+ * @param type The type of the records
+ * @param class The class of the records
+ * @return The linked list of copies of the cached RRs, NULL if not found or expired
+ */
+dns_rr_t *DNS_cache_get(char *name, int type, int class);
+
+/**
+ * Look up the cache for the records of the given name, type and class to answer a client, like
+ * {@code DNS_cache_get}. The refresh flag is set if the records should be resolved again in the
+ * background: the RRsets are popular and in the prefetch window of their TTL.
+ * The flag is only set for one of the lookups of an RRset until the refresh is done (or given up)
+ * @param name The name to be looked up, matched case-insensitively
+ * @param type The type of the records
+ * @param class The class of the records
+ * @param refresh Set to true if the records should be refreshed, left unchanged otherwise
+ * @return The linked list of copies of the cached RRs, NULL if not found or expired
+ */
+dns_rr_t *DNS_cache_lookup(char *name, int type, int class, bool *refresh);
+
+/**
+ * Look up the cache for the records to answer the clients when they cannot be resolved again in time.
+ * With serve-stale enabled, the RRsets expired within the window are returned with a TTL of 30 seconds
+ * @param name The name to be looked up, matched case-insensitively
+ * @param type The type of the records
+ * @param class The class of the records
+ * @return The linked list of copies of the cached RRs, NULL if not found, expired beyond the window
+ *         or serve-stale is disabled
+ */
+dns_rr_t *DNS_cache_get_stale(char *name, int type, int class);
+
+/**
+ * Add an RR to the cache. The RRs with the same name, type and class are stored as one RRset,
+ * the RR will be added to the existing RRset if it is not expired, or replaces it if expired.
+ * Duplicated RRs are ignored. If persistence is enabled, the added RR is also written to the database
+ * @param rr The RR to be cached
+ * @return True if the RR is added to the cache, false if failed or the RR is already in the cache
+ */
+bool DNS_cache_put(dns_rr_t rr);
+
+/**
+ * Replace the RRset of the name, type and class of the first RR with the RRs of the list having the same
+ * name, type and class, in one step under the lock, so the clients never see part of the new RRset.
+ * Used to store the RRsets answered to the resolutions, including the refreshes of the RRsets.
+ * If persistence is enabled, the RRs are also written to the database
+ * @param rrset The first RR of the list, the list may also hold the RRs of other RRsets
+ * @return True if the RRset is replaced, false if failed
+ */
+bool DNS_cache_replace(dns_rr_t *rrset);
+
+/**
+ * Look up the cache for the negative answer of the given name, type and class, that is, the
+ * upstream servers answered that the name does not exist or has no records of the type
+ * @param name The name to be looked up, matched case-insensitively
+ * @param type The type of the records
+ * @param class The class of the records
+ * @param rcode Returns the response code of the negative answer, {@code R_NOT_EXIST} if the name
+ *              does not exist, {@code R_NO_ERROR} if it has no records of the type
+ * @return A copy of the SOA record of the negative answer with the remaining TTL, NULL if not cached or expired
+ */
+dns_rr_t *DNS_cache_get_negative(char *name, int type, int class, int *rcode);
+
+/**
+ * Add a negative answer for the name, type and class to the cache, it replaces the RRset of the
+ * name and type if there is one. The negative answer is cached for the TTL of the SOA record or
+ * its minimum TTL whichever is smaller (RFC 2308), at most 15 minutes. The negative answers are
+ * not written to the database
+ * @param name The name
+ * @param type The type of the records
+ * @param class The class of the records
+ * @param rcode The response code of the negative answer, see {@code DNS_cache_get_negative}
+ * @param soa The SOA record in the authority section of the negative answer
+ * @return True if the negative answer is added to the cache
+ */
+bool DNS_cache_put_negative(char *name, int type, int class, int rcode, dns_rr_t *soa);
+
+/**
+ * Set the prefetch window, the popular RRsets hit during the last part of their TTL are refreshed
+ * in the background, so they never expire while they are used
+ * @param percent The percentage of the TTL, 0 to disable prefetch
+ */
+void DNS_cache_set_prefetch(int percent);
+
+/**
+ * Set the serve-stale window, the RRsets are kept after they expire and served to the clients when
+ * resolving them again fails or takes too long, so the clients are answered even if the upstream servers
+ * are slow or unreachable
+ * @param seconds The seconds the RRsets are served after they expire, 0 to disable serve-stale
+ */
+void DNS_cache_set_serve_stale(int seconds);
+
+/**
+ * Get the size of the cache, all zero if the cache is not initialized
+ * @param entries Returns the number of the RRsets and negative answers cached
+ * @param bytes Returns the memory taken by them
+ */
+void DNS_cache_get_usage(unsigned long *entries, unsigned long *bytes);
+
+#endif //PROJECT_DNS_DNS_CACHE_H
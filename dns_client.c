@@ -17,21 +17,27 @@
  * @param rr The pointer to the RR
  */
 void print_RR(dns_rr_t *rr) {
+    struct in_addr addr;
     switch (rr->type) {
         case TYPE_A:
-            DNS_log_info("%10s internet address = %s", rr->name, rr->data);
+            addr.s_addr = htonl(rr->rdata.a);
+            DNS_log_info("%10s internet address = %s", rr->name, inet_ntoa(addr));
             break;
         case TYPE_MX:
-            DNS_log_info("%10s mail exchanger = %s", rr->name, rr->data);
+            DNS_log_info("%10s mail exchanger = %hu,%s", rr->name, rr->rdata.mx.preference, rr->rdata.mx.exchange);
             break;
         case TYPE_NS:
-            DNS_log_info("%10s nameserver = %s", rr->name, rr->data);
+            DNS_log_info("%10s nameserver = %s", rr->name, rr->rdata.name);
             break;
         case TYPE_CNAME:
-            DNS_log_info("%10s canonical name = %s", rr->name, rr->data);
+            DNS_log_info("%10s canonical name = %s", rr->name, rr->rdata.name);
             break;
         case TYPE_PTR:
-            DNS_log_info("%10s name = %s", rr->name, rr->data);
+            DNS_log_info("%10s name = %s", rr->name, rr->rdata.name);
+            break;
+        case TYPE_SOA:
+            DNS_log_info("%10s origin = %s, mail addr = %s, serial = %u, minimum = %u", rr->name,
+                         rr->rdata.soa.mname, rr->rdata.soa.rname, rr->rdata.soa.serial, rr->rdata.soa.minimum);
             break;
     }
 }
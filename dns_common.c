@@ -39,35 +39,55 @@
 #include <stdio.h>
 #include <stdarg.h>
 #include <string.h>
+#include <ctype.h>
 #include "dns_io.h"
 #include "dns_common.h"
 
-// The Logging macro
-#define DNS_LOG(format, color, level) \
-    char buf[LOG_BUFFER_LEN];\
-    va_list list;\
-    va_start(list, format);\
-    vsnprintf(buf, LOG_BUFFER_LEN, format, list);\
-    va_end(list);\
-    printf(color level "%s\n" COLOR_RESET, buf);\
+volatile int log_level = LOG_LEVEL_TRACE;
 
+// Takes the messages when the asynchronous logger is started, NULL if the messages are printed at once
+bool (*log_sink)(int level, const char *format, va_list args) = NULL;
 
-void DNS_log_error(const char *format, ...) {
-    DNS_LOG(format, COLOR_RED_B, "[ ERROR ] ");
+const char *log_prefixes[] = {COLOR_BLUE_B "[ TRACE ] ", COLOR_RESET "[  INFO ] ", COLOR_YELLOW_B "[WARNING] ",
+                              COLOR_RED_B "[ ERROR ] "};
+
+const char *log_level_names[] = {"trace", "info", "warning", "error"};
+
+void DNS_log_print(int level, const char *message) {
+    printf("%s%s\n" COLOR_RESET, log_prefixes[level], message);
 }
 
-void DNS_log_warning(const char *format, ...) {
-    DNS_LOG(format, COLOR_YELLOW_B, "[WARNING] ");
+void DNS_log_write(int level, const char *format, ...) {
+    va_list list;
+    va_start(list, format);
+    if (log_sink != NULL) {
+        va_list copy;
+        va_copy(copy, list);
+        bool taken = log_sink(level, format, copy);
+        va_end(copy);
+        if (taken) {
+            va_end(list);
+            return;
+        }
+    }
+
+    char buf[LOG_BUFFER_LEN];
+    vsnprintf(buf, LOG_BUFFER_LEN, format, list);
+    va_end(list);
+    DNS_log_print(level, buf);
 }
 
-void DNS_log_info(const char *format, ...) {
-    DNS_LOG(format, COLOR_RESET, "[  INFO ] ");
+void DNS_log_set_sink(bool (*sink)(int level, const char *format, va_list args)) {
+    log_sink = sink;
 }
 
-void DNS_log_trace(const char *format, ...) {
-#ifndef NOTRACE
-    DNS_LOG(format, COLOR_BLUE_B, "[ TRACE ] ");
-#endif
+int DNS_log_level_from_str(const char *str) {
+    for (int i = LOG_LEVEL_TRACE; i <= LOG_LEVEL_ERROR; i++) {
+        if (!strcmp(str, log_level_names[i])) {
+            return i;
+        }
+    }
+    return -1;
 }
 
 uint16 DNS_type_from_str(char *str) {
@@ -86,6 +106,9 @@ uint16 DNS_type_from_str(char *str) {
     else if (!strcmp(str, "CNAME")) {
         return TYPE_CNAME;
     }
+    else if (!strcmp(str, "SOA")) {
+        return TYPE_SOA;
+    }
     else {
         DNS_log_error("[ dns_common ] Unknown DNS type '%s'", str);
         return 0;
@@ -108,6 +131,9 @@ char *DNS_type_to_str(uint16 type) {
     else if (type == TYPE_CNAME) {
         return "CNAME";
     }
+    else if (type == TYPE_SOA) {
+        return "SOA";
+    }
     else {
         DNS_log_error("[ dns_common ] The DNS type %d is currently not supported.", type);
         return "[UNKNOWN]";
@@ -161,4 +187,23 @@ char *DNS_opcode_to_str(uint8 code) {
     else {
         return "Unknown query";
     }
-}
\ No newline at end of file
+}
+
+void DNS_name_to_lower(char *dest, const char *name, int size) {
+    int i;
+    for (i = 0; name[i] != '\0' && i < size - 1; i++) {
+        dest[i] = (char) tolower((unsigned char) name[i]);
+    }
+    dest[i] = '\0';
+}
+
+uint32 DNS_name_hash(const char *name, uint16 type, uint16 class) {
+    // FNV-1a hash
+    uint32 hash = 2166136261u;
+    for (; *name != '\0'; name++) {
+        hash = (hash ^ (uint8) *name) * 16777619u;
+    }
+    hash = (hash ^ type) * 16777619u;
+    hash = (hash ^ class) * 16777619u;
+    return hash;
+}
@@ -6,6 +6,7 @@
 #ifndef PROJECT_DNS_DNS_COMMON_H
 #define PROJECT_DNS_DNS_COMMON_H
 
+#include <stdarg.h>
 #include "dns_io.h"
 
 // IP addresses for different DNS servers
@@ -50,6 +51,7 @@ enum {
     TYPE_A = 1,
     TYPE_NS = 2,
     TYPE_CNAME = 5,
+    TYPE_SOA = 6,
     TYPE_PTR = 12,
     TYPE_MX = 15
 };
@@ -61,6 +63,39 @@ enum {
     CLASS_IN = 1
 };
 
+/**
+ * The levels of the messages, the messages below the current level are not logged
+ */
+enum {
+    LOG_LEVEL_TRACE = 0,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_WARNING,
+    LOG_LEVEL_ERROR
+};
+
+// The current log level, can be changed at any time
+extern volatile int log_level;
+
+/**
+ * Check whether the messages of the level are logged, the trace messages are never logged with NOTRACE
+ * @param level The level of the messages
+ */
+#ifdef NOTRACE
+#define DNS_log_enabled(level) ((level) != LOG_LEVEL_TRACE && log_level <= (level))
+#else
+#define DNS_log_enabled(level) (log_level <= (level))
+#endif
+
+/**
+ * Log a message if its level is enabled, the arguments are not evaluated otherwise
+ */
+#define DNS_LOG_AT(level, ...) \
+    do { \
+        if (DNS_log_enabled(level)) { \
+            DNS_log_write(level, __VA_ARGS__); \
+        } \
+    } while (0)
+
 /**
  * Print a error message to the terminal.
  * The message will begin with "[ERROR]" and will be colored red
@@ -68,7 +103,7 @@ enum {
  * @param format  The format of the message
  * @param ... The arguments to be formatted to the message
  */
-void DNS_log_error(const char *format, ...);
+#define DNS_log_error(...) DNS_LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
 
 /**
  * Print a warning message to the terminal.
@@ -77,7 +112,7 @@ void DNS_log_error(const char *format, ...);
  * @param format  The format of the message
  * @param ... The arguments to be formatted to the message
  */
-void DNS_log_warning(const char *format, ...);
+#define DNS_log_warning(...) DNS_LOG_AT(LOG_LEVEL_WARNING, __VA_ARGS__)
 
 /**
  * Print a normal message to the terminal.
@@ -85,7 +120,7 @@ void DNS_log_warning(const char *format, ...);
  * @param format  The format of the message
  * @param ... The arguments to be formatted to the message
  */
-void DNS_log_info(const char *format, ...);
+#define DNS_log_info(...) DNS_LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
 
 /**
  * Print a trace message to the terminal.
@@ -95,7 +130,37 @@ void DNS_log_info(const char *format, ...);
  * @param format  The format of the message
  * @param ... The arguments to be formatted to the message
  */
-void DNS_log_trace(const char *format, ...);
+#define DNS_log_trace(...) DNS_LOG_AT(LOG_LEVEL_TRACE, __VA_ARGS__)
+
+/**
+ * Log a message, printed at once or handed to the asynchronous logger if it is started.
+ * Use the macros above instead, which check the level first
+ * @param level The level of the message
+ * @param format The format of the message
+ * @param ... The arguments to be formatted to the message
+ */
+void DNS_log_write(int level, const char *format, ...);
+
+/**
+ * Print a formatted message to the terminal with the prefix and the color of its level
+ * @param level The level of the message
+ * @param message The message
+ */
+void DNS_log_print(int level, const char *message);
+
+/**
+ * Set the function taking the messages instead of printing them at once, used by the asynchronous logger
+ * @param sink The function, returns false if the message should be printed at once. NULL to print all
+ *             the messages at once
+ */
+void DNS_log_set_sink(bool (*sink)(int level, const char *format, va_list args));
+
+/**
+ * Convert the name of a log level to the level
+ * @param str The name, one of "trace", "info", "warning" and "error"
+ * @return The level, -1 if the name is unknown
+ */
+int DNS_log_level_from_str(const char *str);
 
 /**
  * Convert a DNS RR type from a string to a 16-bit integer
@@ -132,4 +197,22 @@ char *DNS_rcode_to_str(uint8 code);
  */
 char *DNS_opcode_to_str(uint8 code);
 
+/**
+ * Copy a domain name in lower case, since the names in DNS are case-insensitive
+ * @param dest The destination string
+ * @param name The name to be converted
+ * @param size The size of the destination, longer names will be truncated
+ */
+void DNS_name_to_lower(char *dest, const char *name, int size);
+
+/**
+ * Hash a lowercased domain name together with the type and class of the records,
+ * used as the key of the hash tables of RRsets
+ * @param name The lowercased name
+ * @param type The type of the records
+ * @param class The class of the records
+ * @return The hash value
+ */
+uint32 DNS_name_hash(const char *name, uint16 type, uint16 class);
+
 #endif //PROJECT_DNS_DNS_COMMON_H
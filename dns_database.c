@@ -6,15 +6,35 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <time.h>
+#include <arpa/inet.h>
 #include "sqlite3.h"  // sqlite3's source code and header file should be included in the project
 #include "dns_common.h"
 #include "dns_io.h"
+#include "dns_latency.h"
 
 #define DATABASE_NAME "dns_database.db" // the file name of the database, can be changed
+#define BUSY_TIMEOUT  1000              // milliseconds to wait for the locks held by other processes
+#define MAX_TABLES    8                 // the maximum number of tables with prepared statements
 
-sqlite3 *database;
+/**
+ * The prepared statements for looking up the records in one of the server tables.
+ * The table name cannot be bound as a parameter, so every table have its own statements
+ */
+typedef struct {
+    const char *table_name;
+    sqlite3_stmt *select;         // Records of the given name, type and class
+    sqlite3_stmt *select_cname;   // Same as above but also includes the CNAME records
+} table_statements_t;
+
+// The connection and the prepared statements are kept open for the whole lifetime of the thread,
+// so a query only needs to bind the parameters, step and reset the statement.
+// Each thread have its own connection since a sqlite3 connection should not be shared between threads.
+static __thread sqlite3 *database = NULL;
+static __thread table_statements_t table_statements[MAX_TABLES];
+static __thread sqlite3_stmt *cache_insert = NULL;
 
 /**
  * Write default testing data to the database.
@@ -38,6 +58,8 @@ bool DNS_database_write_default_data() {
             "INSERT INTO s1   VALUES (2, 'co.us',            60, 1, 2, 'ns4.local');"
             "INSERT INTO s1   VALUES (3, 'ns3.local',        60, 1, 1, '127.0.0.5');"
             "INSERT INTO s1   VALUES (4, 'ns4.local',        60, 1, 1, '127.0.0.6');"
+            "INSERT INTO s1   VALUES (5, 'cn',               60, 1, 6, 'ns1.local,admin.local,1,3600,600,86400,60');" // SOA for the negative answers
+            "INSERT INTO s1   VALUES (6, 'us',               60, 1, 6, 'ns1.local,admin.local,1,3600,600,86400,60');"
 
             // Records of DNS server 2
             "INSERT INTO s2   VALUES (1, 'www.baidu.com',    60, 1, 5, 'www.a.shifen.com');"
@@ -47,12 +69,15 @@ bool DNS_database_write_default_data() {
             "INSERT INTO s2   VALUES (5, 'post.n.shifen.com',60, 1, 1, '14.215.177.221');"
             "INSERT INTO s2   VALUES (6, 'code.org',         60, 1, 1, '99.84.57.215');"
             "INSERT INTO s2   VALUES (7, 'studio.code.org',  60, 1, 1, '13.227.51.203');"
+            "INSERT INTO s2   VALUES (8, 'baidu.com',        60, 1, 6, 'ns2.local,admin.local,1,3600,600,86400,60');"
+            "INSERT INTO s2   VALUES (9, 'code.org',         60, 1, 6, 'ns2.local,admin.local,1,3600,600,86400,60');"
 
             // Records of DNS server 3
             "INSERT INTO s3   VALUES (1, 'bupt.edu.cn',      60, 1,15, '3,mx.bupt.edu.cn');"
             "INSERT INTO s3   VALUES (2, 'mx.bupt.edu.cn',   60, 1, 1, '183.3.235.87');"
             "INSERT INTO s3   VALUES (3, 'www.bupt.edu.cn',  60, 1, 5, 'vn64.bupt.edu.cn');"
             "INSERT INTO s3   VALUES (4, 'vn64.bupt.edu.cn', 60, 1, 1, '211.68.69.240');"
+            "INSERT INTO s3   VALUES (5, 'edu.cn',           60, 1, 6, 'ns3.local,admin.local,1,3600,600,86400,60');"
 
             // Records of DNS server 4, contains PTR records
             "INSERT INTO s4   VALUES (1, 'ci.craig.co.us',        60, 1, 1, '50.28.0.27');"
@@ -62,12 +87,15 @@ bool DNS_database_write_default_data() {
             "INSERT INTO s4   VALUES (5, '4.0.0.127.in-addr.arpa',60, 1,12, 's2.local');"
             "INSERT INTO s4   VALUES (6, '5.0.0.127.in-addr.arpa',60, 1,12, 's3.local');"
             "INSERT INTO s4   VALUES (7, '6.0.0.127.in-addr.arpa',60, 1,12, 's4.local');"
-            "INSERT INTO s4   VALUES (8, '7.0.0.127.in-addr.arpa',60, 1,12, 'root.local');";
+            "INSERT INTO s4   VALUES (8, '7.0.0.127.in-addr.arpa',60, 1,12, 'root.local');"
+            "INSERT INTO s4   VALUES (9, 'co.us',                 60, 1, 6, 'ns4.local,admin.local,1,3600,600,86400,60');"
+            "INSERT INTO s4   VALUES (10,'in-addr.arpa',          60, 1, 6, 'ns4.local,admin.local,1,3600,600,86400,60');";
 
     char *err = NULL;
     sqlite3_exec(database, sql_insert, NULL, NULL, &err);
     if (err != NULL) {
         DNS_log_error("[dns_database] Cannot write default data, %s.", err);
+        sqlite3_free(err);
         return false;
     }
 
@@ -77,25 +105,31 @@ bool DNS_database_write_default_data() {
 /**
  * Initialize the database. If the database file does not exist,
  * a new one will be created with default data.
- * Note that this should be called for every database operation and the
- * database should be closed after the operation since this database will
- * be used by multiple processes
+ * The connection is opened only once for each thread and reused by all later operations.
+ * Since the database is also used by other server processes, a busy timeout is set so the
+ * operations will wait for the locks held by other processes instead of failing
  * @return True if the database is successfully initialized
  */
 bool DNS_database_init() {
     char *err = NULL;  // Error message
 
+    if (database != NULL) {
+        return true;
+    }
+
     if (access(DATABASE_NAME, F_OK) == -1) {
         DNS_log_warning("[dns_database] Database not found! creating new one...");
         if (sqlite3_open(DATABASE_NAME, &database) != SQLITE_OK) {
             DNS_log_error("[dns_database] Cannot create database, %s", sqlite3_errmsg(database));
             sqlite3_close(database);
+            database = NULL;
             return false;
         }
 
         char sql_create[] =
-                // Create tables for different name servers, for local DNS server, the timestamp field is used to store
-                // the time (in seconds) when the cache were added
+                // Create tables for different name servers, for local DNS server, the cache table keeps the cache
+                // written with --cache-persist, and the timestamp field is used to store the time (in seconds)
+                // when the cache were added
                 "CREATE TABLE root  (id INTEGER PRIMARY KEY, name TEXT, ttl INTEGER, class INTEGER, type INTEGER, data TEXT);"
                 "CREATE TABLE s1    (id INTEGER PRIMARY KEY, name TEXT, ttl INTEGER, class INTEGER, type INTEGER, data TEXT);"
                 "CREATE TABLE s2    (id INTEGER PRIMARY KEY, name TEXT, ttl INTEGER, class INTEGER, type INTEGER, data TEXT);"
@@ -106,6 +140,7 @@ bool DNS_database_init() {
         sqlite3_exec(database, sql_create, NULL, NULL, &err);
         if (err != NULL) {
             DNS_log_error("[dns_database] Cannot crate tables, %s.", err);
+            sqlite3_free(err);
             return false;
         }
 
@@ -117,125 +152,292 @@ bool DNS_database_init() {
         if (sqlite3_open(DATABASE_NAME, &database) != SQLITE_OK) {
             DNS_log_error("[dns_database] Cannot open existing database, %s", sqlite3_errmsg(database));
             sqlite3_close(database);
+            database = NULL;
             return false;
         }
     }
 
+    sqlite3_busy_timeout(database, BUSY_TIMEOUT);
     return true;
 }
 
-dns_rr_t *DNS_database_get_record(const char* table_name, char* name, int type, int class, bool include_cname) {
-    char **data;
-    int columns = 0;
-    int count = 0;
-    char *err = NULL;
-    char sql[256];
+/**
+ * Compile a SQL statement on the connection of current thread
+ * @param sql The SQL statement, parameters are given as ?1, ?2, ...
+ * @return The prepared statement, NULL if failed
+ */
+sqlite3_stmt *database_prepare(const char *sql) {
+    sqlite3_stmt *stmt = NULL;
+    if (sqlite3_prepare_v2(database, sql, -1, &stmt, NULL) != SQLITE_OK) {
+        DNS_log_error("[dns_database] Cannot prepare statement, %s\n\t%s", sqlite3_errmsg(database), sql);
+        return NULL;
+    }
+    return stmt;
+}
 
-    if(!DNS_database_init()) {
+/**
+ * Get the prepared statements of the given table, the statements will be prepared
+ * when the table is used for the first time
+ * @param table_name The name of the table
+ * @return The statements, NULL if failed
+ */
+table_statements_t *database_get_table_statements(const char *table_name) {
+    int i;
+    for (i = 0; i < MAX_TABLES && table_statements[i].table_name != NULL; i++) {
+        if (!strcmp(table_statements[i].table_name, table_name)) {
+            return &table_statements[i];
+        }
+    }
+
+    if (i == MAX_TABLES) {
+        DNS_log_error("[dns_database] Too many tables used, cannot prepare statements for table %s", table_name);
         return NULL;
     }
-    sprintf(sql, "SELECT * FROM %s WHERE name = '%s' and (type = %d %s) and class = %d;",
-            table_name, name, type, (include_cname ? "or type = 5" : "" ), class);
 
-    if (sqlite3_get_table(database, sql, &data, &count, &columns, &err) != SQLITE_OK) {
-        DNS_log_error("[dns_database] SQL execution failed, %s\n\t", err, sql);
-        sqlite3_close(database);
+    char sql[256];
+    table_statements_t *t = &table_statements[i];
+    sprintf(sql, "SELECT name, ttl, class, type, data FROM %s WHERE name = ?1 and type = ?2 and class = ?3;",
+            table_name);
+    t->select = database_prepare(sql);
+    sprintf(sql, "SELECT name, ttl, class, type, data FROM %s WHERE name = ?1 and (type = ?2 or type = 5) and class = ?3;",
+            table_name);
+    t->select_cname = database_prepare(sql);
+    if (t->select == NULL || t->select_cname == NULL) {
+        sqlite3_finalize(t->select);
+        sqlite3_finalize(t->select_cname);
+        t->select = NULL;
+        t->select_cname = NULL;
         return NULL;
     }
 
-    dns_rr_t *first = NULL;
-    if (count > 0) {
-        dns_rr_t *prev = NULL;
-
-        int index = columns;
-        for (int row = 0; row < count; row++) {
-            dns_rr_t *t = DNS_RR_create();
-            index++;  // Skip the ID field
-            sscanf(data[index++], "%s", t->name);
-            sscanf(data[index++], "%d", &t->ttl);
-            sscanf(data[index++], "%hd", &t->class);
-            sscanf(data[index++], "%hd", &t->type);
-            sscanf(data[index++], "%s", t->data);
-            if (first == NULL) {
-                first = t;
-                prev = t;
-            }
-            else {
-                prev->next = t;
-                prev = t;
-            }
+    t->table_name = table_name;
+    return t;
+}
+
+/**
+ * Copy a text column to a fixed-size string of the RR
+ * @param dest The destination, should have at least {@code RR_STRING_LEN} bytes
+ * @param stmt The statement
+ * @param column The column index
+ */
+void database_copy_text(ptr_t dest, sqlite3_stmt *stmt, int column) {
+    const unsigned char *text = sqlite3_column_text(stmt, column);
+    if (text == NULL) {
+        dest[0] = '\0';
+        return;
+    }
+    strncpy((char *) dest, (const char *) text, RR_STRING_LEN - 1);
+    dest[RR_STRING_LEN - 1] = '\0';
+}
+
+/**
+ * Convert the text stored in the data column to the RDATA of the RR, the type of the RR should be set.
+ * The data is an IP address for A records like '14.215.177.38', the preference and the name of
+ * the mail exchanger for MX records like '3,mx.bupt.edu.cn', the primary server, the mailbox, the serial,
+ * the refresh, retry and expire timers and the minimum TTL for SOA records like
+ * 'ns2.local,admin.local,1,3600,600,86400,60' and a domain name for the other types
+ * @param rr The RR
+ * @param text The text in the data column
+ */
+void database_rdata_from_text(dns_rr_t *rr, const char *text) {
+    if (rr->type == TYPE_A) {
+        struct in_addr addr;
+        if (inet_pton(AF_INET, text, &addr) != 1) {
+            DNS_log_warning("[dns_database] Expected IP address in RR of type A, but got '%s'.", text);
+            addr.s_addr = 0;
+        }
+        rr->rdata.a = ntohl(addr.s_addr);
+    }
+    else if (rr->type == TYPE_MX) {
+        int length = 0;
+        if (sscanf(text, "%hu,%n", &rr->rdata.mx.preference, &length) != 1 || length == 0) {
+            DNS_log_warning("[dns_database] Expected preference and name in RR of type MX, but got '%s', "
+                            "the preference will be set to 0", text);
+            rr->rdata.mx.preference = 0;
+        }
+        strncpy((char *) rr->rdata.mx.exchange, text + length, RR_STRING_LEN - 1);
+        rr->rdata.mx.exchange[RR_STRING_LEN - 1] = '\0';
+    }
+    else if (rr->type == TYPE_SOA) {
+        char rname[RR_STRING_LEN];
+        if (sscanf(text, "%127[^,],%127[^,],%u,%u,%u,%u,%u", (char *) rr->rdata.soa.mname, rname,
+                   &rr->rdata.soa.serial, &rr->rdata.soa.refresh, &rr->rdata.soa.retry, &rr->rdata.soa.expire,
+                   &rr->rdata.soa.minimum) != 7 || !DNS_RR_set_soa_rname(rr, rname)) {
+            DNS_log_warning("[dns_database] Expected names, serial and timers in RR of type SOA, but got '%s'.", text);
+            ptr_t mname = rr->rdata.soa.mname;
+            memset(&rr->rdata.soa, 0, sizeof(rr->rdata.soa));
+            rr->rdata.soa.mname = mname;
+            mname[0] = '\0';
+            DNS_RR_set_soa_rname(rr, "");
         }
-        sqlite3_free_table(data);
     }
+    else {
+        strncpy((char *) rr->rdata.name, text, RR_STRING_LEN - 1);
+        rr->rdata.name[RR_STRING_LEN - 1] = '\0';
+    }
+}
 
-    sqlite3_close(database);
-    return first;
+/**
+ * Convert the RDATA of the RR to the text stored in the data column,
+ * see {@code database_rdata_from_text} for the format
+ * @param rr The RR
+ * @param text The text, should have at least {@code RR_STRING_LEN + 64} bytes
+ */
+void database_rdata_to_text(const dns_rr_t *rr, char *text) {
+    if (rr->type == TYPE_A) {
+        struct in_addr addr;
+        addr.s_addr = htonl(rr->rdata.a);
+        strcpy(text, inet_ntoa(addr));
+    }
+    else if (rr->type == TYPE_MX) {
+        sprintf(text, "%hu,%s", rr->rdata.mx.preference, rr->rdata.mx.exchange);
+    }
+    else if (rr->type == TYPE_SOA) {
+        sprintf(text, "%s,%s,%u,%u,%u,%u,%u", rr->rdata.soa.mname, rr->rdata.soa.rname, rr->rdata.soa.serial,
+                rr->rdata.soa.refresh, rr->rdata.soa.retry, rr->rdata.soa.expire, rr->rdata.soa.minimum);
+    }
+    else {
+        strcpy(text, (const char *) rr->rdata.name);
+    }
 }
 
-dns_rr_t *DNS_database_get_cache(char* name, int type, int class) {
-    char **data;
-    int columns = 0;
-    int count = 0;
-    char *err = NULL;
-    char sql[256];
-    time_t tim = time(NULL);
+/**
+ * Run a SELECT statement with bound parameters, the columns should be (name, ttl, class, type, data).
+ * The statement will be reset after the operation so it can be reused
+ * @param stmt The statement
+ * @return The linked list of the RRs
+ */
+dns_rr_t *database_read_records(sqlite3_stmt *stmt) {
+    dns_rr_t *first = NULL, *prev = NULL;
+    int ret;
+
+    while ((ret = sqlite3_step(stmt)) == SQLITE_ROW) {
+        dns_rr_t *t = DNS_RR_create();
+        database_copy_text(t->name, stmt, 0);
+        t->ttl = (uint32) sqlite3_column_int(stmt, 1);
+        t->class = (uint16) sqlite3_column_int(stmt, 2);
+        t->type = (uint16) sqlite3_column_int(stmt, 3);
+        const unsigned char *data = sqlite3_column_text(stmt, 4);
+        database_rdata_from_text(t, data != NULL ? (const char *) data : "");
+        if (first == NULL) {
+            first = t;
+            prev = t;
+        }
+        else {
+            prev->next = t;
+            prev = t;
+        }
+    }
+
+    if (ret != SQLITE_DONE) {
+        DNS_log_error("[dns_database] SQL execution failed, %s\n\t%s", sqlite3_errmsg(database), sqlite3_sql(stmt));
+    }
 
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    return first;
+}
+
+dns_rr_t *DNS_database_get_record(const char* table_name, char* name, int type, int class, bool include_cname) {
     if(!DNS_database_init()) {
         return NULL;
     }
-    sprintf(sql, "SELECT * FROM cache WHERE name = '%s' and (type = %d or type = 5) and class = %d and timestamp + ttl > %ld;",
-            name, type, class, time(&tim));
 
-    if (sqlite3_get_table(database, sql, &data, &count, &columns, &err) != SQLITE_OK) {
-        DNS_log_error("[dns_database] SQL execution failed, %s\n\t%s", err, sql);
-        sqlite3_close(database);
+    table_statements_t *statements = database_get_table_statements(table_name);
+    if (statements == NULL) {
         return NULL;
     }
 
-    dns_rr_t *first = NULL;
-    if (count > 0) {
-        dns_rr_t *prev = NULL;
-
-        int index = columns;
-        for (int row = 0; row < count; row++) {
-            dns_rr_t *t = DNS_RR_create();
-            index++;  // Skip the ID field
-            sscanf(data[index++], "%s", t->name);
-            sscanf(data[index++], "%d", &t->ttl);
-            sscanf(data[index++], "%hd", &t->class);
-            sscanf(data[index++], "%hd", &t->type);
-            sscanf(data[index++], "%s", t->data);
-            index++;  // Skip the timestamp field
-            if (first == NULL) {
-                first = t;
-                prev = t;
-            }
-            else {
-                prev->next = t;
-                prev = t;
-            }
-        }
-        sqlite3_free_table(data);
-    }
+    unsigned long start = DNS_latency_start();
+    sqlite3_stmt *stmt = include_cname ? statements->select_cname : statements->select;
+    sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
+    sqlite3_bind_int(stmt, 2, type);
+    sqlite3_bind_int(stmt, 3, class);
 
-    sqlite3_close(database);
-    return first;
+    dns_rr_t *records = database_read_records(stmt);
+    DNS_latency_end(LATENCY_DATABASE, start);
+    return records;
 }
 
-bool DNS_database_put_cache(dns_rr_t rr) {
-    char sql_insert[128];
-    time_t tim = time(NULL);
-    DNS_database_init();
+dns_rr_t *DNS_database_get_all_records(const char *table_name) {
+    char sql[128];
 
-    sprintf(sql_insert, "INSERT INTO cache VALUES (NULL, '%s', %d, %hd, %hd, '%s', %ld);", rr.name, rr.ttl, rr.class, rr.type, rr.data, time(&tim));
+    if(!DNS_database_init()) {
+        return NULL;
+    }
 
+    // This is only used once when loading the records, so the statement is not kept
+    sprintf(sql, "SELECT name, ttl, class, type, data FROM %s ORDER BY id;", table_name);
+    sqlite3_stmt *stmt = database_prepare(sql);
+    if (stmt == NULL) {
+        return NULL;
+    }
+
+    dns_rr_t *records = database_read_records(stmt);
+    sqlite3_finalize(stmt);
+    return records;
+}
+
+dns_rr_t *DNS_database_load_cache() {
     char *err = NULL;
-    sqlite3_exec(database, sql_insert, NULL, NULL, &err);
+    char sql[128];
+    sqlite3_int64 now = (sqlite3_int64) time(NULL);
+
+    if(!DNS_database_init()) {
+        return NULL;
+    }
+
+    // The expired records will never be used again
+    sprintf(sql, "DELETE FROM cache WHERE timestamp + ttl <= %lld;", (long long) now);
+    sqlite3_exec(database, sql, NULL, NULL, &err);
     if (err != NULL) {
-        DNS_log_error("[dns_database] Cannot write cache data, %s.", err);
+        DNS_log_error("[dns_database] Cannot delete expired cache, %s.", err);
+        sqlite3_free(err);
+    }
+
+    sqlite3_stmt *stmt = database_prepare(
+            "SELECT name, timestamp + ttl - ?1, class, type, data FROM cache ORDER BY id;");
+    if (stmt == NULL) {
+        return NULL;
+    }
+
+    sqlite3_bind_int64(stmt, 1, now);
+    dns_rr_t *records = database_read_records(stmt);
+    sqlite3_finalize(stmt);
+    return records;
+}
+
+bool DNS_database_put_cache(dns_rr_t rr) {
+    if(!DNS_database_init()) {
         return false;
     }
-    sqlite3_close(database);
 
-    return true;
-}
\ No newline at end of file
+    if (cache_insert == NULL) {
+        cache_insert = database_prepare("INSERT INTO cache VALUES (NULL, ?1, ?2, ?3, ?4, ?5, ?6);");
+        if (cache_insert == NULL) {
+            return false;
+        }
+    }
+
+    unsigned long start = DNS_latency_start();
+    char data[RR_STRING_LEN + 64];
+    database_rdata_to_text(&rr, data);
+
+    sqlite3_bind_text(cache_insert, 1, rr.name, -1, SQLITE_STATIC);
+    sqlite3_bind_int(cache_insert, 2, (int) rr.ttl);
+    sqlite3_bind_int(cache_insert, 3, rr.class);
+    sqlite3_bind_int(cache_insert, 4, rr.type);
+    sqlite3_bind_text(cache_insert, 5, data, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(cache_insert, 6, (sqlite3_int64) time(NULL));
+
+    bool success = true;
+    if (sqlite3_step(cache_insert) != SQLITE_DONE) {
+        DNS_log_error("[dns_database] Cannot write cache data, %s.", sqlite3_errmsg(database));
+        success = false;
+    }
+
+    sqlite3_reset(cache_insert);
+    sqlite3_clear_bindings(cache_insert);
+    DNS_latency_end(LATENCY_DATABASE, start);
+    return success;
+}
@@ -9,7 +9,21 @@
 #include "dns_io.h"
 
 dns_rr_t *DNS_database_get_record(const char* table_name, char* name, int type, int class, bool include_cname);
-dns_rr_t * DNS_database_get_cache(char* name, int type, int class);
+
+/**
+ * Read all the records of a table, used to load the records into memory
+ * @param table_name The table name
+ * @return The linked list of all the RRs in the table, ordered by their IDs
+ */
+dns_rr_t *DNS_database_get_all_records(const char* table_name);
+
 bool DNS_database_put_cache(dns_rr_t rr);
 
+/**
+ * Delete the expired records in the cache table and read the remaining ones,
+ * used to restore the in-memory cache when the local server starts
+ * @return The linked list of unexpired RRs, their TTLs are the remaining time before expiration
+ */
+dns_rr_t *DNS_database_load_cache();
+
 #endif //PROJECT_DNS_DNS_DATABASE_H
@@ -0,0 +1,91 @@
+//
+// dns_histogram.c -- Implementation of the latency histograms
+// Created on 10/15/26.
+//
+
+#include <string.h>
+#include "dns_histogram.h"
+
+#define SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+
+/**
+ * Get the bucket of a value. The values below 2 * SUB_BUCKETS have their own buckets, the others
+ * are shifted right until they have HISTOGRAM_SUB_BITS + 1 bits, and each shift has SUB_BUCKETS buckets
+ */
+int histogram_bucket(unsigned long value) {
+    if (value < 2 * SUB_BUCKETS) {
+        return (int) value;
+    }
+    int shift = 63 - __builtin_clzl(value) - HISTOGRAM_SUB_BITS;
+    return ((shift + 1) << HISTOGRAM_SUB_BITS) + (int) (value >> shift) - SUB_BUCKETS;
+}
+
+/**
+ * Get the largest value counted in the bucket
+ */
+unsigned long histogram_bucket_max(int bucket) {
+    if (bucket < 2 * SUB_BUCKETS) {
+        return (unsigned long) bucket;
+    }
+    int shift = (bucket >> HISTOGRAM_SUB_BITS) - 1;
+    unsigned long first = (unsigned long) ((bucket & (SUB_BUCKETS - 1)) + SUB_BUCKETS) << shift;
+    return first + (1ul << shift) - 1;
+}
+
+void DNS_histogram_reset(dns_histogram_t *histogram) {
+    memset(histogram, 0, sizeof(dns_histogram_t));
+}
+
+void DNS_histogram_record(dns_histogram_t *histogram, unsigned long value) {
+    histogram->counts[histogram_bucket(value)]++;
+    if (histogram->count == 0 || value < histogram->min) {
+        histogram->min = value;
+    }
+    if (value > histogram->max) {
+        histogram->max = value;
+    }
+    histogram->count++;
+    histogram->sum += (double) value;
+}
+
+void DNS_histogram_merge(dns_histogram_t *dest, const dns_histogram_t *src) {
+    if (src->count == 0) {
+        return;
+    }
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        dest->counts[i] += src->counts[i];
+    }
+    if (dest->count == 0 || src->min < dest->min) {
+        dest->min = src->min;
+    }
+    if (src->max > dest->max) {
+        dest->max = src->max;
+    }
+    dest->count += src->count;
+    dest->sum += src->sum;
+}
+
+unsigned long DNS_histogram_percentile(const dns_histogram_t *histogram, double percentile) {
+    if (histogram->count == 0) {
+        return 0;
+    }
+
+    // The rank of the value, at least 1 so the 0th percentile is the minimum
+    unsigned long rank = (unsigned long) (percentile / 100.0 * (double) histogram->count + 0.5);
+    if (rank == 0) {
+        rank = 1;
+    }
+    unsigned long seen = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += histogram->counts[i];
+        if (seen >= rank) {
+            unsigned long value = histogram_bucket_max(i);
+            return value > histogram->max ? histogram->max : value;
+        }
+    }
+    return histogram->max;
+}
+
+double DNS_histogram_mean(const dns_histogram_t *histogram) {
+    return histogram->count == 0 ? 0 : histogram->sum / (double) histogram->count;
+}
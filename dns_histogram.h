@@ -0,0 +1,62 @@
+//
+// dns_histogram.h -- Histograms of latencies with a bounded relative error, like HdrHistogram. The values
+//                    below 128 are counted exactly, and each power of 2 above is divided into 64 buckets,
+//                    so a percentile is reported within 1/64 of the real value whatever the scale
+// Created on 10/15/26.
+//
+
+#ifndef PROJECT_DNS_DNS_HISTOGRAM_H
+#define PROJECT_DNS_DNS_HISTOGRAM_H
+
+#include "dns_io.h"
+
+#define HISTOGRAM_SUB_BITS 6
+#define HISTOGRAM_BUCKETS ((65 - HISTOGRAM_SUB_BITS) << HISTOGRAM_SUB_BITS)
+
+/**
+ * The histogram of the values recorded, the unit of the values is up to the user
+ */
+typedef struct {
+    unsigned long counts[HISTOGRAM_BUCKETS];
+    unsigned long count;
+    unsigned long min;
+    unsigned long max;
+    double sum;
+} dns_histogram_t;
+
+/**
+ * Clear the histogram
+ * @param histogram The histogram
+ */
+void DNS_histogram_reset(dns_histogram_t *histogram);
+
+/**
+ * Record a value
+ * @param histogram The histogram
+ * @param value The value
+ */
+void DNS_histogram_record(dns_histogram_t *histogram, unsigned long value);
+
+/**
+ * Add the values recorded in a histogram to another one
+ * @param dest The histogram to be added to
+ * @param src The histogram to be added
+ */
+void DNS_histogram_merge(dns_histogram_t *dest, const dns_histogram_t *src);
+
+/**
+ * Get the value at the percentile, which is the largest value of its bucket
+ * @param histogram The histogram
+ * @param percentile The percentile between 0 and 100, like 99.9
+ * @return The value, 0 if the histogram is empty
+ */
+unsigned long DNS_histogram_percentile(const dns_histogram_t *histogram, double percentile);
+
+/**
+ * Get the mean of the values recorded
+ * @param histogram The histogram
+ * @return The mean, 0 if the histogram is empty
+ */
+double DNS_histogram_mean(const dns_histogram_t *histogram);
+
+#endif //PROJECT_DNS_DNS_HISTOGRAM_H
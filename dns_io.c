@@ -8,8 +8,13 @@
 #include <string.h>
 #include <arpa/inet.h>
 #include "dns_common.h"
+#include "dns_arena.h"
 #include "dns_io.h"
 
+#define MAX_WIRE_NAME_LEN 256   // The maximum length of a domain name in the packet format
+#define MAX_WIRE_RR_LEN   512   // The maximum length of a pre-encoded RR
+#define MAX_POINTER_HOPS  64    // The maximum number of pointers followed when reading one name
+
 /**
  * Ensures the operation successes, otherwise print the error and exit the current function
  */
@@ -45,9 +50,7 @@ buffer_t DNS_buffer_create(int capacity) {
         return NULL;
     }
 
-    buf->capacity = capacity;
-    buf->pos = 0;
-    buf->known_names = NULL;
+    DNS_buffer_init(buf, buf->ptr, capacity);
     memset(buf->ptr, 0, buf->capacity);
 
     return buf;
@@ -60,10 +63,7 @@ buffer_t DNS_buffer_from_ptr(ptr_t ptr, int capacity) {
         return NULL;
     }
 
-    buf->ptr = ptr;
-    buf->capacity = capacity;
-    buf->pos = 0;
-    buf->known_names = NULL;
+    DNS_buffer_init(buf, ptr, capacity);
     return buf;
 }
 
@@ -72,15 +72,25 @@ void DNS_buffer_free(buffer_t buffer) {
     free(buffer);
 }
 
+void DNS_buffer_init(buffer_t buffer, ptr_t ptr, int capacity) {
+    buffer->ptr = ptr;
+    buffer->capacity = capacity;
+    buffer->pos = 0;
+    buffer->name_count = 0;
+    memset(buffer->names, 0, sizeof(buffer->names));
+}
+
 dns_rr_t *DNS_RR_create() {
-    dns_rr_t *rr = (dns_rr_t *) malloc(sizeof(dns_rr_t));
+    // The RR struct and its strings are allocated together
+    dns_rr_t *rr = (dns_rr_t *) DNS_alloc(sizeof(dns_rr_t) + 2 * RR_STRING_LEN);
     if (rr == NULL) {
         DNS_log_error("[   dns_io   ] Cannot create RR struct, out of memory.");
         return NULL;
     }
 
-    rr->data = (ptr_t) malloc(128);
-    rr->name = (ptr_t) malloc(128);
+    rr->name = (ptr_t) (rr + 1);
+    rr->rdata.name = rr->name + RR_STRING_LEN;
+    rr->wire = NULL;
     rr->next = NULL;
     return rr;
 }
@@ -105,21 +115,79 @@ dns_rr_t *DNS_RR_copy(dns_rr_t *other) {
 
     dns_rr_t *ret = DNS_RR_create();
     strcpy(ret->name, other->name);
-    strcpy(ret->data, other->data);
     ret->type = other->type;
     ret->class = other->class;
     ret->ttl = other->ttl;
+    DNS_RR_copy_rdata(ret, other);
+    ret->wire = other->wire;   // The wire format will not be changed, so it can be shared
     ret->next = NULL;
     return ret;
 }
 
+ptr_t DNS_RR_rdata_name(const dns_rr_t *rr) {
+    return rr->type == TYPE_A ? NULL : rr->rdata.name;
+}
+
+uint32 DNS_RR_rdata_names_size(const dns_rr_t *rr) {
+    if (rr->type == TYPE_A) {
+        return 0;
+    }
+    uint32 size = (uint32) strlen(rr->rdata.name) + 1;
+    if (rr->type == TYPE_SOA) {
+        size += (uint32) strlen(rr->rdata.soa.rname) + 1;
+    }
+    return size;
+}
+
+bool DNS_RR_set_soa_rname(dns_rr_t *rr, const char *rname) {
+    size_t offset = strlen(rr->rdata.soa.mname) + 1;
+    if (offset + strlen(rname) + 1 > RR_STRING_LEN) {
+        return false;
+    }
+    rr->rdata.soa.rname = rr->rdata.soa.mname + offset;
+    strcpy(rr->rdata.soa.rname, rname);
+    return true;
+}
+
+void DNS_RR_copy_rdata(dns_rr_t *dest, const dns_rr_t *src) {
+    if (src->type == TYPE_A) {
+        dest->rdata.a = src->rdata.a;
+        return;
+    }
+
+    strcpy(dest->rdata.name, src->rdata.name);
+    if (src->type == TYPE_MX) {
+        dest->rdata.mx.preference = src->rdata.mx.preference;
+    }
+    else if (src->type == TYPE_SOA) {
+        ptr_t mname = dest->rdata.soa.mname;
+        dest->rdata.soa = src->rdata.soa;
+        dest->rdata.soa.mname = mname;
+        DNS_RR_set_soa_rname(dest, src->rdata.soa.rname);
+    }
+}
+
+bool DNS_RR_rdata_equals(const dns_rr_t *a, const dns_rr_t *b) {
+    if (a->type == TYPE_A) {
+        return a->rdata.a == b->rdata.a;
+    }
+    if (a->type == TYPE_MX && a->rdata.mx.preference != b->rdata.mx.preference) {
+        return false;
+    }
+    if (a->type == TYPE_SOA && (a->rdata.soa.serial != b->rdata.soa.serial || strcmp(a->rdata.soa.rname, b->rdata.soa.rname))) {
+        return false;
+    }
+    return !strcmp(a->rdata.name, b->rdata.name);
+}
+
 dns_query_t *DNS_query_create() {
-    dns_query_t *query = (dns_query_t *) malloc(sizeof(dns_query_t));
+    dns_query_t *query = (dns_query_t *) DNS_alloc(sizeof(dns_query_t) + RR_STRING_LEN);
     if (query == NULL) {
         DNS_log_error("[   dns_io   ] Cannot create query struct, out of memory");
+        return NULL;
     }
 
-    query->name = (ptr_t) malloc(128);
+    query->name = (ptr_t) (query + 1);
     query->next = NULL;
     return query;
 }
@@ -258,172 +326,336 @@ bool DNS_buffer_write_DNS_header(buffer_t buffer, dns_header_t v) {
     return true;
 }
 
-/**
- * Find a name from the known names in the buffer with its position
- * @param buffer
- * @param position
- * @return The name
- */
-ptr_t known_names_find_name(buffer_t buffer, uint16 position) {
-    for (known_name_t *k = buffer->known_names; k != NULL; k = k->next) {
-        if (k->pos == position) {
-            return k->name;
+bool DNS_buffer_read_DNS_name(buffer_t buffer, ptr_t name) {
+    uint32 pos = buffer->pos;
+    bool jumped = false;
+    int hops = 0;
+    int length = 0;
+
+    while (true) {
+        ENSURE_SUCCESS((pos < buffer->capacity));
+        uint8 length_tag = buffer->ptr[pos];
+
+        if ((length_tag >> 6) == 0b11) {  // This is a pointer to another position of the packet
+            ENSURE_SUCCESS((pos + 1 < buffer->capacity));
+            uint16 ptr = ((length_tag & 0x3F) << 8) | buffer->ptr[pos + 1];
+            if (!jumped) {
+                // The name in the current position ends with the pointer
+                buffer->pos = pos + 2;
+                jumped = true;
+            }
+
+            // The pointers should only point backward, so the names cannot contain loops
+            if (ptr >= pos || ++hops > MAX_POINTER_HOPS) {
+                DNS_log_warning("[   dns_io   ] One of the pointers in the packet does not points to a name");
+                return false;
+            }
+            pos = ptr;
+            continue;
+        }
+
+        if (length_tag == 0 || (length_tag >> 6) != 0) {
+            ENSURE_SUCCESS((length_tag == 0));
+            pos++;
+            break;
+        }
+
+        if (pos + length_tag + 1 > buffer->capacity || length + length_tag + 1 >= RR_STRING_LEN) {
+            DNS_log_warning("[   dns_io   ] The name in the packet is longer than %d bytes", RR_STRING_LEN - 1);
+            return false;
         }
+        memcpy(&name[length], &buffer->ptr[pos + 1], length_tag);
+        length += length_tag;
+        name[length++] = '.';  // Append dots to the string
+        pos += length_tag + 1;
     }
 
-    return NULL;
+    if (!jumped) {
+        buffer->pos = pos;
+    }
+    name[length > 0 ? length - 1 : 0] = '\0';  // Remove last dot (.) and write termination of string
+
+    return true;
 }
 
-/**
- * Find the position of the name in the known names of the buffer
- * @param buffer
- * @param name
- * @return The position, 0xFFFF if not found
- */
-uint16 known_names_find_pos(buffer_t buffer, ptr_t name) {
-    for (known_name_t *k = buffer->known_names; k != NULL; k = k->next) {
-        if (!strcmp(name, k->name)) {
-            return k->pos;
+int DNS_name_to_wire(const char *name, ptr_t wire) {
+    int len = 0;
+    while (*name != '\0') {
+        const char *end = name;
+        while (*end != '\0' && *end != '.') {
+            end++;
+        }
+
+        int length_tag = (int) (end - name);
+        if (length_tag > 63) {
+            DNS_log_warning("[   dns_io   ] The label of name '%s' is longer than 63 bytes", name);
+            return 0;
+        }
+        if (length_tag > 0) {   // Skip empty labels, like the one after the trailing dot
+            wire[len++] = (uint8) length_tag;
+            memcpy(&wire[len], name, length_tag);
+            len += length_tag;
         }
+        name = (*end == '.') ? end + 1 : end;
     }
+    wire[len++] = 0;
+    return len;
+}
 
-    return 0xFFFF;
+/**
+ * Hash one label of a name into the hash of the suffix after it, so the hashes of all the
+ * suffixes of a name are computed from the last label to the first one
+ * @param hash The hash of the suffix after the label
+ * @param label The label, starting with its length tag
+ * @return The hash of the suffix starting from the label
+ */
+uint32 compression_hash_label(uint32 hash, ptr_t label) {
+    for (int i = 0; i <= label[0]; i++) {
+        hash ^= label[i];
+        hash *= 16777619u;
+    }
+    return hash;
 }
 
 /**
- * Append a new name to the known names of the buffer
+ * Compare the name written at the position of the buffer with the name in wire format,
+ * the pointers in the buffer are followed
  * @param buffer
- * @param name
- * @param position
+ * @param pos The position of the name in the buffer
+ * @param wire The name in wire format
+ * @return True if the names are the same
  */
-void known_names_append(buffer_t buffer, ptr_t name, uint16 position) {
-    known_name_t *k = buffer->known_names;
-
-    known_name_t *kk = (known_name_t *) malloc(sizeof(known_name_t));
-    kk->name = (ptr_t) malloc(64);
-    ptr_t named = kk->name;
-    uint8 length_tag2;
-    while (*name != '\0') {
-        length_tag2 = *name++;
-        if ((length_tag2 >> 6) == 0b11) {
-            uint16 ptr = ((length_tag2 & 0x3F) << 8) | *name++;
-            ptr_t found_name = known_names_find_name(buffer, ptr);
-            if (found_name != NULL) {
-                strcpy(named, found_name);
-                named += strlen(found_name);
+bool compression_match(buffer_t buffer, uint32 pos, ptr_t wire) {
+    int hops = 0;
+    while (pos < buffer->pos) {
+        uint8 length_tag = buffer->ptr[pos];
+        if ((length_tag >> 6) == 0b11) {
+            if (pos + 1 >= buffer->pos || ++hops > MAX_POINTER_HOPS) {
+                return false;
             }
-            break;
+            pos = ((length_tag & 0x3F) << 8) | buffer->ptr[pos + 1];
+            continue;
         }
 
-        *named++ = length_tag2;
-        for (int i = 0; i < length_tag2; i++) {
-            *named++ = *name++;
+        if (length_tag != *wire) {
+            return false;
+        }
+        if (length_tag == 0) {
+            return true;
         }
+        if (pos + length_tag >= buffer->pos || memcmp(&buffer->ptr[pos + 1], wire + 1, length_tag) != 0) {
+            return false;
+        }
+        pos += length_tag + 1;
+        wire += length_tag + 1;
     }
-    *named = '\0';
-    kk->pos = position;
-    kk->next = NULL;
+    return false;
+}
 
-    if (k == NULL) {
-        buffer->known_names = kk;
+/**
+ * Find the position of the name in the compression table of the buffer
+ * @param buffer
+ * @param wire The name in wire format
+ * @param hash The hash of the name
+ * @return The position, 0 if not found
+ */
+uint16 compression_find(buffer_t buffer, ptr_t wire, uint32 hash) {
+    uint32 index = hash & (COMPRESSION_TABLE_SIZE - 1);
+    for (compression_entry_t *e = &buffer->names[index]; e->pos != 0; e = &buffer->names[index]) {
+        if (e->tag == (uint16) (hash >> 16) && compression_match(buffer, e->pos, wire)) {
+            return e->pos;
+        }
+        index = (index + 1) & (COMPRESSION_TABLE_SIZE - 1);
     }
-    else {
-        for (; k->next != NULL; k = k->next);
-        k->next = kk;
+    return 0;
+}
+
+/**
+ * Add a name to the compression table of the buffer. The name is not added when the table is
+ * 3/4 full, it will just not be compressed in the following names
+ * @param buffer
+ * @param hash The hash of the name
+ * @param pos The position of the name
+ */
+void compression_insert(buffer_t buffer, uint32 hash, uint16 pos) {
+    if (buffer->name_count >= COMPRESSION_TABLE_SIZE / 4 * 3) {
+        return;
+    }
+
+    uint32 index = hash & (COMPRESSION_TABLE_SIZE - 1);
+    while (buffer->names[index].pos != 0) {
+        index = (index + 1) & (COMPRESSION_TABLE_SIZE - 1);
     }
+    buffer->names[index].tag = (uint16) (hash >> 16);
+    buffer->names[index].pos = pos;
+    buffer->name_count++;
 }
 
+bool DNS_buffer_write_wire_name(buffer_t buffer, ptr_t wire) {
+    // Find the beginning of the labels, and compute the hash of the suffix starting from each of them
+    uint8 labels[MAX_WIRE_NAME_LEN / 2];
+    uint32 hashes[MAX_WIRE_NAME_LEN / 2];
+    int label_count = 0;
+    for (int i = 0; wire[i] != 0; i += wire[i] + 1) {
+        labels[label_count++] = (uint8) i;
+    }
+    uint32 hash = 2166136261u;
+    for (int i = label_count - 1; i >= 0; i--) {
+        hash = compression_hash_label(hash, &wire[labels[i]]);
+        hashes[i] = hash;
+    }
 
-bool DNS_buffer_read_DNS_name(buffer_t buffer, ptr_t name) {
-    uint8 length_tag;
-    do {
-        ENSURE_SUCCESS(DNS_buffer_read_u8(buffer, &length_tag));
-
-        if ((length_tag >> 6) != 0b11 && length_tag != 0) {
-            ENSURE_SUCCESS(check_capacity(buffer, length_tag));
-            // Append the current name to the known names
-            // This will add the string from current length tag to the final tag (\0)
-            known_names_append(buffer, &buffer->ptr[buffer->pos - 1], buffer->pos - 1);
-
-            uint8 c;
-            for (int i = 0; i < length_tag; i++) {
-                ENSURE_SUCCESS(DNS_buffer_read_u8(buffer, &c));
-                *name++ = c;
-            }
-            *name++ = '.'; // Append dots to the string
-        } else if ((length_tag >> 6) == 0b11) {  // This is a pointer to another position of the packet
-            uint16 ptr;
-            uint8 ptr8;
-            ENSURE_SUCCESS(DNS_buffer_read_u8(buffer, &ptr8));
-            ptr = ((length_tag & 0x3F) << 4) | ptr8;
-            ptr_t name1 = known_names_find_name(buffer, ptr);  // Find the position in the known names
-            if (name1 == NULL) {
-                DNS_log_warning("[   dns_io   ] One of the pointers in the packet does not points to a name");
-            }
-            else {
-                uint8 length_tag2;
-                while (*name1 != '\0') {
-                    length_tag2 = *name1++;
-                    for (int i = 0; i < length_tag2; i++) {
-                        *name++ = *name1++;
-                    }
-                    *name++ = '.';
-                }
-            }
-            break;
+    // Process the segments of name respectively
+    for (int i = 0; i < label_count; i++) {
+        // Try to find existing names on the buffer
+        ptr_t label = &wire[labels[i]];
+        uint16 find = compression_find(buffer, label, hashes[i]);
+        if (find != 0) {
+            // If found, write its position instead of its actual value
+            return DNS_buffer_write_u16(buffer, find | 0xC000);
+        }
+
+        // Only the first 16KB of the packet can be pointed to, and the position 0 is the header
+        if (buffer->pos > 0 && buffer->pos < 0x4000) {
+            compression_insert(buffer, hashes[i], (uint16) buffer->pos);
         }
-    } while (length_tag > 0);
 
-    *(name - 1) = '\0';  // Remove last dot (.) and write termination of string
+        // Write the length tag and the content of the label
+        ENSURE_SUCCESS(check_capacity(buffer, label[0] + 1));
+        memcpy(&buffer->ptr[buffer->pos], label, label[0] + 1);
+        buffer->pos += label[0] + 1;
+    }
 
-    return true;
+    return DNS_buffer_write_u8(buffer, 0);
 }
 
 bool DNS_buffer_write_DNS_name(buffer_t buffer, ptr_t name) {
-    buffer_t converted_name = DNS_buffer_create(strlen(name) + 2);
-    ptr_t tok = strtok(name, ".");
-    uint8 length_tag;
+    unsigned char wire[MAX_WIRE_NAME_LEN];
+
     // Convert the domain name to machine format
-    while (tok) {
-        length_tag = (uint8) strlen(tok);
-        DNS_buffer_write_u8(converted_name, length_tag);
-        for (int i = 0; i < length_tag; i++) {
-            DNS_buffer_write_u8(converted_name, tok[i]);
-        }
-        tok = strtok(NULL, ".");
+    if (strlen(name) + 2 > MAX_WIRE_NAME_LEN || DNS_name_to_wire(name, wire) == 0) {
+        DNS_log_warning("[   dns_io   ] Invalid domain name '%s'", name);
+        return false;
     }
 
-    if (!check_capacity(buffer, converted_name->capacity)) {
+    return DNS_buffer_write_wire_name(buffer, wire);
+}
+
+/**
+ * Write the domain name to the buffer without compression
+ * @return False if the name is invalid or the buffer is full
+ */
+bool wire_write_name(buffer_t buffer, const char *name) {
+    if (strlen(name) + 2 > MAX_WIRE_NAME_LEN || strlen(name) + 2 > buffer->capacity - buffer->pos) {
+        return false;
+    }
+    int len = DNS_name_to_wire(name, &buffer->ptr[buffer->pos]);
+    if (len == 0) {
         return false;
     }
+    buffer->pos += len;
+    return true;
+}
 
-    length_tag = 0;
-    converted_name->pos = 0;
-    // Process the segments of name respectively
-    do {
-        // Try to find existing names on the buffer
-        uint16 find = known_names_find_pos(buffer, &converted_name->ptr[converted_name->pos]);
-        if (find != 0xFFFF) {
-            // If found, write its position instead of its actual value
-            DNS_buffer_write_u16(buffer, find | 0xC000);
-            break;
-        }
+/**
+ * Write the serial, the timers and the minimum TTL of the SOA record to the buffer
+ */
+bool buffer_write_soa_numbers(buffer_t buffer, const dns_rr_t *rr) {
+    ENSURE_SUCCESS(DNS_buffer_write_u32(buffer, rr->rdata.soa.serial));
+    ENSURE_SUCCESS(DNS_buffer_write_u32(buffer, rr->rdata.soa.refresh));
+    ENSURE_SUCCESS(DNS_buffer_write_u32(buffer, rr->rdata.soa.retry));
+    ENSURE_SUCCESS(DNS_buffer_write_u32(buffer, rr->rdata.soa.expire));
+    ENSURE_SUCCESS(DNS_buffer_write_u32(buffer, rr->rdata.soa.minimum));
+    return true;
+}
 
-        // Read the length tags
-        ENSURE_SUCCESS(DNS_buffer_read_u8(converted_name, &length_tag));
+bool DNS_RR_encode_wire(dns_rr_t *rr) {
+    unsigned char data[MAX_WIRE_RR_LEN];
+    struct dns_buffer buf;
+    DNS_buffer_init(&buf, data, MAX_WIRE_RR_LEN);
+    uint16 rdata_name = 0;
 
-        // Append the current name to the known names
-        if (length_tag != 0)
-            known_names_append(buffer, &converted_name->ptr[converted_name->pos - 1], buffer->pos);
+    // The names are written without compression, since the encoded RR will be copied to different packets
+    if (strlen(rr->name) + 2 > MAX_WIRE_NAME_LEN || (buf.pos = DNS_name_to_wire(rr->name, data)) == 0) {
+        return false;
+    }
+    uint16 name_length = (uint16) buf.pos;
+    ENSURE_SUCCESS(DNS_buffer_write_u16(&buf, rr->type));
+    ENSURE_SUCCESS(DNS_buffer_write_u16(&buf, rr->class));
+    ENSURE_SUCCESS(DNS_buffer_write_u32(&buf, rr->ttl));
+    buf.pos += 2;   // Skip the length field for now
+
+    uint32 pos = buf.pos;
+    const char *target = DNS_RR_rdata_name(rr);
+    if (rr->type == TYPE_A) {
+        ENSURE_SUCCESS(DNS_buffer_write_u32(&buf, rr->rdata.a));
+    }
+    else if (rr->type == TYPE_MX) {
+        ENSURE_SUCCESS(DNS_buffer_write_u16(&buf, rr->rdata.mx.preference));
+    }
+    else if (rr->type == TYPE_SOA) {
+        // The names of SOA are not at the end of the RDATA, so they are copied without compression
+        target = NULL;
+        if (!wire_write_name(&buf, rr->rdata.soa.mname) || !wire_write_name(&buf, rr->rdata.soa.rname)) {
+            return false;
+        }
+        ENSURE_SUCCESS(buffer_write_soa_numbers(&buf, rr));
+    }
 
-        // Write the length tag
-        ENSURE_SUCCESS(DNS_buffer_write_u8(buffer, length_tag));
-        for (int i = 0; i < length_tag; i++) {
-            // Write the content of the name
-            ENSURE_SUCCESS(DNS_buffer_write_u8(buffer, converted_name->ptr[converted_name->pos++]));
+    if (target != NULL) {
+        rdata_name = (uint16) buf.pos;
+        if (!wire_write_name(&buf, target)) {
+            return false;
         }
-    } while (length_tag > 0);
+    }
 
+    uint16 rdata_length = (uint16) (buf.pos - pos);
+    data[pos - 2] = (uint8) (rdata_length >> 8);
+    data[pos - 1] = (uint8) rdata_length;
+
+    dns_rr_wire_t *wire = (dns_rr_wire_t *) malloc(sizeof(dns_rr_wire_t) + buf.pos);
+    if (wire == NULL) {
+        DNS_log_error("[   dns_io   ] Cannot create wire format of RR, out of memory.");
+        return false;
+    }
+    wire->length = (uint16) buf.pos;
+    wire->name_length = name_length;
+    wire->rdata_name = rdata_name;
+    memcpy(wire->data, data, buf.pos);
+    rr->wire = wire;
+    return true;
+}
+
+/**
+ * Write the pre-encoded RR to the buffer. The fixed fields and RDATA are copied directly, only
+ * the owner name and the name in the RDATA are compressed, and the RDATA length is patched
+ * @param buffer
+ * @param wire The encoded RR
+ * @return
+ */
+bool buffer_write_RR_wire(buffer_t buffer, dns_rr_wire_t *wire) {
+    ENSURE_SUCCESS(DNS_buffer_write_wire_name(buffer, wire->data));
+
+    if (wire->rdata_name == 0) {
+        uint16 length = wire->length - wire->name_length;
+        ENSURE_SUCCESS(check_capacity(buffer, length));
+        memcpy(&buffer->ptr[buffer->pos], &wire->data[wire->name_length], length);
+        buffer->pos += length;
+        return true;
+    }
+
+    // Copy the type, class, TTL, RDATA length and the RDATA before the name (preference of MX)
+    uint16 length = wire->rdata_name - wire->name_length;
+    ENSURE_SUCCESS(check_capacity(buffer, length));
+    memcpy(&buffer->ptr[buffer->pos], &wire->data[wire->name_length], length);
+    uint32 rdata_pos = buffer->pos + 10;
+    buffer->pos += length;
+
+    // The name is always at the end of the RDATA
+    ENSURE_SUCCESS(DNS_buffer_write_wire_name(buffer, &wire->data[wire->rdata_name]));
+    uint16 rdata_length = (uint16) (buffer->pos - rdata_pos);
+    buffer->ptr[rdata_pos - 2] = (uint8) (rdata_length >> 8);
+    buffer->ptr[rdata_pos - 1] = (uint8) rdata_length;
     return true;
 }
 
@@ -440,24 +672,29 @@ bool DNS_buffer_read_RR(buffer_t buffer, dns_rr_t *v) {
     if (v->type == TYPE_A) {
         if (v->length != 4) {
             DNS_log_warning("[   dns_io   ] Inconsistent RR data length of type A, 4 is expected but got %d", v->length);
-            memcpy(v->data, buffer->ptr, v->length);
+            v->rdata.a = 0;
             buffer->pos += v->length;
         } else {
-            uint32 iip;
-            struct in_addr addr;
-            ENSURE_SUCCESS(DNS_buffer_read_u32(buffer, &iip));
-            addr.s_addr = ntohl(iip);
-            strcpy(v->data, inet_ntoa(addr));
+            ENSURE_SUCCESS(DNS_buffer_read_u32(buffer, &v->rdata.a));
         }
     } else if (v->type == TYPE_MX) {
-        uint16 preference;
-        unsigned char data[128];
-
-        ENSURE_SUCCESS(DNS_buffer_read_u16(buffer, &preference));
-        ENSURE_SUCCESS(DNS_buffer_read_DNS_name(buffer, data));
-        sprintf(v->data, "%hd,%s", preference, data);
+        ENSURE_SUCCESS(DNS_buffer_read_u16(buffer, &v->rdata.mx.preference));
+        ENSURE_SUCCESS(DNS_buffer_read_DNS_name(buffer, v->rdata.mx.exchange));
+    } else if (v->type == TYPE_SOA) {
+        char rname[RR_STRING_LEN];
+        ENSURE_SUCCESS(DNS_buffer_read_DNS_name(buffer, v->rdata.soa.mname));
+        ENSURE_SUCCESS(DNS_buffer_read_DNS_name(buffer, rname));
+        if (!DNS_RR_set_soa_rname(v, rname)) {
+            DNS_log_warning("[   dns_io   ] The names in the SOA record are longer than %d bytes", RR_STRING_LEN - 2);
+            return false;
+        }
+        ENSURE_SUCCESS(DNS_buffer_read_u32(buffer, &v->rdata.soa.serial));
+        ENSURE_SUCCESS(DNS_buffer_read_u32(buffer, &v->rdata.soa.refresh));
+        ENSURE_SUCCESS(DNS_buffer_read_u32(buffer, &v->rdata.soa.retry));
+        ENSURE_SUCCESS(DNS_buffer_read_u32(buffer, &v->rdata.soa.expire));
+        ENSURE_SUCCESS(DNS_buffer_read_u32(buffer, &v->rdata.soa.minimum));
     } else {
-        ENSURE_SUCCESS(DNS_buffer_read_DNS_name(buffer, v->data));
+        ENSURE_SUCCESS(DNS_buffer_read_DNS_name(buffer, v->rdata.name));
     }
 
     if (buffer->pos - pos != v->length) {
@@ -470,6 +707,10 @@ bool DNS_buffer_read_RR(buffer_t buffer, dns_rr_t *v) {
 }
 
 bool DNS_buffer_write_RR(buffer_t buffer, dns_rr_t v) {
+    if (v.wire != NULL) {
+        return buffer_write_RR_wire(buffer, v.wire);
+    }
+
     ENSURE_SUCCESS(DNS_buffer_write_DNS_name(buffer, v.name));
 
     ENSURE_SUCCESS( DNS_buffer_write_u16(buffer, v.type));
@@ -479,28 +720,16 @@ bool DNS_buffer_write_RR(buffer_t buffer, dns_rr_t v) {
     buffer->pos += 2;       // Skip the length field for now, we will add it later
 
     if (v.type == TYPE_A) {
-        uint32 iip = htonl(inet_addr(v.data));
-        ENSURE_SUCCESS(DNS_buffer_write_u32(buffer, iip));
-        if (iip == -1) {
-            DNS_log_warning("[   dns_io   ] Expected IP address in RR of type A, but got '%s'.", v.data);
-        }
+        ENSURE_SUCCESS(DNS_buffer_write_u32(buffer, v.rdata.a));
     } else if (v.type == TYPE_MX) {
-        uint16 pref;
-        char name[128];
-
-        if (sscanf(v.data, "%hd,%s", &pref, name) != 2) {
-            DNS_log_warning(
-                    "[   dns_io   ] Expected preference and name in RR of type MX, but got '%s', the preference will be set to 0",
-                    v.data);
-            // memset(name, 0, 128);
-            ENSURE_SUCCESS(DNS_buffer_write_u16(buffer, 0));
-            ENSURE_SUCCESS(DNS_buffer_write_DNS_name(buffer, v.data));
-        } else {
-            ENSURE_SUCCESS(DNS_buffer_write_u16(buffer, pref));
-            ENSURE_SUCCESS(DNS_buffer_write_DNS_name(buffer, name));
-        }
+        ENSURE_SUCCESS(DNS_buffer_write_u16(buffer, v.rdata.mx.preference));
+        ENSURE_SUCCESS(DNS_buffer_write_DNS_name(buffer, v.rdata.mx.exchange));
+    } else if (v.type == TYPE_SOA) {
+        ENSURE_SUCCESS(DNS_buffer_write_DNS_name(buffer, v.rdata.soa.mname));
+        ENSURE_SUCCESS(DNS_buffer_write_DNS_name(buffer, v.rdata.soa.rname));
+        ENSURE_SUCCESS(buffer_write_soa_numbers(buffer, &v));
     } else {
-        ENSURE_SUCCESS(DNS_buffer_write_DNS_name(buffer, v.data));
+        ENSURE_SUCCESS(DNS_buffer_write_DNS_name(buffer, v.rdata.name));
     }
 
     int pos2 = buffer->pos;
@@ -9,6 +9,9 @@
 #define true  1
 #define false 0
 
+// The length of the name and data strings of the queries and RRs
+#define RR_STRING_LEN 128
+
 // some type definition
 typedef unsigned char *ptr_t;
 typedef unsigned char bool;
@@ -49,6 +52,42 @@ typedef struct dns_query {
     struct dns_query *next;
 } dns_query_t;
 
+/**
+ * The pre-encoded wire format of a resource record, used for the static records
+ * so that they can be written to the packet with memcpy.
+ * The names in the wire format are not compressed
+ */
+typedef struct dns_rr_wire {
+    uint16 length;          /// < The length of the whole RR in wire format
+    uint16 name_length;     /// < The length of the owner name at the beginning of the RR
+    uint16 rdata_name;      /// < The offset of the domain name in the RDATA (NS, CNAME, PTR and MX), 0 if none
+    uint8 data[];           /// < The owner name, type, class, TTL, RDATA length and RDATA
+} dns_rr_wire_t;
+
+/**
+ * The RDATA of a resource record, the member used depends on the type of the RR.
+ * The domain name of NS, CNAME, PTR, the exchange of MX and the primary server of SOA are at
+ * the same place, so {@code name} can be used for all the types containing a domain name.
+ * The mailbox of SOA is stored right after the primary server in the same memory
+ */
+typedef union dns_rdata {
+    uint32 a;                   /// < TYPE_A: The IPv4 address in host byte order
+    ptr_t name;                 /// < TYPE_NS, TYPE_CNAME, TYPE_PTR: The domain name
+    struct {
+        ptr_t exchange;         /// < The domain name of the mail exchanger
+        uint16 preference;
+    } mx;                       /// < TYPE_MX
+    struct {
+        ptr_t mname;            /// < The primary name server of the zone
+        ptr_t rname;            /// < The mailbox of the person responsible for the zone
+        uint32 serial;
+        uint32 refresh;
+        uint32 retry;
+        uint32 expire;
+        uint32 minimum;         /// < The TTL of the negative answers of the zone (RFC 2308)
+    } soa;                      /// < TYPE_SOA
+} dns_rdata_t;
+
 /**
  * The DNS resource record
  * Stores as linked list
@@ -59,7 +98,8 @@ typedef struct dns_rr {
     uint16 class;
     uint32 ttl;
     uint16 length;
-    ptr_t data;
+    dns_rdata_t rdata;
+    dns_rr_wire_t *wire;    /// < The pre-encoded wire format, NULL if not encoded
 
     struct dns_rr *next;
 } dns_rr_t;
@@ -76,15 +116,17 @@ typedef struct {
     dns_rr_t *additionals;
 } dns_packet_t;
 
+// The number of entries of the compression table in the buffer, should be power of 2
+#define COMPRESSION_TABLE_SIZE 1024
+
 /**
- * This struct records one known name and its position in the buffer
- * This struct is stored in a linked list
+ * This struct records the position of one name (or the suffix of a name) written to the buffer,
+ * the entries are stored in an open-addressing hash table keyed on the wire format of the names
  */
-typedef struct known_name {
-    ptr_t name;
-    uint16 pos;
-    struct known_name *next;
-} known_name_t;
+typedef struct compression_entry {
+    uint16 tag;     // The high bits of the hash, to skip most of the comparisons of different names
+    uint16 pos;     // The position of the name, 0 for empty entries since the header is always at 0
+} compression_entry_t;
 
 /**
  * This struct contains the pointer, length, capacity and current position of a buffer
@@ -94,8 +136,9 @@ struct dns_buffer {
     uint32 capacity;
     uint32 pos;
 
-    // The known names in the buffer
-    known_name_t *known_names;
+    // The names written to the buffer, used to compress the following names
+    compression_entry_t names[COMPRESSION_TABLE_SIZE];
+    uint16 name_count;
 };
 
 /**
@@ -118,16 +161,75 @@ buffer_t DNS_buffer_create(int capacity);
  */
 buffer_t DNS_buffer_from_ptr(ptr_t ptr, int capacity);
 
+/**
+ * Initialize a buffer struct with existing memory pointer, used when the
+ * buffer struct is not allocated from the heap (like on the stack)
+ * @param buffer The buffer struct to be initialized
+ * @param ptr The pointer of the buffer begins
+ * @param capacity The capacity of the buffer
+ */
+void DNS_buffer_init(buffer_t buffer, ptr_t ptr, int capacity);
+
 /**
  * Release the memory space taken by the buffer
  * @param buffer The buffer to be released
  */
 void DNS_buffer_free(buffer_t buffer);
 
+/**
+ * Create a query. The memory is allocated with {@code DNS_alloc}, so it is owned by
+ * the current arena if there is one
+ * @return The query, the name can hold {@code RR_STRING_LEN} bytes
+ */
 dns_query_t *DNS_query_create();
 
+/**
+ * Create an RR. The memory is allocated with {@code DNS_alloc}, so it is owned by
+ * the current arena if there is one
+ * @return The RR, the name and {@code rdata.name} can hold {@code RR_STRING_LEN} bytes
+ */
 dns_rr_t *DNS_RR_create();
 
+/**
+ * Get the domain name in the RDATA of the RR
+ * @param rr The RR
+ * @return The domain name of NS, CNAME, PTR and MX records, the primary server of SOA records,
+ *         NULL for A records
+ */
+ptr_t DNS_RR_rdata_name(const dns_rr_t *rr);
+
+/**
+ * Get the size of the memory taken by the domain names in the RDATA of the RR
+ * @param rr The RR
+ * @return The size including the terminating null characters, 0 for A records
+ */
+uint32 DNS_RR_rdata_names_size(const dns_rr_t *rr);
+
+/**
+ * Set the mailbox of an SOA record to the memory right after its primary server, the primary
+ * server and the mailbox together should fit into {@code RR_STRING_LEN} bytes
+ * @param rr The SOA record, its primary server should be set
+ * @param rname The mailbox
+ * @return False if the names are too long
+ */
+bool DNS_RR_set_soa_rname(dns_rr_t *rr, const char *rname);
+
+/**
+ * Copy the RDATA of an RR to another one, the domain names are copied to the memory of
+ * {@code rdata.name} of the destination RR, which should be of the same type
+ * @param dest The destination RR
+ * @param src The source RR
+ */
+void DNS_RR_copy_rdata(dns_rr_t *dest, const dns_rr_t *src);
+
+/**
+ * Check whether two RRs of the same type have the same RDATA
+ * @param a The first RR
+ * @param b The second RR
+ * @return True if the RDATA are the same
+ */
+bool DNS_RR_rdata_equals(const dns_rr_t *a, const dns_rr_t *b);
+
 dns_query_t *DNS_query_copy(dns_query_t *other);
 
 /**
@@ -162,9 +264,10 @@ bool DNS_buffer_write_DNS_header(buffer_t buffer, dns_header_t v);
 /**
  * Read DNS name from the buffer and convert it to human readable format.
  * For example, the names in the buffer will like '\003www\005baidu\003com\0'
- * and it should be converted to 'www.baidu.com'
+ * and it should be converted to 'www.baidu.com'. The compression pointers are
+ * followed directly to the positions in the buffer
  * @param buffer
- * @param name
+ * @param name The name, should be able to hold {@code RR_STRING_LEN} bytes
  * @return True if the operation is success
  */
 bool DNS_buffer_read_DNS_name(buffer_t buffer, ptr_t name);
@@ -179,6 +282,33 @@ bool DNS_buffer_read_DNS_name(buffer_t buffer, ptr_t name);
  */
 bool DNS_buffer_write_DNS_name(buffer_t buffer, ptr_t name);
 
+/**
+ * Convert a human readable name to the format in the packet, for example
+ * 'www.baidu.com' will be converted to '\003www\005baidu\003com\0'
+ * @param name The name
+ * @param wire The converted name, should have at least strlen(name) + 2 bytes
+ * @return The length of the converted name, 0 if the name is invalid
+ */
+int DNS_name_to_wire(const char *name, ptr_t wire);
+
+/**
+ * Write DNS name in the packet format to the buffer. For existing names in the same packet,
+ * pointers to the name will be used
+ * @param buffer
+ * @param wire The name like '\003www\005baidu\003com\0'
+ * @return
+ */
+bool DNS_buffer_write_wire_name(buffer_t buffer, ptr_t wire);
+
+/**
+ * Encode the RR to the wire format and keep it in the RR, so later writes of the RR
+ * will only copy the encoded bytes and compress the names.
+ * Should only be used for the RRs that will not be changed, like the records of the zone
+ * @param rr The RR
+ * @return True if the RR is successfully encoded
+ */
+bool DNS_RR_encode_wire(dns_rr_t *rr);
+
 bool DNS_buffer_read_RR(buffer_t buffer, dns_rr_t *v);
 
 bool DNS_buffer_write_RR(buffer_t buffer, dns_rr_t v);
@@ -0,0 +1,347 @@
+//
+// dns_io_bench.c -- Microbenchmark of encoding and decoding the DNS packets. A corpus of packets from a
+//                   single query to a response with many RRs in the same zone is encoded and decoded
+//                   repeatedly, and the time, the heap allocations and the bytes allocated of each
+//                   operation are reported, so the changes to the codec can be compared. The heap
+//                   allocations are counted by wrapping malloc at link time (-Wl,--wrap=malloc)
+// Created on 10/15/26.
+//
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "dns_common.h"
+#include "dns_arena.h"
+#include "dns_io.h"
+#include "dns_view.h"
+
+#define BUFFER_SIZE (64 * 1024)
+#define DEFAULT_RR_COUNT 200
+#define MIN_TIME_NS 2e8              // Each operation runs at least this long without a given number of iterations
+#define TIME_CHECK_INTERVAL 64       // The number of iterations between the checks of the time
+
+// The heap allocations made by the codec, counted by the wrappers of the allocation functions
+unsigned long bench_allocs = 0;
+unsigned long bench_alloc_bytes = 0;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size) {
+    bench_allocs++;
+    bench_alloc_bytes += size;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size) {
+    bench_allocs++;
+    bench_alloc_bytes += count * size;
+    return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+    bench_allocs++;
+    bench_alloc_bytes += size;
+    return __real_realloc(ptr, size);
+}
+
+/**
+ * The operations measured on each packet of the corpus
+ */
+enum {
+    OP_BUILD,           // DNS_buffer_write_packet
+    OP_PARSE,           // DNS_buffer_read_packet with every query and RR allocated from the heap, like the client
+    OP_PARSE_ARENA,     // DNS_buffer_read_packet with the memory taken from an arena, like the servers
+    OP_VIEW,            // DNS_view_parse, and decompressing the names of every RR
+    OP_COUNT
+};
+
+const char *bench_op_names[OP_COUNT] = {"build", "parse", "parse-arena", "view"};
+
+/**
+ * The result of one operation
+ */
+typedef struct {
+    double ns;
+    double allocs;
+    double bytes;
+} bench_result_t;
+
+/**
+ * Get the current time of the monotonic clock
+ * @return The time in nanoseconds
+ */
+double bench_now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double) now.tv_sec * 1e9 + (double) now.tv_nsec;
+}
+
+/**
+ * Create a packet with one question
+ * @param qr Whether the packet is a response
+ */
+dns_packet_t bench_create_packet(const char *name, uint16 type, bool qr) {
+    dns_packet_t packet;
+    memset(&packet, 0, sizeof(packet));
+    packet.header.id = 0x1234;
+    packet.header.qr = qr;
+    packet.header.aa = qr;
+
+    dns_query_t *query = DNS_query_create();
+    strcpy(query->name, name);
+    query->type = type;
+    query->class = CLASS_IN;
+    DNS_packet_append_query(&packet, query, true);
+    return packet;
+}
+
+/**
+ * Create an RR, the RDATA is an address for A records and a domain name for the other types
+ * @param data The address in host byte order or the domain name
+ */
+dns_rr_t *bench_create_rr(const char *name, uint16 type, uint32 address, const char *data) {
+    dns_rr_t *rr = DNS_RR_create();
+    strcpy(rr->name, name);
+    rr->type = type;
+    rr->class = CLASS_IN;
+    rr->ttl = 60;
+    if (type == TYPE_A) {
+        rr->rdata.a = address;
+    }
+    else {
+        strcpy(rr->rdata.name, data);
+        if (type == TYPE_MX) {
+            rr->rdata.mx.preference = (uint16) address;
+        }
+    }
+    return rr;
+}
+
+/**
+ * Create a response with a chain of CNAME records across zones, like the answers of a CDN
+ */
+dns_packet_t bench_create_cname_chain() {
+    dns_packet_t packet = bench_create_packet("www.bench.example.com", TYPE_A, true);
+    DNS_packet_append_answer(&packet, bench_create_rr("www.bench.example.com", TYPE_CNAME, 0,
+                                                      "www.bench.example.com.edge.example.net"), true);
+    DNS_packet_append_answer(&packet, bench_create_rr("www.bench.example.com.edge.example.net", TYPE_CNAME, 0,
+                                                      "e1234.a.cdn.example.org"), true);
+    DNS_packet_append_answer(&packet, bench_create_rr("e1234.a.cdn.example.org", TYPE_CNAME, 0,
+                                                      "e1234.b.cdn.example.org"), true);
+    for (uint32 i = 1; i <= 2; i++) {
+        DNS_packet_append_answer(&packet, bench_create_rr("e1234.b.cdn.example.org", TYPE_A, 0xC6336400 | i, NULL),
+                                 true);
+    }
+    return packet;
+}
+
+/**
+ * Create a response with MX records, the NS records of the zone and the addresses of all of them
+ */
+dns_packet_t bench_create_mx() {
+    char name[RR_STRING_LEN];
+    dns_packet_t packet = bench_create_packet("bench.example.com", TYPE_MX, true);
+    for (uint32 i = 1; i <= 3; i++) {
+        sprintf(name, "mx%u.bench.example.com", i);
+        DNS_packet_append_answer(&packet, bench_create_rr("bench.example.com", TYPE_MX, i * 10, name), true);
+        DNS_packet_append_additional(&packet, bench_create_rr(name, TYPE_A, 0xC0000200 | i, NULL), true);
+    }
+    for (uint32 i = 1; i <= 2; i++) {
+        sprintf(name, "ns%u.bench.example.com", i);
+        DNS_packet_append_authority(&packet, bench_create_rr("bench.example.com", TYPE_NS, 0, name), true);
+        DNS_packet_append_additional(&packet, bench_create_rr(name, TYPE_A, 0xC0000210 | i, NULL), true);
+    }
+    return packet;
+}
+
+/**
+ * Create a response with the A records of different hosts in the same zone,
+ * and the NS records of the zone with their glue records
+ * @param rr_count The number of the A records
+ * @return The response packet
+ */
+dns_packet_t bench_create_response(int rr_count) {
+    char name[RR_STRING_LEN];
+    dns_packet_t packet = bench_create_packet("host0.bench.example.com", TYPE_A, true);
+    for (int i = 0; i < rr_count; i++) {
+        sprintf(name, "host%d.bench.example.com", i);
+        DNS_packet_append_answer(&packet, bench_create_rr(name, TYPE_A, 0x0A000000 | (uint32) i, NULL), true);   // 10.x.x.x
+    }
+
+    for (int i = 0; i < 4; i++) {
+        sprintf(name, "ns%d.bench.example.com", i);
+        DNS_packet_append_authority(&packet, bench_create_rr("bench.example.com", TYPE_NS, 0, name), true);
+        DNS_packet_append_additional(&packet, bench_create_rr(name, TYPE_A, 0xC0000200 | (uint32) (i + 1), NULL),
+                                     true);   // 192.0.2.x
+    }
+    return packet;
+}
+
+/**
+ * Release the queries and the RRs of a packet decoded without an arena,
+ * each of them is allocated in one block with its strings
+ */
+void bench_free_packet(dns_packet_t *packet) {
+    dns_rr_t *lists[] = {packet->answers, packet->authorities, packet->additionals};
+    for (int i = 0; i < 3; i++) {
+        dns_rr_t *next;
+        for (dns_rr_t *rr = lists[i]; rr != NULL; rr = next) {
+            next = rr->next;
+            free(rr);
+        }
+    }
+    dns_query_t *next;
+    for (dns_query_t *query = packet->queries; query != NULL; query = next) {
+        next = query->next;
+        free(query);
+    }
+}
+
+/**
+ * Run the operation once
+ * @param data The memory of the encoded packet
+ * @param length The length of the encoded packet
+ * @param arena_bytes Returns the bytes taken from the arena
+ * @return False if failed
+ */
+bool bench_run_once(int op, dns_packet_t *packet, ptr_t data, uint32 length, dns_arena_t *arena,
+                    unsigned long *arena_bytes) {
+    static struct dns_buffer buffer;
+    static unsigned char out[BUFFER_SIZE];
+
+    if (op == OP_BUILD) {
+        DNS_buffer_init(&buffer, out, BUFFER_SIZE);
+        return DNS_buffer_write_packet(&buffer, *packet);
+    }
+    if (op == OP_PARSE || op == OP_PARSE_ARENA) {
+        dns_packet_t decoded;
+        memset(&decoded, 0, sizeof(decoded));
+        DNS_buffer_init(&buffer, data, length);
+        if (op == OP_PARSE_ARENA) {
+            DNS_arena_set_current(arena);
+        }
+        bool success = DNS_buffer_read_packet(&buffer, &decoded);
+        if (op == OP_PARSE_ARENA) {
+            DNS_arena_set_current(NULL);
+            *arena_bytes += DNS_arena_used(arena);
+            DNS_arena_reset(arena);
+        }
+        else {
+            bench_free_packet(&decoded);
+        }
+        return success;
+    }
+
+    // Validate the packet with the view, and decompress the name and RDATA of every RR
+    dns_packet_view_t view;
+    dns_rr_view_t rr;
+    char name[RR_STRING_LEN];
+    uint32 address;
+    if (!DNS_view_parse(&view, data, length)) {
+        return false;
+    }
+    uint32 offset = view.answers;
+    int rr_total = view.header.answer_count + view.header.authority_count + view.header.additional_count;
+    for (int j = 0; j < rr_total; j++) {
+        offset = DNS_view_read_rr(&view, offset, &rr);
+        DNS_view_name(&view, rr.name, name);
+        if (!DNS_view_rdata_a(&view, &rr, &address)) {
+            DNS_view_name(&view, rr.rdata, name);
+        }
+    }
+    return true;
+}
+
+/**
+ * Measure an operation on a packet. The operation runs the given number of iterations, or until
+ * it runs long enough if the number is 0
+ * @return False if the operation failed
+ */
+bool bench_measure(int op, dns_packet_t *packet, ptr_t data, uint32 length, dns_arena_t *arena, int iterations,
+                   bench_result_t *result) {
+    unsigned long arena_bytes = 0;
+
+    // Warm up, so the arena and the caches are ready
+    for (int i = 0; i < TIME_CHECK_INTERVAL; i++) {
+        if (!bench_run_once(op, packet, data, length, arena, &arena_bytes)) {
+            return false;
+        }
+    }
+
+    arena_bytes = 0;
+    unsigned long allocs = bench_allocs, bytes = bench_alloc_bytes;
+    double start = bench_now_ns(), elapsed = 0;
+    long count = 0;
+    while (iterations > 0 ? count < iterations : elapsed < MIN_TIME_NS) {
+        bench_run_once(op, packet, data, length, arena, &arena_bytes);
+        if (++count % TIME_CHECK_INTERVAL == 0) {
+            elapsed = bench_now_ns() - start;
+        }
+    }
+    elapsed = bench_now_ns() - start;
+
+    result->ns = elapsed / (double) count;
+    result->allocs = (double) (bench_allocs - allocs) / (double) count;
+    result->bytes = (double) (bench_alloc_bytes - bytes + arena_bytes) / (double) count;
+    return true;
+}
+
+/**
+ * Main entry of the benchmark
+ * Usage: dns_io_bench [rr_count] [iterations], the operations run for a while each if the iterations are not given
+ */
+int main(int argc, char **argv) {
+    int rr_count = argc > 1 ? atoi(argv[1]) : DEFAULT_RR_COUNT;
+    int iterations = argc > 2 ? atoi(argv[2]) : 0;
+    if (rr_count <= 0 || iterations < 0) {
+        DNS_log_error("[ dns_bench  ] Usage: dns_io_bench [rr_count] [iterations]");
+        return -1;
+    }
+
+    char many_name[32];
+    sprintf(many_name, "many-rr-%d", rr_count + 8);
+    const char *case_names[] = {"a-query", "a-response", "cname-chain", "mx-additional", many_name};
+    dns_packet_t corpus[] = {
+            bench_create_packet("www.example.com", TYPE_A, false),
+            bench_create_packet("www.example.com", TYPE_A, true),
+            bench_create_cname_chain(),
+            bench_create_mx(),
+            bench_create_response(rr_count)
+    };
+    DNS_packet_append_answer(&corpus[1], bench_create_rr("www.example.com", TYPE_A, 0x5DB8D822, NULL), true);
+
+    static unsigned char data[BUFFER_SIZE];
+    static struct dns_buffer buffer;
+    dns_arena_t *arena = DNS_arena_create(BUFFER_SIZE);
+
+    printf("%-16s %5s %7s  %-12s %12s %10s %10s\n", "case", "RRs", "length", "operation", "ns/op", "allocs/op",
+           "bytes/op");
+    for (int i = 0; i < (int) (sizeof(corpus) / sizeof(corpus[0])); i++) {
+        DNS_buffer_init(&buffer, data, BUFFER_SIZE);
+        if (!DNS_buffer_write_packet(&buffer, corpus[i])) {
+            DNS_log_error("[ dns_bench  ] Failed to encode the %s packet, try fewer RRs.", case_names[i]);
+            return -1;
+        }
+        uint32 length = buffer.pos;
+        int rrs = corpus[i].header.answer_count + corpus[i].header.authority_count +
+                  corpus[i].header.additional_count;
+
+        for (int op = 0; op < OP_COUNT; op++) {
+            bench_result_t result;
+            if (!bench_measure(op, &corpus[i], data, length, arena, iterations, &result)) {
+                DNS_log_error("[ dns_bench  ] Failed to %s the %s packet.", bench_op_names[op], case_names[i]);
+                return -1;
+            }
+            printf("%-16s %5d %7u  %-12s %12.1f %10.2f %10.1f\n", case_names[i], rrs, length, bench_op_names[op],
+                   result.ns, result.allocs, result.bytes);
+        }
+    }
+
+    DNS_arena_free(arena);
+    return 0;
+}
@@ -0,0 +1,143 @@
+//
+// dns_latency.c -- Implementation of the latency of the stages. Each thread records into its own histograms,
+//                  which are linked into a list when the thread records for the first time, so the writers
+//                  never take a lock. The readers merge the histograms while they may be updated, so a
+//                  sample being recorded may be missed, which does not matter for the percentiles
+// Created on 10/15/26.
+//
+
+#define _POSIX_C_SOURCE 200809L   // For clock_gettime
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include "dns_common.h"
+#include "dns_latency.h"
+
+/**
+ * The histograms of one thread
+ */
+typedef struct latency_thread {
+    dns_histogram_t stages[LATENCY_STAGES];
+    struct latency_thread *next;
+} latency_thread_t;
+
+volatile bool latency_enabled = false;
+
+// The histograms of all the threads, only added to
+latency_thread_t *latency_threads = NULL;
+pthread_mutex_t latency_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread latency_thread_t *latency_local = NULL;
+
+// Set by SIGUSR2, the timing is turned on or off by the next iteration of an event loop
+static volatile sig_atomic_t latency_toggle_requested = 0;
+
+const char *latency_stage_names[LATENCY_STAGES] = {
+        "request", "decode", "response", "cache", "database", "upstream", "resolution", "encode"
+};
+
+void latency_handle_sigusr2(int sig) {
+    (void) sig;
+    latency_toggle_requested = 1;
+}
+
+unsigned long DNS_latency_now() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long) now.tv_sec * 1000000000ul + (unsigned long) now.tv_nsec + 1;
+}
+
+void DNS_latency_record(dns_latency_stage_t stage, unsigned long start) {
+    unsigned long end = DNS_latency_now();
+    if (latency_local == NULL) {
+        latency_thread_t *local = (latency_thread_t *) calloc(1, sizeof(latency_thread_t));
+        if (local == NULL) {
+            return;
+        }
+        pthread_mutex_lock(&latency_lock);
+        local->next = latency_threads;
+        latency_threads = local;
+        pthread_mutex_unlock(&latency_lock);
+        latency_local = local;
+    }
+    DNS_histogram_record(&latency_local->stages[stage], end > start ? end - start : 0);
+}
+
+void DNS_latency_set_enabled(bool enabled) {
+    if (enabled && !latency_enabled) {
+        pthread_mutex_lock(&latency_lock);
+        for (latency_thread_t *t = latency_threads; t != NULL; t = t->next) {
+            for (int i = 0; i < LATENCY_STAGES; i++) {
+                DNS_histogram_reset(&t->stages[i]);
+            }
+        }
+        pthread_mutex_unlock(&latency_lock);
+    }
+    latency_enabled = enabled;
+}
+
+void DNS_latency_watch_signal() {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = latency_handle_sigusr2;
+    action.sa_flags = SA_RESTART;
+    sigaction(SIGUSR2, &action, NULL);
+}
+
+void DNS_latency_poll() {
+    // Only one of the event loops handles the signal
+    if (!latency_toggle_requested || !__atomic_exchange_n(&latency_toggle_requested, 0, __ATOMIC_ACQ_REL)) {
+        return;
+    }
+    if (latency_enabled) {
+        DNS_latency_set_enabled(false);
+        DNS_log_info("[ dns_latency] Latency timing is turned off");
+        DNS_latency_print();
+    }
+    else {
+        DNS_latency_set_enabled(true);
+        DNS_log_info("[ dns_latency] Latency timing is turned on");
+    }
+}
+
+void DNS_latency_merge(dns_histogram_t stages[LATENCY_STAGES]) {
+    for (int i = 0; i < LATENCY_STAGES; i++) {
+        DNS_histogram_reset(&stages[i]);
+    }
+    pthread_mutex_lock(&latency_lock);
+    for (latency_thread_t *t = latency_threads; t != NULL; t = t->next) {
+        for (int i = 0; i < LATENCY_STAGES; i++) {
+            DNS_histogram_merge(&stages[i], &t->stages[i]);
+        }
+    }
+    pthread_mutex_unlock(&latency_lock);
+}
+
+const char *DNS_latency_stage_name(dns_latency_stage_t stage) {
+    return stage < LATENCY_STAGES ? latency_stage_names[stage] : "unknown";
+}
+
+void DNS_latency_print() {
+    static dns_histogram_t stages[LATENCY_STAGES];
+    static pthread_mutex_t print_lock = PTHREAD_MUTEX_INITIALIZER;
+
+    pthread_mutex_lock(&print_lock);
+    DNS_latency_merge(stages);
+    DNS_log_info("[ dns_latency] Latency of the stages in microseconds:");
+    for (int i = 0; i < LATENCY_STAGES; i++) {
+        if (stages[i].count == 0) {
+            continue;
+        }
+        DNS_log_info("[ dns_latency] %-10s %10lu samples, mean %.1f, p50 %.1f, p90 %.1f, p99 %.1f, "
+                     "p99.9 %.1f, max %.1f", latency_stage_names[i], stages[i].count,
+                     DNS_histogram_mean(&stages[i]) / 1000,
+                     DNS_histogram_percentile(&stages[i], 50) / 1000.0,
+                     DNS_histogram_percentile(&stages[i], 90) / 1000.0,
+                     DNS_histogram_percentile(&stages[i], 99) / 1000.0,
+                     DNS_histogram_percentile(&stages[i], 99.9) / 1000.0, stages[i].max / 1000.0);
+    }
+    pthread_mutex_unlock(&print_lock);
+}
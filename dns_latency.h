@@ -0,0 +1,99 @@
+//
+// dns_latency.h -- Latency of each stage of handling the requests. The stages are timed with the monotonic
+//                  clock and recorded into the histograms of the current thread without any lock, the
+//                  histograms of all the threads are merged when they are read. The timing can be turned
+//                  on and off while the server is running, and costs one branch per stage when it is off
+// Created on 10/15/26.
+//
+
+#ifndef PROJECT_DNS_DNS_LATENCY_H
+#define PROJECT_DNS_DNS_LATENCY_H
+
+#include "dns_histogram.h"
+
+/**
+ * The stages timed, the latencies are recorded in nanoseconds
+ */
+typedef enum {
+    LATENCY_REQUEST,        // A request handled at once, from decoding the request to encoding the response
+    LATENCY_DECODE,         // Parsing the request
+    LATENCY_RESPONSE,       // Creating the response, DNS_query_create_response(_local)
+    LATENCY_CACHE,          // Looking up the cache of the local server
+    LATENCY_DATABASE,       // Reading and writing the database
+    LATENCY_UPSTREAM,       // The round trip of a query to another server
+    LATENCY_RESOLUTION,     // A deferred request, from creating the response to sending it after the resolution
+    LATENCY_ENCODE,         // Encoding the response
+    LATENCY_STAGES
+} dns_latency_stage_t;
+
+// Whether the stages are timed, read without synchronization on every stage
+extern volatile bool latency_enabled;
+
+/**
+ * Get the current time of the monotonic clock
+ * @return The time in nanoseconds, never 0
+ */
+unsigned long DNS_latency_now();
+
+/**
+ * Record the latency of a stage in the histogram of the current thread
+ * @param stage The stage
+ * @param start The time the stage started, returned by {@code DNS_latency_start}
+ */
+void DNS_latency_record(dns_latency_stage_t stage, unsigned long start);
+
+/**
+ * Start timing a stage
+ * @return The current time, 0 if the timing is off
+ */
+static inline unsigned long DNS_latency_start() {
+    return latency_enabled ? DNS_latency_now() : 0;
+}
+
+/**
+ * Finish timing a stage, nothing is recorded if the timing was off when the stage started
+ * @param stage The stage
+ * @param start The time returned by {@code DNS_latency_start}
+ */
+static inline void DNS_latency_end(dns_latency_stage_t stage, unsigned long start) {
+    if (start != 0) {
+        DNS_latency_record(stage, start);
+    }
+}
+
+/**
+ * Turn the timing on or off, the histograms are cleared when it is turned on
+ * @param enabled Whether the stages are timed
+ */
+void DNS_latency_set_enabled(bool enabled);
+
+/**
+ * Turn the timing on or off when the process receives SIGUSR2, the change is made by the next
+ * {@code DNS_latency_poll} and the latencies are printed when the timing is turned off
+ */
+void DNS_latency_watch_signal();
+
+/**
+ * Handle the SIGUSR2 received, called by every iteration of the event loops
+ */
+void DNS_latency_poll();
+
+/**
+ * Merge the histograms of all the threads
+ * @param stages The histograms of all the stages to be filled
+ */
+void DNS_latency_merge(dns_histogram_t stages[LATENCY_STAGES]);
+
+/**
+ * Get the name of a stage
+ * @param stage The stage
+ * @return The name, like "decode"
+ */
+const char *DNS_latency_stage_name(dns_latency_stage_t stage);
+
+/**
+ * Print the count and the percentiles of the latencies of each stage recorded
+ */
+void DNS_latency_print();
+
+#endif //PROJECT_DNS_DNS_LATENCY_H
@@ -0,0 +1,479 @@
+//
+// dns_log.c -- Implementation of the asynchronous logger. The ring buffer of each thread has one producer
+//              (the thread) and one consumer (the thread printing the messages), so the records are
+//              passed with two indexes and no lock. The arguments are copied by walking the conversion
+//              specifications of the format, and the messages with the specifications not understood
+//              (like '*' widths) are formatted by the logging thread instead
+// Created on 10/15/26.
+//
+
+#define _POSIX_C_SOURCE 200809L   // For nanosleep and sigaction
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include "dns_common.h"
+#include "dns_log.h"
+
+#define LOG_RING_SLOTS 1024         // The number of the records of each thread, should be power of 2
+#define LOG_RECORD_SIZE 512         // The size of a record, the long strings are truncated to fit
+#define LOG_MESSAGE_LEN 1024        // The maximum length of a formatted message
+#define LOG_SPEC_LEN 32             // The maximum length of a conversion specification
+#define LOG_IDLE_NS 1000000         // The time the logging thread sleeps when there is no message
+
+/**
+ * The kinds of the arguments of the conversion specifications
+ */
+enum {
+    ARG_NONE,           // "%%"
+    ARG_SIGNED,
+    ARG_UNSIGNED,
+    ARG_CHAR,
+    ARG_DOUBLE,
+    ARG_STRING,
+    ARG_POINTER,
+    ARG_UNSUPPORTED
+};
+
+/**
+ * The length modifiers of the integers
+ */
+enum {
+    LENGTH_INT,         // None, "h" or "hh", the arguments are promoted to int
+    LENGTH_LONG,        // "l"
+    LENGTH_LONG_LONG,   // "ll" or "j"
+    LENGTH_SIZE         // "z" or "t"
+};
+
+/**
+ * A conversion specification in the format
+ */
+typedef struct {
+    int kind;
+    int length;
+    int prefix;         // The length of '%', the flags, the width and the precision
+    int size;           // The length of the whole specification
+    char conversion;
+} log_spec_t;
+
+/**
+ * A message in the ring buffer. The integers, the doubles and the pointers are stored in 8 bytes each
+ * and the strings are stored with their terminating '\0', in the order of the format
+ */
+typedef struct {
+    const char *format;     // NULL if the message is formatted already, and the data is the text
+    uint16 level;
+    uint16 length;
+    uint8 data[LOG_RECORD_SIZE - sizeof(const char *) - 2 * sizeof(uint16)];
+} log_record_t;
+
+/**
+ * The ring buffer of a thread
+ */
+typedef struct log_ring {
+    uint32 head;                    // The next record to write, only written by the owner thread
+    uint32 tail;                    // The next record to print, only written by the logging thread
+    unsigned long dropped;          // The messages dropped since the ring was full
+    unsigned long reported;         // The dropped messages reported by the logging thread
+    log_record_t records[LOG_RING_SLOTS];
+    struct log_ring *next;
+} log_ring_t;
+
+// The rings of all the threads, only added to
+log_ring_t *log_rings = NULL;
+pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Held while printing the messages, so the rings are consumed by one thread at a time
+pthread_mutex_t log_print_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread log_ring_t *log_local = NULL;
+
+// The level restored when the trace messages are turned off by SIGHUP
+static volatile sig_atomic_t log_saved_level = LOG_LEVEL_INFO;
+
+// The file the level is read from on SIGHUP, NULL to turn the trace messages on and off instead
+static const char *log_level_file = NULL;
+
+// Set by SIGHUP when the level is read from the file, the file is read by the logging thread
+static volatile sig_atomic_t log_reload_requested = 0;
+
+/**
+ * Parse the conversion specification starting with '%'
+ * @param format Points to the '%'
+ * @param spec The specification to be filled
+ */
+void log_parse_spec(const char *format, log_spec_t *spec) {
+    const char *c = format + 1;
+    while (*c != '\0' && strchr("-+ #0", *c) != NULL) {
+        c++;
+    }
+    while ((*c >= '0' && *c <= '9') || *c == '.') {
+        c++;
+    }
+    spec->prefix = (int) (c - format);
+
+    spec->length = LENGTH_INT;
+    bool supported = *c != '*';
+    if (*c == 'h') {
+        c += c[1] == 'h' ? 2 : 1;
+    }
+    else if (*c == 'l') {
+        spec->length = c[1] == 'l' ? LENGTH_LONG_LONG : LENGTH_LONG;
+        c += c[1] == 'l' ? 2 : 1;
+    }
+    else if (*c == 'j' || *c == 'z' || *c == 't') {
+        spec->length = *c == 'j' ? LENGTH_LONG_LONG : LENGTH_SIZE;
+        c++;
+    }
+    else if (*c == 'L') {
+        supported = false;
+    }
+
+    spec->conversion = *c;
+    spec->size = (int) (c - format) + (*c != '\0' ? 1 : 0);
+    if (!supported || spec->prefix + 3 >= LOG_SPEC_LEN) {
+        spec->kind = ARG_UNSUPPORTED;
+    }
+    else if (*c == '%') {
+        spec->kind = spec->prefix == 1 ? ARG_NONE : ARG_UNSUPPORTED;
+    }
+    else if (*c == 'd' || *c == 'i') {
+        spec->kind = ARG_SIGNED;
+    }
+    else if (*c == 'u' || *c == 'x' || *c == 'X' || *c == 'o') {
+        spec->kind = ARG_UNSIGNED;
+    }
+    else if (*c == 'c') {
+        spec->kind = ARG_CHAR;
+    }
+    else if (*c != '\0' && strchr("fFeEgGaA", *c) != NULL) {
+        spec->kind = ARG_DOUBLE;
+    }
+    else if (*c == 's') {
+        spec->kind = ARG_STRING;
+    }
+    else if (*c == 'p') {
+        spec->kind = ARG_POINTER;
+    }
+    else {
+        spec->kind = ARG_UNSUPPORTED;
+    }
+}
+
+/**
+ * Copy the arguments of the message into the record without formatting them
+ * @return False if the format has specifications not supported or the arguments do not fit in the record
+ */
+bool log_capture(log_record_t *record, const char *format, va_list args) {
+    uint32 pos = 0;
+    const char *c = format;
+    while (*c != '\0') {
+        if (*c != '%') {
+            c++;
+            continue;
+        }
+        log_spec_t spec;
+        log_parse_spec(c, &spec);
+        c += spec.size;
+        if (spec.kind == ARG_NONE) {
+            continue;
+        }
+        if (spec.kind == ARG_UNSUPPORTED || pos + 8 > sizeof(record->data)) {
+            return false;
+        }
+
+        if (spec.kind == ARG_SIGNED || spec.kind == ARG_CHAR) {
+            long long value = spec.length == LENGTH_LONG ? va_arg(args, long) :
+                              spec.length == LENGTH_LONG_LONG ? va_arg(args, long long) :
+                              spec.length == LENGTH_SIZE ? (long long) va_arg(args, size_t) : va_arg(args, int);
+            memcpy(&record->data[pos], &value, 8);
+            pos += 8;
+        }
+        else if (spec.kind == ARG_UNSIGNED) {
+            unsigned long long value = spec.length == LENGTH_LONG ? va_arg(args, unsigned long) :
+                                       spec.length == LENGTH_LONG_LONG ? va_arg(args, unsigned long long) :
+                                       spec.length == LENGTH_SIZE ? va_arg(args, size_t) : va_arg(args, unsigned int);
+            memcpy(&record->data[pos], &value, 8);
+            pos += 8;
+        }
+        else if (spec.kind == ARG_DOUBLE) {
+            double value = va_arg(args, double);
+            memcpy(&record->data[pos], &value, 8);
+            pos += 8;
+        }
+        else if (spec.kind == ARG_POINTER) {
+            uint64_t value = (uint64_t) (uintptr_t) va_arg(args, void *);
+            memcpy(&record->data[pos], &value, 8);
+            pos += 8;
+        }
+        else {
+            // The string may be gone when the message is printed, the end of it is cut off if it does not fit
+            const char *str = va_arg(args, const char *);
+            if (str == NULL) {
+                str = "(null)";
+            }
+            size_t len = strlen(str);
+            if (len > sizeof(record->data) - pos - 1) {
+                len = sizeof(record->data) - pos - 1;
+            }
+            memcpy(&record->data[pos], str, len);
+            record->data[pos + len] = '\0';
+            pos += (uint32) len + 1;
+        }
+    }
+    record->format = format;
+    record->length = (uint16) pos;
+    return true;
+}
+
+/**
+ * Format the message of a record with the arguments copied by {@code log_capture}
+ * @param out The buffer of the message
+ * @param size The size of the buffer
+ */
+void log_format(const log_record_t *record, char *out, size_t size) {
+    if (record->format == NULL) {
+        snprintf(out, size, "%s", (const char *) record->data);
+        return;
+    }
+
+    size_t n = 0;
+    uint32 pos = 0;
+    const char *c = record->format;
+    while (*c != '\0' && n < size - 1) {
+        if (*c != '%') {
+            out[n++] = *c++;
+            continue;
+        }
+        log_spec_t spec;
+        log_parse_spec(c, &spec);
+        if (spec.kind == ARG_NONE) {
+            out[n++] = '%';
+            c += spec.size;
+            continue;
+        }
+
+        // Keep the flags, the width and the precision, the integers are all passed as long long
+        char format[LOG_SPEC_LEN];
+        int format_len = spec.prefix;
+        memcpy(format, c, (size_t) spec.prefix);
+        if (spec.kind == ARG_SIGNED || spec.kind == ARG_UNSIGNED) {
+            format[format_len++] = 'l';
+            format[format_len++] = 'l';
+        }
+        format[format_len++] = spec.conversion;
+        format[format_len] = '\0';
+        c += spec.size;
+
+        int len;
+        const uint8 *arg = &record->data[pos];
+        if (spec.kind == ARG_STRING) {
+            len = snprintf(out + n, size - n, format, (const char *) arg);
+            pos += (uint32) strlen((const char *) arg) + 1;
+        }
+        else {
+            uint64_t value;
+            memcpy(&value, arg, 8);
+            pos += 8;
+            if (spec.kind == ARG_SIGNED) {
+                len = snprintf(out + n, size - n, format, (long long) value);
+            }
+            else if (spec.kind == ARG_UNSIGNED) {
+                len = snprintf(out + n, size - n, format, (unsigned long long) value);
+            }
+            else if (spec.kind == ARG_CHAR) {
+                len = snprintf(out + n, size - n, format, (int) value);
+            }
+            else if (spec.kind == ARG_DOUBLE) {
+                double d;
+                memcpy(&d, arg, 8);
+                len = snprintf(out + n, size - n, format, d);
+            }
+            else {
+                len = snprintf(out + n, size - n, format, (void *) (uintptr_t) value);
+            }
+        }
+        if (len > 0) {
+            n += (size_t) len < size - 1 - n ? (size_t) len : size - 1 - n;
+        }
+    }
+    out[n] = '\0';
+}
+
+/**
+ * Get the ring buffer of the current thread, it is created when the thread logs for the first time
+ * @return The ring, NULL if out of memory
+ */
+log_ring_t *log_get_ring() {
+    if (log_local == NULL) {
+        log_ring_t *ring = (log_ring_t *) calloc(1, sizeof(log_ring_t));
+        if (ring == NULL) {
+            return NULL;
+        }
+        pthread_mutex_lock(&log_lock);
+        ring->next = log_rings;
+        log_rings = ring;
+        pthread_mutex_unlock(&log_lock);
+        log_local = ring;
+    }
+    return log_local;
+}
+
+/**
+ * Put a message into the ring buffer of the current thread, the message is dropped if the ring is full
+ * @return False if the message should be printed at once
+ */
+bool log_sink_async(int level, const char *format, va_list args) {
+    log_ring_t *ring = log_get_ring();
+    if (ring == NULL) {
+        return false;
+    }
+    uint32 head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= LOG_RING_SLOTS) {
+        __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+        return true;
+    }
+
+    log_record_t *record = &ring->records[head & (LOG_RING_SLOTS - 1)];
+    va_list copy;
+    va_copy(copy, args);
+    if (!log_capture(record, format, copy)) {
+        vsnprintf((char *) record->data, sizeof(record->data), format, args);
+        record->format = NULL;
+    }
+    va_end(copy);
+    record->level = (uint16) level;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/**
+ * Print the messages in all the rings
+ * @return True if any message is printed
+ */
+bool log_print_all() {
+    char message[LOG_MESSAGE_LEN];
+    bool printed = false;
+
+    pthread_mutex_lock(&log_print_lock);
+    pthread_mutex_lock(&log_lock);
+    log_ring_t *rings = log_rings;
+    pthread_mutex_unlock(&log_lock);
+
+    for (log_ring_t *ring = rings; ring != NULL; ring = ring->next) {
+        uint32 tail = ring->tail;
+        uint32 head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        while (tail != head) {
+            log_record_t *record = &ring->records[tail & (LOG_RING_SLOTS - 1)];
+            log_format(record, message, LOG_MESSAGE_LEN);
+            DNS_log_print(record->level, message);
+            __atomic_store_n(&ring->tail, ++tail, __ATOMIC_RELEASE);
+            printed = true;
+        }
+
+        unsigned long dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+        if (dropped != ring->reported) {
+            snprintf(message, LOG_MESSAGE_LEN, "[  dns_log   ] %lu messages dropped, the logging is too slow",
+                     dropped - ring->reported);
+            DNS_log_print(LOG_LEVEL_WARNING, message);
+            ring->reported = dropped;
+            printed = true;
+        }
+    }
+    if (printed) {
+        fflush(stdout);
+    }
+    pthread_mutex_unlock(&log_print_lock);
+    return printed;
+}
+
+/**
+ * Set the level to the first word of the level file, called by the logging thread after SIGHUP
+ */
+void log_reload_level() {
+    char line[32];
+    FILE *file = fopen(log_level_file, "r");
+    if (file == NULL) {
+        DNS_log_warning("[  dns_log   ] Failed to open the log level file %s: %s", log_level_file, strerror(errno));
+        return;
+    }
+    if (fgets(line, sizeof(line), file) == NULL) {
+        line[0] = '\0';
+    }
+    fclose(file);
+
+    line[strcspn(line, " \t\r\n")] = '\0';
+    int level = DNS_log_level_from_str(line);
+    if (level < 0) {
+        DNS_log_warning("[  dns_log   ] Invalid log level '%s' in %s, should be trace, info, warning or error",
+                        line, log_level_file);
+        return;
+    }
+    log_level = level;
+    DNS_log_info("[  dns_log   ] Log level set to %s", line);
+}
+
+/**
+ * The entry of the logging thread
+ */
+void *log_main(void *arg) {
+    (void) arg;
+    struct timespec idle = {0, LOG_IDLE_NS};
+    while (true) {
+        if (log_reload_requested) {
+            log_reload_requested = 0;
+            log_reload_level();
+        }
+        if (!log_print_all()) {
+            nanosleep(&idle, NULL);
+        }
+    }
+    return NULL;
+}
+
+bool DNS_log_start_async() {
+    pthread_t thread;
+    int ret = pthread_create(&thread, NULL, log_main, NULL);
+    if (ret != 0) {
+        DNS_log_error("[  dns_log   ] Failed to start the logging thread: %s", strerror(ret));
+        return false;
+    }
+    pthread_detach(thread);
+    atexit(DNS_log_flush);
+    DNS_log_set_sink(log_sink_async);
+    return true;
+}
+
+void DNS_log_flush() {
+    log_print_all();
+}
+
+void log_handle_sighup(int sig) {
+    (void) sig;
+    if (log_level_file != NULL) {
+        log_reload_requested = 1;   // Reading the file is not safe in a signal handler
+    }
+    else if (log_level == LOG_LEVEL_TRACE) {
+        log_level = log_saved_level;
+    }
+    else {
+        log_saved_level = log_level;
+        log_level = LOG_LEVEL_TRACE;
+    }
+}
+
+void DNS_log_watch_signal(const char *level_file) {
+    log_level_file = level_file;
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = log_handle_sighup;
+    action.sa_flags = SA_RESTART;
+    sigaction(SIGHUP, &action, NULL);
+}
@@ -0,0 +1,35 @@
+//
+// dns_log.h -- Asynchronous logger of the servers. Each thread puts its messages into its own ring buffer
+//              without formatting them: only the format and the arguments are copied (the strings are
+//              copied since they may not live long). A background thread formats and prints them, so
+//              the threads handling the requests never wait for the terminal
+// Created on 10/15/26.
+//
+
+#ifndef PROJECT_DNS_DNS_LOG_H
+#define PROJECT_DNS_DNS_LOG_H
+
+#include "dns_io.h"
+
+/**
+ * Start the background thread and take all the messages logged afterwards. The messages are
+ * dropped (and the number of them reported) when the ring buffer of a thread is full
+ * @return True if started
+ */
+bool DNS_log_start_async();
+
+/**
+ * Print all the messages taken so far, called when the process exits
+ */
+void DNS_log_flush();
+
+/**
+ * Change the level when the process receives SIGHUP, so the messages logged can be changed while the server
+ * is running. The level is read from the file if given (the first word of the file: trace, info, warning or
+ * error) once the logging thread is started, otherwise SIGHUP switches between the trace level and the level
+ * set before, turning the trace messages on and off
+ * @param level_file The path of the file to read the level from, NULL to turn the trace messages on and off
+ */
+void DNS_log_watch_signal(const char *level_file);
+
+#endif //PROJECT_DNS_DNS_LOG_H
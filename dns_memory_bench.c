@@ -0,0 +1,134 @@
+//
+// dns_memory_bench.c -- Benchmark for the memory usage of the authoritative servers. The requests are sent
+//                       over the loopback interface and handled one by one with the server code, and the
+//                       resident set size of the process is printed periodically. With the requests
+//                       allocated from the arena, the resident set size should stay flat
+// Created on 10/15/26.
+//
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "dns_common.h"
+#include "dns_network.h"
+#include "dns_query.h"
+#include "dns_zone.h"
+
+#define BUFFER_SIZE 1024
+#define DEFAULT_QUERIES 2000000
+#define REPORT_COUNT 10       // How many times the memory usage is printed
+
+/**
+ * Get the resident set size of the process
+ * @return The resident set size in kilobytes, 0 if failed
+ */
+unsigned long bench_get_rss_kb() {
+    unsigned long size, resident;
+    FILE *file = fopen("/proc/self/statm", "r");
+    if (file == NULL) {
+        return 0;
+    }
+    if (fscanf(file, "%lu %lu", &size, &resident) != 2) {
+        resident = 0;
+    }
+    fclose(file);
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+/**
+ * Create the server socket on a random port of the loopback interface
+ * @param addr Returns the address of the socket
+ * @return The socket, -1 if failed
+ */
+int bench_create_server_socket(struct sockaddr_in *addr) {
+    int sock = socket(PF_INET, SOCK_DGRAM, 0);
+    if (sock < 0) {
+        return -1;
+    }
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_port = 0;
+    addr->sin_addr.s_addr = inet_addr("127.0.0.1");
+    socklen_t len = sizeof(*addr);
+    if (bind(sock, (struct sockaddr *) addr, sizeof(*addr)) < 0 ||
+        getsockname(sock, (struct sockaddr *) addr, &len) < 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+/**
+ * Main entry of the benchmark
+ * Usage: dns_memory_bench [queries] [--memory-zone]
+ */
+int main(int argc, char **argv) {
+    unsigned long queries = DEFAULT_QUERIES;
+    bool memory_zone = false;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--memory-zone")) {
+            memory_zone = true;
+        }
+        else {
+            queries = strtoul(argv[i], NULL, 10);
+        }
+    }
+    if (queries < REPORT_COUNT) {
+        queries = REPORT_COUNT;
+    }
+
+    DNS_query_set_table_name("s2");
+    if (memory_zone && !DNS_zone_load("s2")) {
+        DNS_log_error("[ dns_bench  ] Failed to load the records into memory.");
+        return -1;
+    }
+
+    struct sockaddr_in addr;
+    int server_sock = bench_create_server_socket(&addr);
+    int client_sock = socket(PF_INET, SOCK_DGRAM, 0);
+    if (server_sock < 0 || client_sock < 0) {
+        DNS_log_error("[ dns_bench  ] Failed to create sockets.");
+        return -1;
+    }
+
+    // The request is encoded once, the response of it contains a CNAME and two A records
+    char request[BUFFER_SIZE];
+    char response[BUFFER_SIZE];
+    struct dns_buffer buffer;
+    DNS_buffer_init(&buffer, request, BUFFER_SIZE);
+    DNS_buffer_write_packet(&buffer, DNS_query_create_request("www.baidu.com", TYPE_A));
+    int request_len = buffer.pos;
+
+    printf("%12s %12s %12s\n", "queries", "rss (KB)", "qps");
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (unsigned long i = 1; i <= queries; i++) {
+        if (sendto(client_sock, request, request_len, 0, (struct sockaddr *) &addr, sizeof(addr)) < 0 ) {
+            DNS_log_error("[ dns_bench  ] Failed to send the request.");
+            return -1;
+        }
+        DNS_network_handle_query_udp(server_sock, DNS_query_create_response);
+        if (recv(client_sock, response, sizeof(response), 0) <= 0) {
+            DNS_log_error("[ dns_bench  ] Failed to receive the response.");
+            return -1;
+        }
+
+        if (i % (queries / REPORT_COUNT) == 0) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            double seconds = (double) (now.tv_sec - start.tv_sec) + (double) (now.tv_nsec - start.tv_nsec) / 1e9;
+            printf("%12lu %12lu %12.0f\n", i, bench_get_rss_kb(), (double) i / seconds);
+        }
+    }
+
+    close(client_sock);
+    close(server_sock);
+    return 0;
+}
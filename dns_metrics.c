@@ -0,0 +1,431 @@
+//
+// dns_metrics.c -- Implementation of the metrics. Each thread counts into its own counters, which are linked
+//                  into a list when the thread counts for the first time. The metrics thread reads them
+//                  while they may be updated, so a scrape may miss the last few counts, which are seen by
+//                  the next scrape
+// Created on 10/15/26.
+//
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "dns_common.h"
+#include "dns_metrics.h"
+#include "dns_cache.h"
+#include "dns_upstream.h"
+#include "dns_latency.h"
+
+#define METRICS_TYPES 7             // The types counted separately, the last one is for the other types
+#define METRICS_RCODES 16
+#define METRICS_UPSTREAMS 1024      // The maximum number of the upstream servers exported
+#define METRICS_TIMEOUT 5           // The seconds a scrape may take before the connection is closed
+#define REQUEST_SIZE 1024
+
+/**
+ * The counters of one thread
+ */
+typedef struct metrics_thread {
+    unsigned long queries[2][METRICS_TYPES][METRICS_RCODES];    // By the transport, the type and the rcode
+    unsigned long cache_hits;
+    unsigned long cache_misses;
+    unsigned long negative_hits;
+    long resolutions;
+    struct metrics_thread *next;
+} metrics_thread_t;
+
+/**
+ * The text of a response, grows as the metrics are written
+ */
+typedef struct {
+    char *data;
+    size_t length;
+    size_t capacity;
+} metrics_buffer_t;
+
+/**
+ * The socket listening for the scrapes
+ */
+typedef struct {
+    int sock;
+} metrics_server_t;
+
+// The counters of all the threads, only added to
+metrics_thread_t *metrics_threads = NULL;
+pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread metrics_thread_t *metrics_local = NULL;
+
+const uint16 metrics_types[METRICS_TYPES - 1] = {TYPE_A, TYPE_NS, TYPE_CNAME, TYPE_SOA, TYPE_PTR, TYPE_MX};
+
+const char *metrics_rcode_names[] = {"NOERROR", "FORMERR", "SERVFAIL", "NXDOMAIN", "NOTIMP", "REFUSED"};
+
+/**
+ * Get the counters of the current thread, they are created when the thread counts for the first time
+ * @return The counters, NULL if out of memory
+ */
+metrics_thread_t *metrics_get_local() {
+    if (metrics_local == NULL) {
+        metrics_thread_t *local = (metrics_thread_t *) calloc(1, sizeof(metrics_thread_t));
+        if (local == NULL) {
+            return NULL;
+        }
+        pthread_mutex_lock(&metrics_lock);
+        local->next = metrics_threads;
+        metrics_threads = local;
+        pthread_mutex_unlock(&metrics_lock);
+        metrics_local = local;
+    }
+    return metrics_local;
+}
+
+void DNS_metrics_count_query(bool tcp, int type, int rcode) {
+    metrics_thread_t *local = metrics_get_local();
+    if (local == NULL) {
+        return;
+    }
+    int index = 0;
+    while (index < METRICS_TYPES - 1 && metrics_types[index] != type) {
+        index++;
+    }
+    local->queries[tcp ? 1 : 0][index][rcode & (METRICS_RCODES - 1)]++;
+}
+
+void DNS_metrics_count_cache_lookup(bool hit) {
+    metrics_thread_t *local = metrics_get_local();
+    if (local == NULL) {
+        return;
+    }
+    if (hit) {
+        local->cache_hits++;
+    }
+    else {
+        local->cache_misses++;
+    }
+}
+
+void DNS_metrics_count_negative_hit() {
+    metrics_thread_t *local = metrics_get_local();
+    if (local != NULL) {
+        local->negative_hits++;
+    }
+}
+
+void DNS_metrics_add_resolutions(int delta) {
+    metrics_thread_t *local = metrics_get_local();
+    if (local != NULL) {
+        local->resolutions += delta;
+    }
+}
+
+/**
+ * Append formatted text to the buffer
+ * @return False if out of memory
+ */
+bool metrics_printf(metrics_buffer_t *buffer, const char *format, ...) {
+    while (true) {
+        va_list args;
+        va_start(args, format);
+        int len = vsnprintf(buffer->data + buffer->length, buffer->capacity - buffer->length, format, args);
+        va_end(args);
+        if (len < 0) {
+            return false;
+        }
+        if (buffer->length + len < buffer->capacity) {
+            buffer->length += len;
+            return true;
+        }
+
+        size_t capacity = buffer->capacity * 2 > buffer->length + len + 1 ? buffer->capacity * 2
+                                                                          : buffer->length + len + 1;
+        char *data = (char *) realloc(buffer->data, capacity);
+        if (data == NULL) {
+            return false;
+        }
+        buffer->data = data;
+        buffer->capacity = capacity;
+    }
+}
+
+/**
+ * Write the counters of all the threads
+ */
+void metrics_write_counters(metrics_buffer_t *buffer) {
+    static metrics_thread_t total;
+    memset(&total, 0, sizeof(total));
+    pthread_mutex_lock(&metrics_lock);
+    for (metrics_thread_t *t = metrics_threads; t != NULL; t = t->next) {
+        for (int i = 0; i < 2; i++) {
+            for (int j = 0; j < METRICS_TYPES; j++) {
+                for (int k = 0; k < METRICS_RCODES; k++) {
+                    total.queries[i][j][k] += t->queries[i][j][k];
+                }
+            }
+        }
+        total.cache_hits += t->cache_hits;
+        total.cache_misses += t->cache_misses;
+        total.negative_hits += t->negative_hits;
+        total.resolutions += t->resolutions;
+    }
+    pthread_mutex_unlock(&metrics_lock);
+
+    metrics_printf(buffer, "# HELP dns_queries_total The requests answered.\n"
+                           "# TYPE dns_queries_total counter\n");
+    for (int i = 0; i < 2; i++) {
+        for (int j = 0; j < METRICS_TYPES; j++) {
+            for (int k = 0; k < METRICS_RCODES; k++) {
+                if (total.queries[i][j][k] == 0) {
+                    continue;
+                }
+                char rcode[8];
+                if (k < (int) (sizeof(metrics_rcode_names) / sizeof(metrics_rcode_names[0]))) {
+                    strcpy(rcode, metrics_rcode_names[k]);
+                }
+                else {
+                    sprintf(rcode, "%d", k);
+                }
+                metrics_printf(buffer, "dns_queries_total{transport=\"%s\",type=\"%s\",rcode=\"%s\"} %lu\n",
+                               i ? "tcp" : "udp", j < METRICS_TYPES - 1 ? DNS_type_to_str(metrics_types[j]) : "other",
+                               rcode, total.queries[i][j][k]);
+            }
+        }
+    }
+
+    unsigned long entries, bytes;
+    DNS_cache_get_usage(&entries, &bytes);
+    metrics_printf(buffer, "# HELP dns_cache_lookups_total The questions of the clients looked up in the cache by the result.\n"
+                           "# TYPE dns_cache_lookups_total counter\n"
+                           "dns_cache_lookups_total{result=\"hit\"} %lu\n"
+                           "dns_cache_lookups_total{result=\"miss\"} %lu\n"
+                           "dns_cache_lookups_total{result=\"negative\"} %lu\n"
+                           "# HELP dns_cache_entries The RRsets and negative answers in the cache.\n"
+                           "# TYPE dns_cache_entries gauge\n"
+                           "dns_cache_entries %lu\n"
+                           "# HELP dns_cache_bytes The memory taken by the cache.\n"
+                           "# TYPE dns_cache_bytes gauge\n"
+                           "dns_cache_bytes %lu\n"
+                           "# HELP dns_resolutions_in_flight The resolutions waiting for the other servers.\n"
+                           "# TYPE dns_resolutions_in_flight gauge\n"
+                           "dns_resolutions_in_flight %ld\n",
+                   total.cache_hits, total.cache_misses, total.negative_hits, entries, bytes, total.resolutions);
+}
+
+/**
+ * Write the statistics of the upstream servers
+ */
+void metrics_write_upstreams(metrics_buffer_t *buffer) {
+    static dns_upstream_stats_t stats[METRICS_UPSTREAMS];
+    int count = DNS_upstream_get_stats(stats, METRICS_UPSTREAMS);
+    const char *names[] = {"queries_total", "responses_total", "timeouts_total", "srtt_seconds",
+                           "rttvar_seconds", "rto_seconds"};
+    const char *helps[] = {"The queries sent to the server.", "The responses of the server.",
+                           "The queries to the server timed out.", "The smoothed round-trip time of the server.",
+                           "The variance of the round-trip time of the server.",
+                           "The timeout of the next query to the server."};
+
+    for (int i = 0; i < 6; i++) {
+        metrics_printf(buffer, "# HELP dns_upstream_%s %s\n# TYPE dns_upstream_%s %s\n", names[i], helps[i],
+                       names[i], i < 3 ? "counter" : "gauge");
+        for (int j = 0; j < count; j++) {
+            struct in_addr addr;
+            char str[INET_ADDRSTRLEN];
+            addr.s_addr = htonl(stats[j].address);
+            inet_ntop(AF_INET, &addr, str, sizeof(str));
+            if (i < 3) {
+                unsigned long values[] = {stats[j].queries, stats[j].responses, stats[j].timeouts};
+                metrics_printf(buffer, "dns_upstream_%s{server=\"%s\"} %lu\n", names[i], str, values[i]);
+            }
+            else {
+                double values[] = {stats[j].srtt, stats[j].rttvar, stats[j].rto};
+                metrics_printf(buffer, "dns_upstream_%s{server=\"%s\"} %.6f\n", names[i], str,
+                               values[i - 3] / 1000);
+            }
+        }
+    }
+}
+
+/**
+ * Write the latency of the stages as summaries, only the stages timed since the timing is turned on
+ */
+void metrics_write_latency(metrics_buffer_t *buffer) {
+    static dns_histogram_t stages[LATENCY_STAGES];
+    const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+    DNS_latency_merge(stages);
+    metrics_printf(buffer, "# HELP dns_stage_latency_seconds The latency of the stages of handling the requests.\n"
+                           "# TYPE dns_stage_latency_seconds summary\n");
+    for (int i = 0; i < LATENCY_STAGES; i++) {
+        const char *name = DNS_latency_stage_name((dns_latency_stage_t) i);
+        for (int j = 0; j < 4; j++) {
+            metrics_printf(buffer, "dns_stage_latency_seconds{stage=\"%s\",quantile=\"%g\"} %.9f\n", name,
+                           quantiles[j], DNS_histogram_percentile(&stages[i], quantiles[j] * 100) / 1e9);
+        }
+        metrics_printf(buffer, "dns_stage_latency_seconds_sum{stage=\"%s\"} %.9f\n"
+                               "dns_stage_latency_seconds_count{stage=\"%s\"} %lu\n",
+                       name, stages[i].sum / 1e9, name, stages[i].count);
+    }
+}
+
+/**
+ * Send all the data on the socket
+ * @return False if failed
+ */
+bool metrics_send_all(int sock, const char *data, size_t length) {
+    while (length > 0) {
+        ssize_t ret = send(sock, data, length, MSG_NOSIGNAL);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            return false;
+        }
+        data += ret;
+        length -= (size_t) ret;
+    }
+    return true;
+}
+
+/**
+ * Answer one scrape, the metrics are served on "/" and "/metrics", the connection is closed after the response
+ * @param sock The connection
+ */
+void metrics_handle_connection(int sock) {
+    static metrics_buffer_t buffer = {NULL, 0, 0};
+    char request[REQUEST_SIZE];
+    size_t length = 0;
+
+    // Read the request line and the headers, the body is ignored
+    while (length < REQUEST_SIZE - 1) {
+        ssize_t ret = recv(sock, request + length, REQUEST_SIZE - 1 - length, 0);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            return;
+        }
+        length += (size_t) ret;
+        request[length] = '\0';
+        if (strstr(request, "\r\n\r\n") != NULL || strstr(request, "\n\n") != NULL) {
+            break;
+        }
+    }
+    request[length] = '\0';
+
+    char header[256];
+    if (strncmp(request, "GET / ", 6) != 0 && strncmp(request, "GET /metrics ", 13) != 0 &&
+        strncmp(request, "GET /metrics?", 13) != 0) {
+        const char *not_found = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+        metrics_send_all(sock, not_found, strlen(not_found));
+        return;
+    }
+
+    buffer.length = 0;
+    if (buffer.data == NULL) {
+        buffer.data = (char *) malloc(4096);
+        buffer.capacity = buffer.data == NULL ? 0 : 4096;
+    }
+    metrics_write_counters(&buffer);
+    metrics_write_upstreams(&buffer);
+    metrics_write_latency(&buffer);
+
+    int header_length = sprintf(header, "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                                        "Content-Length: %zu\r\nConnection: close\r\n\r\n", buffer.length);
+    if (metrics_send_all(sock, header, (size_t) header_length)) {
+        metrics_send_all(sock, buffer.data, buffer.length);
+    }
+}
+
+/**
+ * The entry of the metrics thread, the scrapes are answered one by one
+ * @param arg The {@code metrics_server_t} of the listening socket
+ */
+void *metrics_main(void *arg) {
+    metrics_server_t *server = (metrics_server_t *) arg;
+    struct timeval timeout = {METRICS_TIMEOUT, 0};
+    while (true) {
+        int sock = accept(server->sock, NULL, NULL);
+        if (sock < 0) {
+            if (errno != EINTR && errno != ECONNABORTED) {
+                DNS_log_error("[ dns_metrics] Failed to accept the connection: %s", strerror(errno));
+            }
+            continue;
+        }
+
+        // A slow client only delays the next scrape, never the requests
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        metrics_handle_connection(sock);
+        close(sock);
+    }
+    return NULL;
+}
+
+bool DNS_metrics_start(const char *address, const char *listen_on) {
+    static metrics_server_t server;
+    bool unix_socket = strchr(listen_on, '/') != NULL;
+
+    server.sock = socket(unix_socket ? AF_UNIX : AF_INET, SOCK_STREAM, 0);
+    if (server.sock < 0) {
+        DNS_log_error("[ dns_metrics] Failed to create the socket of the metrics: %s", strerror(errno));
+        return false;
+    }
+
+    int ret;
+    if (unix_socket) {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (strlen(listen_on) >= sizeof(addr.sun_path)) {
+            DNS_log_error("[ dns_metrics] The path of the unix socket '%s' is too long", listen_on);
+            close(server.sock);
+            return false;
+        }
+        strcpy(addr.sun_path, listen_on);
+        unlink(listen_on);   // Left by the last run
+        ret = bind(server.sock, (struct sockaddr *) &addr, sizeof(addr));
+    }
+    else {
+        int port = atoi(listen_on);
+        if (port <= 0 || port > 65535) {
+            DNS_log_error("[ dns_metrics] Invalid port '%s' of the metrics", listen_on);
+            close(server.sock);
+            return false;
+        }
+        int reuse = 1;
+        setsockopt(server.sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons((uint16) port);
+        addr.sin_addr.s_addr = inet_addr(address);
+        ret = bind(server.sock, (struct sockaddr *) &addr, sizeof(addr));
+    }
+    if (ret < 0 || listen(server.sock, 16) < 0) {
+        DNS_log_error("[ dns_metrics] Failed to listen on %s for the metrics: %s", listen_on, strerror(errno));
+        close(server.sock);
+        return false;
+    }
+
+    pthread_t thread;
+    ret = pthread_create(&thread, NULL, metrics_main, &server);
+    if (ret != 0) {
+        DNS_log_error("[ dns_metrics] Failed to start the metrics thread: %s", strerror(ret));
+        close(server.sock);
+        return false;
+    }
+    pthread_detach(thread);
+    DNS_log_info("[ dns_metrics] Serving the metrics on %s%s%s", unix_socket ? "" : address, unix_socket ? "" : ":",
+                 listen_on);
+    return true;
+}
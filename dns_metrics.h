@@ -0,0 +1,48 @@
+//
+// dns_metrics.h -- Counters of the servers, exported in the Prometheus text format. The counters are updated
+//                  by each thread in its own memory without any lock or atomic operation, and a separate
+//                  thread serves them over HTTP on a TCP port or a unix socket, summing the counters of all
+//                  the threads with the statistics of the cache, the upstream servers and the latency
+// Created on 10/15/26.
+//
+
+#ifndef PROJECT_DNS_DNS_METRICS_H
+#define PROJECT_DNS_DNS_METRICS_H
+
+#include "dns_io.h"
+
+/**
+ * Count a request answered
+ * @param tcp Whether the request was received over TCP
+ * @param type The type of the question, 0 if the request cannot be parsed
+ * @param rcode The rcode of the response
+ */
+void DNS_metrics_count_query(bool tcp, int type, int rcode);
+
+/**
+ * Count a question of a client looked up in the cache, the lookups made while following the CNAME
+ * and MX records or by the resolver are not counted
+ * @param hit Whether the records are found, false if neither the records nor a negative answer is cached
+ */
+void DNS_metrics_count_cache_lookup(bool hit);
+
+/**
+ * Count a question of a client answered by a negative answer in the cache
+ */
+void DNS_metrics_count_negative_hit();
+
+/**
+ * Change the number of the resolutions in flight of the current thread
+ * @param delta 1 when a resolution starts, -1 when it finishes
+ */
+void DNS_metrics_add_resolutions(int delta);
+
+/**
+ * Start the thread serving the metrics
+ * @param address The IP address of the server, the metrics are served on this address if a port is given
+ * @param listen_on A TCP port, or the path of a unix socket if it contains '/'
+ * @return True if the socket is listening
+ */
+bool DNS_metrics_start(const char *address, const char *listen_on);
+
+#endif //PROJECT_DNS_DNS_METRICS_H
@@ -3,51 +3,80 @@
 // Created on 5/26/20.
 //
 
+#define _GNU_SOURCE   // For SO_REUSEPORT and recvmmsg/sendmmsg, which are not in POSIX
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/time.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <fcntl.h>
+#include <time.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <errno.h>
 #include <unistd.h>
+#include <pthread.h>
 #include "dns_common.h"
 #include "dns_query.h"
+#include "dns_arena.h"
 #include "dns_io.h"
+#include "dns_network.h"
+#include "dns_latency.h"
+#include "dns_metrics.h"
 
 // The buffer size for receiving data from sockets
 #define BUFFER_SIZE 1024
 
+// The chunk size of the arenas used for handling requests, one chunk is enough for most of the requests
+#define ARENA_CHUNK_SIZE (64 * 1024)
+
+#define MAX_EVENTS          64      // The maximum number of events handled in one iteration of the event loop
+#define UDP_BATCH_SIZE      64      // The maximum number of datagrams received with one recvmmsg
+#define MAX_TCP_CONNECTIONS 1024    // The maximum number of concurrent TCP connections
+#define TCP_IDLE_TIMEOUT    10      // The seconds after which the idle TCP connections are closed
+#define MAX_WORKERS         256     // The maximum number of worker threads
+
+// Whether the server loops use io_uring instead of epoll
+bool network_use_uring = false;
+
+#ifndef CLIENT
+// The hooks called by the event loops, NULL if not set
+dns_loop_hooks_t *network_hooks = NULL;
+#endif
+
 
 /**
  * Print out an RR to the terminal in the WireShark-like format
  * @param rr The Resource Record
  */
 void rr_print(dns_rr_t rr) {
-    char info[128];
+    if (!DNS_log_enabled(LOG_LEVEL_TRACE)) {
+        return;
+    }
+    char info[RR_STRING_LEN + 32];
     if (rr.type == TYPE_MX) {
-        int pref;
-        char name[64];
-        if (sscanf(rr.data, "%d,%s", &pref, name) != 2) {
-            sprintf(info, "mx %s", rr.data);
-        }
-        else {
-            // The MX RRs contains a preference field
-            sprintf(info, "preference %d, mx %s", pref, name);
-        }
+        // The MX RRs contains a preference field
+        snprintf(info, sizeof(info), "preference %hu, mx %s", rr.rdata.mx.preference, rr.rdata.mx.exchange);
     }
     else if (rr.type == TYPE_A) {
-        sprintf(info, "addr %s", rr.data);
+        struct in_addr addr;
+        addr.s_addr = htonl(rr.rdata.a);
+        snprintf(info, sizeof(info), "addr %s", inet_ntoa(addr));
     }
     else if (rr.type == TYPE_CNAME) {
-        sprintf(info, "cname %s", rr.data);
+        snprintf(info, sizeof(info), "cname %s", rr.rdata.name);
     }
     else if (rr.type == TYPE_NS) {
-        sprintf(info, "ns %s", rr.data);
+        snprintf(info, sizeof(info), "ns %s", rr.rdata.name);
+    }
+    else if (rr.type == TYPE_SOA) {
+        snprintf(info, sizeof(info), "mname %s, serial %u, minimum %u", rr.rdata.soa.mname, rr.rdata.soa.serial,
+                 rr.rdata.soa.minimum);
     }
     else {
-        sprintf(info, "%s", rr.data);
+        snprintf(info, sizeof(info), "%s", rr.rdata.name);
     }
 
     DNS_log_trace("      %s: type %s, class %s, %s", rr.name, DNS_type_to_str(rr.type), DNS_class_to_str(rr.class), info);
@@ -60,6 +89,9 @@ void rr_print(dns_rr_t rr) {
  * @param is_send Whether this packet is sent
  */
 void packet_print(dns_packet_t packet, struct sockaddr_in addr, bool is_send) {
+    if (!DNS_log_enabled(LOG_LEVEL_TRACE)) {
+        return;
+    }
     if (is_send)
         DNS_log_trace("[ dns_network] Sending packet to %s:%d : ", inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
     else
@@ -105,14 +137,77 @@ void packet_print(dns_packet_t packet, struct sockaddr_in addr, bool is_send) {
 
 #ifndef CLIENT
 // Some server-only code that we don't expect in the client
+#include "dns_uring.h"
+
+/**
+ * Print the questions of a received request in WireShark-like format,
+ * the names are only decompressed when the trace messages are enabled
+ * @param request The view of the request packet
+ * @param addr The address of receiving this packet
+ */
+void view_print(const dns_packet_view_t *request, struct sockaddr_in addr) {
+#ifndef NOTRACE
+    if (!DNS_log_enabled(LOG_LEVEL_TRACE)) {
+        return;
+    }
+    DNS_log_trace("[ dns_network] Received packet from %s:%d : ", inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
+
+    DNS_log_trace("Domain Name System (%s)", (request->header.qr ? "response" : "request"));
+    DNS_log_trace("   Transaction ID: 0x%04x", request->header.id);
+    DNS_log_trace("   Flags: 0x%04x %s %s, %s",
+                  ntohs(((uint16 *) &request->header)[1]), DNS_opcode_to_str(request->header.opcode),
+                  (request->header.qr ? "response" : "request"), DNS_rcode_to_str(request->header.rcode));
+    DNS_log_trace("   Questions: %d", request->header.question_count);
+    DNS_log_trace("   Answer RRs: %d", request->header.answer_count);
+    DNS_log_trace("   Authority RRs: %d", request->header.authority_count);
+    DNS_log_trace("   Additional RRs: %d", request->header.additional_count);
+
+    DNS_log_trace("   Queries");
+    dns_question_view_t question;
+    char name[RR_STRING_LEN];
+    uint32 offset = request->questions;
+    for (int i = 0; i < request->header.question_count; i++) {
+        offset = DNS_view_read_question(request, offset, &question);
+        DNS_view_name(request, question.name, name);
+        DNS_log_trace("      %s: type %s, class %s", name, DNS_type_to_str(question.type),
+                      DNS_class_to_str(question.class));
+    }
+    DNS_log_trace("[ dns_network] END of DNS packet.\n");
+#else
+    (void) request;
+    (void) addr;
+#endif
+}
 
-int DNS_network_init_server_socket_udp(const char *address) {
+/**
+ * Get the arena that owns all the memory used while handling one request (queries, RRs,
+ * names and the packets from other servers). Each thread have its own arena and it is
+ * reset after each request, so no memory is allocated from the heap once it is warmed up
+ * @return The arena of current thread
+ */
+dns_arena_t *network_get_arena() {
+    static __thread dns_arena_t *arena = NULL;
+    if (arena == NULL) {
+        arena = DNS_arena_create(ARENA_CHUNK_SIZE);
+    }
+    return arena;
+}
+
+int DNS_network_init_server_socket_udp(const char *address, bool reuse_port) {
     int sock = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP);
     if (sock < 0) {
         DNS_log_error("[ dns_network] Failed to create UDP socket: %s", strerror(errno));
         return -1;
     }
 
+    // Each worker binds its own socket to the address, and the kernel spreads the flows across them
+    int reuse = 1;
+    if (reuse_port && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) < 0) {
+        DNS_log_error("[ dns_network] Failed to set SO_REUSEPORT on UDP socket: %s", strerror(errno));
+        close(sock);
+        return -1;
+    }
+
     struct sockaddr_in addr;
     addr.sin_family = AF_INET;
     addr.sin_port = htons(DNS_PORT);
@@ -121,6 +216,7 @@ int DNS_network_init_server_socket_udp(const char *address) {
     if (bind_ret < 0) {
         DNS_log_error("[ dns_network] Failed to bind UDP socket to %s:%d : %s", address, DNS_PORT,
                       strerror(errno));
+        close(sock);
         return -1;
     }
 
@@ -129,13 +225,22 @@ int DNS_network_init_server_socket_udp(const char *address) {
     return sock;
 }
 
-int DNS_network_init_server_socket_tcp(const char *address) {
+int DNS_network_init_server_socket_tcp(const char *address, bool reuse_port) {
     int sock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
     if (sock < 0) {
         DNS_log_error("[ dns_network] Failed to create TCP socket.");
         return -1;
     }
 
+    // Allow restarting the server while the old connections are in TIME_WAIT
+    int reuse = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    if (reuse_port && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) < 0) {
+        DNS_log_error("[ dns_network] Failed to set SO_REUSEPORT on TCP socket: %s", strerror(errno));
+        close(sock);
+        return -1;
+    }
+
     struct sockaddr_in addr;
     addr.sin_family = AF_INET;
     addr.sin_port = htons(DNS_PORT);
@@ -143,10 +248,11 @@ int DNS_network_init_server_socket_tcp(const char *address) {
     int bind_ret = bind(sock, (struct sockaddr *) &addr, sizeof(addr));
     if (bind_ret < 0) {
         DNS_log_error("[ dns_network] Failed to bind TCP socket to %s:%d : %s", address, DNS_PORT, strerror(errno));
+        close(sock);
         return -1;
     }
 
-    int listen_ret = listen(sock, 10);
+    int listen_ret = listen(sock, SOMAXCONN);
     if (listen_ret < 0) {
         DNS_log_error("[dns_network ] Failed to listen on TCP socket on %s:%d : %s", address, DNS_PORT, strerror(errno));
         close(sock);
@@ -158,173 +264,823 @@ int DNS_network_init_server_socket_tcp(const char *address) {
     return sock;
 }
 
-void DNS_network_handle_query_udp(int sock) {
-    char buf[BUFFER_SIZE] = {0};
+/**
+ * The client of the request being handled, remembered by {@code DNS_network_defer}
+ */
+typedef struct {
+    int fd;                                 // The UDP socket or the socket of the TCP connection
+    struct sockaddr_in peer;
+    struct tcp_connection *connection;      // The TCP connection, NULL for UDP
+    struct reactor *reactor;                // The event loop of the TCP connection
+} network_client_t;
+
+/**
+ * A request whose response is sent later
+ */
+struct dns_reply {
+    network_client_t client;
+    bool tcp;                               // The connection is set to NULL if it is closed before the response
+    unsigned long start;                    // The time the response was deferred, 0 if the latency is not timed
+    uint16 type;                            // The type of the question, for the metrics
+};
+
+// The client of the request being handled by current thread, NULL if the request cannot be deferred
+static __thread network_client_t *network_client = NULL;
+
+// Whether the request being handled by current thread is deferred
+static __thread bool network_deferred = false;
+
+// The time the handler was called for the request being handled by current thread, 0 if not timed
+static __thread unsigned long network_response_start = 0;
+
+// The type of the question of the request being handled by current thread, 0 if it cannot be parsed
+static __thread uint16 network_query_type = 0;
+
+int DNS_network_process_request(ptr_t request, int length, ptr_t response, int capacity, dns_handler_t handler,
+                                struct sockaddr_in peer, bool tcp) {
+    dns_arena_t *arena = network_get_arena();
+    DNS_arena_set_current(arena);
+    network_deferred = false;
+    unsigned long start = DNS_latency_start();
+
+    dns_packet_view_t view;
+    dns_packet_t send_packet;
+    network_query_type = 0;
+    if (DNS_view_parse(&view, request, length)) {
+        DNS_latency_end(LATENCY_DECODE, start);
+        if (view.header.question_count > 0) {
+            dns_question_view_t question;
+            DNS_view_read_question(&view, view.questions, &question);
+            network_query_type = question.type;
+        }
+        view_print(&view, peer);
+        network_response_start = DNS_latency_start();
+        send_packet = handler(&view);
+        DNS_latency_end(LATENCY_RESPONSE, network_response_start);
+    }
+    else {
+        DNS_log_error("[ dns_network] Failed to decode incoming packet as DNS packet, the length is %d", length);
+        send_packet = DNS_query_create_fail_response(R_FORMAT_ERR);
+    }
+    if (network_deferred) {
+        DNS_arena_reset(arena);
+        DNS_arena_set_current(NULL);
+        return 0;
+    }
+    packet_print(send_packet, peer, true);
+
+    struct dns_buffer send_buffer;
+    unsigned long encode_start = DNS_latency_start();
+    DNS_buffer_init(&send_buffer, response, capacity);
+    DNS_buffer_write_packet(&send_buffer, send_packet);
+    DNS_latency_end(LATENCY_ENCODE, encode_start);
+    DNS_metrics_count_query(tcp, network_query_type, send_packet.header.rcode);
+
+    // Release all the memory used by this request
+    DNS_arena_reset(arena);
+    DNS_arena_set_current(NULL);
+    DNS_latency_end(LATENCY_REQUEST, start);
+    return (int) send_buffer.pos;
+}
+
+/**
+ * Handle one request of the client, the handler can defer the response with {@code DNS_network_defer}
+ * @param client The client of the request
+ * @return The length of the response, 0 if the response is deferred
+ */
+int network_process_client_request(network_client_t *client, ptr_t request, int length, ptr_t response,
+                                   int capacity, dns_handler_t handler) {
+    network_client = client;
+    int len = DNS_network_process_request(request, length, response, capacity, handler, client->peer,
+                                          client->connection != NULL);
+    network_client = NULL;
+    return len;
+}
+
+bool DNS_network_handle_query_udp(int sock, dns_handler_t handler) {
+    char buf[BUFFER_SIZE];
+    char send_buf[BUFFER_SIZE];
     struct sockaddr_in peer;
     socklen_t peer_len = sizeof(peer);
 
     int ret = recvfrom(sock, buf, sizeof(buf), 0, (struct sockaddr *) &peer, &peer_len);
+    if (ret < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            DNS_log_error("[ dns_network] Failed to receive request from client: %s", strerror(errno));
+        }
+        return false;
+    }
+
+    int len = DNS_network_process_request(buf, ret, send_buf, BUFFER_SIZE, handler, peer, false);
+    if (sendto(sock, send_buf, len, 0, (struct sockaddr *) &peer, peer_len) < 0) {
+        DNS_log_error("[ dns_network] Failed to send response to the client.");
+    }
+    return true;
+}
 
-    if (ret > 0) {
-        buffer_t buffer = DNS_buffer_from_ptr(buf, ret);
-        dns_packet_t packet;
-        packet.queries = NULL;
-        packet.answers = NULL;
-        packet.authorities = NULL;
-        packet.additionals = NULL;
+/**
+ * The buffers of a batch of UDP requests and responses, allocated once for each thread
+ */
+typedef struct {
+    struct mmsghdr recv_messages[UDP_BATCH_SIZE];
+    struct mmsghdr send_messages[UDP_BATCH_SIZE];
+    struct iovec recv_iovecs[UDP_BATCH_SIZE];
+    struct iovec send_iovecs[UDP_BATCH_SIZE];
+    struct sockaddr_in peers[UDP_BATCH_SIZE];
+    uint8 requests[UDP_BATCH_SIZE][BUFFER_SIZE];
+    uint8 responses[UDP_BATCH_SIZE][BUFFER_SIZE];
+} udp_batch_t;
 
-        dns_packet_t send_packet;
-        send_packet.queries = NULL;
-        send_packet.answers = NULL;
-        send_packet.authorities = NULL;
-        send_packet.additionals = NULL;
-        if (DNS_buffer_read_packet(buffer, &packet)) {
-            packet_print(packet, peer, false);
-            send_packet = DNS_query_create_response(packet);
+/**
+ * Get the batch buffers of current thread, the addresses of the buffers are set up when they are allocated
+ * @return The batch buffers, NULL if failed to allocate them
+ */
+udp_batch_t *network_get_udp_batch() {
+    static __thread udp_batch_t *batch = NULL;
+    if (batch == NULL) {
+        batch = (udp_batch_t *) calloc(1, sizeof(udp_batch_t));
+        if (batch == NULL) {
+            return NULL;
         }
-        else {
-            send_packet = DNS_query_create_fail_response(R_FORMAT_ERR);
-            DNS_log_error("[ dns_network] Failed to decode incoming packet as DNS packet, the length is %d", ret);
+        for (int i = 0; i < UDP_BATCH_SIZE; i++) {
+            batch->recv_iovecs[i].iov_base = batch->requests[i];
+            batch->recv_iovecs[i].iov_len = BUFFER_SIZE;
+            batch->recv_messages[i].msg_hdr.msg_iov = &batch->recv_iovecs[i];
+            batch->recv_messages[i].msg_hdr.msg_iovlen = 1;
+            batch->recv_messages[i].msg_hdr.msg_name = &batch->peers[i];
+
+            batch->send_iovecs[i].iov_base = batch->responses[i];
+            batch->send_messages[i].msg_hdr.msg_iov = &batch->send_iovecs[i];
+            batch->send_messages[i].msg_hdr.msg_iovlen = 1;
+            batch->send_messages[i].msg_hdr.msg_name = &batch->peers[i];
         }
-        packet_print(send_packet, peer, true);
-        buffer_t send_buffer = DNS_buffer_create(BUFFER_SIZE);
-        DNS_buffer_write_packet(send_buffer, send_packet);
+    }
+    return batch;
+}
+
+int DNS_network_handle_queries_udp(int sock, dns_handler_t handler, int batch_size) {
+    udp_batch_t *batch = network_get_udp_batch();
+    if (batch == NULL) {
+        DNS_log_error("[ dns_network] Failed to allocate the buffers of UDP requests.");
+        return -1;
+    }
+    if (batch_size > UDP_BATCH_SIZE) {
+        batch_size = UDP_BATCH_SIZE;
+    }
+    if (batch_size < 1) {
+        batch_size = 1;
+    }
 
-        int ret1 = sendto(sock, send_buffer->ptr, send_buffer->pos, 0, (struct sockaddr *) &peer, peer_len);
-        if (ret1 < 0) {
-            DNS_log_error("[ dns_network] Failed to send response to the client.");
+    for (int i = 0; i < batch_size; i++) {
+        batch->recv_messages[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    }
+
+    // Wait for the first datagram only, then take the ones already queued
+    int count = recvmmsg(sock, batch->recv_messages, batch_size, MSG_WAITFORONE, NULL);
+    if (count < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            DNS_log_error("[ dns_network] Failed to receive requests from clients: %s", strerror(errno));
+            return -1;
         }
+        return 0;
+    }
 
-        DNS_buffer_free(send_buffer);
+    // The deferred responses are left out of the batch
+    int send_count = 0;
+    for (int i = 0; i < count; i++) {
+        network_client_t client = {sock, batch->peers[i], NULL, NULL};
+        int len = network_process_client_request(&client, batch->requests[i], (int) batch->recv_messages[i].msg_len,
+                                                 batch->responses[i], BUFFER_SIZE, handler);
+        if (len == 0) {
+            continue;
+        }
+        batch->send_iovecs[send_count].iov_base = batch->responses[i];
+        batch->send_iovecs[send_count].iov_len = len;
+        batch->send_messages[send_count].msg_hdr.msg_name = &batch->peers[i];
+        batch->send_messages[send_count].msg_hdr.msg_namelen = batch->recv_messages[i].msg_hdr.msg_namelen;
+        send_count++;
+    }
 
-    } else {
-        DNS_log_error("[ dns_network] Failed to receive request from client.");
+    // All the responses are sent with one syscall, unless some of them fail
+    int sent = 0;
+    while (sent < send_count) {
+        int ret = sendmmsg(sock, &batch->send_messages[sent], send_count - sent, 0);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            DNS_log_error("[ dns_network] Failed to send response to the client: %s", strerror(errno));
+            ret = 1;   // Skip the response failed to be sent
+        }
+        sent += ret;
     }
+    return count;
 }
 
-void DNS_network_handle_query_tcp(int sock) {
-    char buf[BUFFER_SIZE] = {0};
-    char buf_rec[BUFFER_SIZE] = {0};
+/**
+ * The kinds of the file descriptors watched by the event loop
+ */
+enum {
+    SOURCE_UDP,
+    SOURCE_TCP_LISTEN,
+    SOURCE_TCP_CONNECTION,
+    SOURCE_WATCH          // A socket watched for the hooks, like the sockets to the upstream servers
+};
+
+/**
+ * A file descriptor watched by the event loop, the pointer of it is stored in the epoll events
+ */
+typedef struct reactor_source {
+    int fd;
+    int kind;
+} reactor_source_t;
+
+/**
+ * A TCP connection of the event loop. Each message on the connection is prefixed with its length,
+ * the received bytes are kept until a complete message arrives, and only one response is buffered:
+ * the connection is not read while the response cannot be sent completely
+ */
+typedef struct tcp_connection {
+    reactor_source_t source;      // Should be the first member, so the pointer of the source is the connection
     struct sockaddr_in peer;
-    socklen_t peer_len = sizeof(peer);
-    int sock2 = accept(sock, (struct sockaddr *) &peer, &peer_len);
-    if (sock2 < 0) {
-        DNS_log_error("[ dns_network] Failed to accept connection from the client: %s", strerror(errno));
-        return;
+    time_t last_active;
+    uint32 events;                // The events watched, EPOLLOUT while sending and none while a response is deferred
+    dns_reply_t *pending;         // The deferred response, the connection is not read until it is sent
+    bool ready;                   // Whether the deferred response is put into the buffer and waits to be sent
+
+    uint8 in[BUFFER_SIZE + 2];
+    uint32 in_length;
+    uint8 out[BUFFER_SIZE + 2];
+    uint32 out_length;
+    uint32 out_pos;
+
+    struct tcp_connection *prev;
+    struct tcp_connection *next;
+    struct tcp_connection *ready_next;
+} tcp_connection_t;
+
+/**
+ * The state of an event loop
+ */
+typedef struct reactor {
+    int epoll;
+    dns_handler_t handler;
+    reactor_source_t udp;
+    reactor_source_t tcp;
+    tcp_connection_t *connections;
+    int connection_count;
+    tcp_connection_t *ready;      // The connections with the deferred responses to send after handling the events
+} reactor_t;
+
+// The event loop run by current thread
+static __thread reactor_t *network_reactor = NULL;
+
+/**
+ * Set the socket to non-blocking mode
+ * @return True if success
+ */
+bool network_set_nonblocking(int sock) {
+    int flags = fcntl(sock, F_GETFL, 0);
+    return flags >= 0 && fcntl(sock, F_SETFL, flags | O_NONBLOCK) >= 0;
+}
+
+/**
+ * Close the connection and release its memory
+ */
+void reactor_close_connection(reactor_t *reactor, tcp_connection_t *conn) {
+    DNS_log_trace("[ dns_network] Closed connection from %s:%d", inet_ntoa(conn->peer.sin_addr),
+                  ntohs(conn->peer.sin_port));
+    close(conn->source.fd);   // The fd is also removed from the epoll
+    if (conn->pending != NULL) {
+        conn->pending->client.connection = NULL;   // The deferred response will be dropped
+    }
+    if (conn->ready) {
+        tcp_connection_t **ready = &reactor->ready;
+        while (*ready != conn) {
+            ready = &(*ready)->ready_next;
+        }
+        *ready = conn->ready_next;
     }
 
-    DNS_log_trace("[ dns_network] Accepted connection from %s:%d", inet_ntoa(peer.sin_addr), htons(peer.sin_port));
-
-    int ret = recv(sock2, buf, sizeof(buf), 0);
-    if (ret > 0) {
-        // The DNS packet transmitted in the TCP protocol contains a length field at the begining of the packet
-        // We initialize the packet buffer just at the start of the DNS header
-        buffer_t buffer = DNS_buffer_from_ptr(buf + 2, ret - 2); // Skip the length field
-        dns_packet_t packet;
-        packet.queries = NULL;
-        packet.answers = NULL;
-        packet.authorities = NULL;
-        packet.additionals = NULL;
-
-        dns_packet_t send_packet;
-        send_packet.queries = NULL;
-        send_packet.answers = NULL;
-        send_packet.authorities = NULL;
-        send_packet.additionals = NULL;
-        if (DNS_buffer_read_packet(buffer, &packet)) {
-            packet_print(packet, peer, false);
-            send_packet = DNS_query_create_response_local(packet);
-        }
-        else {
-            DNS_log_error("[ dns_network] Failed to decode incoming packet as DNS packet, the length is %d", ret);
-            send_packet = DNS_query_create_fail_response(R_FORMAT_ERR);
-        }
-        packet_print(send_packet, peer, true);
-        buffer_t send_buffer = DNS_buffer_from_ptr(buf_rec + 2, BUFFER_SIZE - 2);
-        DNS_buffer_write_packet(send_buffer, send_packet);
-        uint16 len = (uint16) send_buffer->pos;
-        *((uint16 *)buf_rec) = htons(len);
-
-        int ret1 = send(sock2, buf_rec, len + 2, 0);
-        if (ret1 < 0) {
+    if (conn->prev != NULL) {
+        conn->prev->next = conn->next;
+    }
+    else {
+        reactor->connections = conn->next;
+    }
+    if (conn->next != NULL) {
+        conn->next->prev = conn->prev;
+    }
+    reactor->connection_count--;
+    free(conn);
+}
+
+/**
+ * Watch the readable or writable events of the connection, or none of them
+ * @return True if success
+ */
+bool reactor_watch_connection(reactor_t *reactor, tcp_connection_t *conn, uint32 events) {
+    if (conn->events == events) {
+        return true;
+    }
+
+    struct epoll_event event;
+    event.events = events;
+    event.data.ptr = conn;
+    if (epoll_ctl(reactor->epoll, EPOLL_CTL_MOD, conn->source.fd, &event) < 0) {
+        DNS_log_error("[ dns_network] Failed to modify the events of the connection: %s", strerror(errno));
+        return false;
+    }
+    conn->events = events;
+    return true;
+}
+
+/**
+ * Send the buffered response of the connection as much as possible
+ * @return False if the connection should be closed
+ */
+bool reactor_flush_connection(reactor_t *reactor, tcp_connection_t *conn) {
+    while (conn->out_pos < conn->out_length) {
+        ssize_t ret = send(conn->source.fd, &conn->out[conn->out_pos], conn->out_length - conn->out_pos, MSG_NOSIGNAL);
+        if (ret < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return reactor_watch_connection(reactor, conn, EPOLLOUT);
+            }
+            if (errno == EINTR) {
+                continue;
+            }
             DNS_log_error("[ dns_network] Failed to send response to the client: %s", strerror(errno));
+            return false;
         }
+        conn->out_pos += ret;
+    }
+
+    conn->out_length = 0;
+    conn->out_pos = 0;
+    return reactor_watch_connection(reactor, conn, conn->pending != NULL ? 0 : EPOLLIN);
+}
 
-    } else {
-        DNS_log_error("[ dns_network] Failed to receive request from client: %s", strerror(errno));
+/**
+ * Handle the complete messages received on the connection, stops when a response cannot be sent completely
+ * or is deferred
+ * @return False if the connection should be closed
+ */
+bool reactor_process_connection(reactor_t *reactor, tcp_connection_t *conn) {
+    uint32 pos = 0;
+    while (conn->out_length == 0 && conn->pending == NULL && conn->in_length - pos >= 2) {
+        uint16 length = (uint16) ((conn->in[pos] << 8) | conn->in[pos + 1]);
+        if (length == 0 || length > BUFFER_SIZE) {
+            DNS_log_error("[ dns_network] Invalid message length %d from the client", length);
+            return false;
+        }
+        if (conn->in_length - pos < (uint32) length + 2) {
+            break;
+        }
+
+        network_client_t client = {conn->source.fd, conn->peer, conn, reactor};
+        int len = network_process_client_request(&client, &conn->in[pos + 2], length, &conn->out[2], BUFFER_SIZE,
+                                                 reactor->handler);
+        pos += (uint32) length + 2;
+        if (len == 0) {
+            continue;   // Deferred, the connection is not read until the response is sent
+        }
+        conn->out[0] = (uint8) (len >> 8);
+        conn->out[1] = (uint8) len;
+        conn->out_length = (uint32) len + 2;
+        conn->out_pos = 0;
+
+        if (!reactor_flush_connection(reactor, conn)) {
+            return false;
+        }
     }
 
-    close(sock2);
+    // Keep the incomplete message at the beginning of the buffer
+    if (pos > 0) {
+        memmove(conn->in, &conn->in[pos], conn->in_length - pos);
+        conn->in_length -= pos;
+    }
+    if (conn->pending != NULL) {
+        return reactor_watch_connection(reactor, conn, 0);
+    }
+    return true;
 }
 
-#endif
+/**
+ * Read from the connection and handle the received messages
+ * @return False if the connection should be closed
+ */
+bool reactor_read_connection(reactor_t *reactor, tcp_connection_t *conn) {
+    while (conn->out_length == 0 && conn->pending == NULL) {
+        ssize_t ret = recv(conn->source.fd, &conn->in[conn->in_length], sizeof(conn->in) - conn->in_length, 0);
+        if (ret == 0) {
+            return false;   // Closed by the client
+        }
+        if (ret < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return true;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            DNS_log_error("[ dns_network] Failed to receive request from client: %s", strerror(errno));
+            return false;
+        }
 
-dns_packet_t *DNS_network_send_query_udp(const char *address, char *name, int type) {
-    struct sockaddr_in addr;
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(DNS_PORT);
-    addr.sin_addr.s_addr = inet_addr(address);
+        conn->in_length += ret;
+        if (!reactor_process_connection(reactor, conn)) {
+            return false;
+        }
+    }
+    return true;
+}
 
-    int sock = socket(PF_INET, SOCK_DGRAM, 0);
+/**
+ * Accept all the pending connections of the listening socket
+ */
+void reactor_accept(reactor_t *reactor) {
+    while (true) {
+        struct sockaddr_in peer;
+        socklen_t peer_len = sizeof(peer);
+        int sock = accept(reactor->tcp.fd, (struct sockaddr *) &peer, &peer_len);
+        if (sock < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                DNS_log_error("[ dns_network] Failed to accept connection from the client: %s", strerror(errno));
+            }
+            return;
+        }
 
-    // Sets the timeout interval of the socket since we don't expect it to wait forever if the
-    // server doesn't response due to some error
-    struct timeval timeout = {10, 0};
-    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (const char *) &timeout, sizeof(timeout));
+        if (reactor->connection_count >= MAX_TCP_CONNECTIONS) {
+            DNS_log_warning("[ dns_network] Too many connections, rejected the connection from %s:%d",
+                            inet_ntoa(peer.sin_addr), ntohs(peer.sin_port));
+            close(sock);
+            continue;
+        }
 
-    if (sock < 0) {
-        DNS_log_error("[ dns_network] Failed to create UDP socket to send query: %s" ,strerror(errno));
-        return NULL;
+        tcp_connection_t *conn = (tcp_connection_t *) malloc(sizeof(tcp_connection_t));
+        if (conn == NULL || !network_set_nonblocking(sock)) {
+            DNS_log_error("[ dns_network] Failed to set up the connection from %s:%d", inet_ntoa(peer.sin_addr),
+                          ntohs(peer.sin_port));
+            free(conn);
+            close(sock);
+            continue;
+        }
+        conn->source.fd = sock;
+        conn->source.kind = SOURCE_TCP_CONNECTION;
+        conn->peer = peer;
+        conn->last_active = time(NULL);
+        conn->events = EPOLLIN;
+        conn->pending = NULL;
+        conn->ready = false;
+        conn->in_length = 0;
+        conn->out_length = 0;
+        conn->out_pos = 0;
+
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.ptr = conn;
+        if (epoll_ctl(reactor->epoll, EPOLL_CTL_ADD, sock, &event) < 0) {
+            DNS_log_error("[ dns_network] Failed to watch the connection: %s", strerror(errno));
+            free(conn);
+            close(sock);
+            continue;
+        }
+
+        conn->prev = NULL;
+        conn->next = reactor->connections;
+        if (reactor->connections != NULL) {
+            reactor->connections->prev = conn;
+        }
+        reactor->connections = conn;
+        reactor->connection_count++;
+
+        DNS_log_trace("[ dns_network] Accepted connection from %s:%d", inet_ntoa(peer.sin_addr), ntohs(peer.sin_port));
     }
+}
 
-    dns_packet_t packet = DNS_query_create_request(name, type);
-    buffer_t buffer = DNS_buffer_create(BUFFER_SIZE);
-    packet_print(packet, addr, true);
-    DNS_buffer_write_packet(buffer, packet);
-    if (sendto(sock, buffer->ptr, buffer->pos, 0, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
-        DNS_log_error("[ dns_network] Failed to send UDP packet to DNS server: %s", strerror(errno));
-        DNS_buffer_free(buffer);
-        close(sock);
-        return NULL;
+/**
+ * Send the deferred responses put into the buffers of the connections, then handle the messages received
+ * meanwhile. Called after the events are handled, so no connection is closed while the events refer to it
+ */
+void reactor_send_ready(reactor_t *reactor) {
+    while (reactor->ready != NULL) {
+        tcp_connection_t *conn = reactor->ready;
+        reactor->ready = conn->ready_next;
+        conn->ready = false;
+        if (!reactor_flush_connection(reactor, conn) ||
+            !reactor_process_connection(reactor, conn) ||
+            !reactor_read_connection(reactor, conn)) {
+            reactor_close_connection(reactor, conn);
+        }
     }
+}
 
-    dns_packet_t *packet_rec = (dns_packet_t *) malloc(sizeof(dns_packet_t));
-    buffer_t buffer_rec = DNS_buffer_create(BUFFER_SIZE);
-    packet_rec->queries = NULL;
-    packet_rec->answers = NULL;
-    packet_rec->additionals = NULL;
-    packet_rec->authorities = NULL;
+/**
+ * Close the connections without any activity for {@code TCP_IDLE_TIMEOUT} seconds
+ */
+void reactor_close_idle(reactor_t *reactor) {
+    time_t now = time(NULL);
+    tcp_connection_t *next;
+    for (tcp_connection_t *conn = reactor->connections; conn != NULL; conn = next) {
+        next = conn->next;
+        if (now - conn->last_active >= TCP_IDLE_TIMEOUT) {
+            reactor_close_connection(reactor, conn);
+        }
+    }
+}
 
-    socklen_t addr_len = sizeof(addr);
+/**
+ * Close the connections, the listening sockets and the epoll of the event loop, when the loop cannot go on
+ */
+void reactor_close(reactor_t *reactor) {
+    while (reactor->connections != NULL) {
+        reactor_close_connection(reactor, reactor->connections);
+    }
+    if (reactor->udp.fd >= 0) {
+        close(reactor->udp.fd);
+    }
+    if (reactor->tcp.fd >= 0) {
+        close(reactor->tcp.fd);
+    }
+    close(reactor->epoll);
+}
 
-    // Get the time before and after the response
-    struct timeval start, end;
-    gettimeofday(&start, NULL);
-    if (recvfrom(sock, buffer_rec->ptr, buffer_rec->capacity, 0, (struct sockaddr *) &addr, &addr_len) < 0) {
-        DNS_log_error("[ dns_network] Failed to receive UDP packet from DNS server: %s", strerror(errno));
-        DNS_buffer_free(buffer_rec);
-        free(packet_rec);
-        close(sock);
-        return NULL;
+/**
+ * Add a listening socket to the event loop
+ * @return True if success
+ */
+bool reactor_add_source(reactor_t *reactor, reactor_source_t *source, int fd, int kind) {
+    source->fd = fd;
+    source->kind = kind;
+    if (fd < 0 || !network_set_nonblocking(fd)) {
+        return false;
     }
-    gettimeofday(&end, NULL);
 
-    DNS_log_trace("[ dns_network] Server respond in %f ms.", (float) (end.tv_usec - start.tv_usec) / 1000);
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = source;
+    if (epoll_ctl(reactor->epoll, EPOLL_CTL_ADD, fd, &event) < 0) {
+        DNS_log_error("[ dns_network] Failed to watch the socket: %s", strerror(errno));
+        return false;
+    }
+    return true;
+}
 
-    close(sock);
+/**
+ * Run an event loop serving the requests on both UDP and TCP on the address. Everything used by
+ * the loop (the sockets, the buffers, the connections and the arena) belongs to the calling thread
+ * @param address The address to listen on
+ * @param handler The function creating the response
+ * @param reuse_port Whether the sockets are shared with other event loops by {@code SO_REUSEPORT}
+ */
+void network_run_reactor(const char *address, dns_handler_t handler, bool reuse_port) {
+    if (network_use_uring && network_hooks != NULL) {
+        DNS_log_warning("[ dns_network] The deferred responses are only supported with epoll, io_uring is not used");
+    }
+    else if (network_use_uring) {
+        if (DNS_uring_serve(address, handler, reuse_port)) {
+            return;
+        }
+        DNS_log_warning("[ dns_network] io_uring is not available, falling back to epoll");
+    }
 
-    if (!DNS_buffer_read_packet(buffer_rec, packet_rec)) {
-        DNS_log_error("[ dns_network] Failed to decode UDP packet as DNS packet.");
-        DNS_buffer_free(buffer_rec);
-        free(packet_rec);
+    reactor_t reactor;
+    reactor.handler = handler;
+    reactor.connections = NULL;
+    reactor.connection_count = 0;
+    reactor.ready = NULL;
+    reactor.udp.fd = -1;
+    reactor.tcp.fd = -1;
+    reactor.epoll = epoll_create(MAX_EVENTS);
+    if (reactor.epoll < 0) {
+        DNS_log_error("[ dns_network] Failed to create epoll: %s", strerror(errno));
+        return;
+    }
+
+    if (!reactor_add_source(&reactor, &reactor.udp, DNS_network_init_server_socket_udp(address, reuse_port),
+                            SOURCE_UDP) ||
+        !reactor_add_source(&reactor, &reactor.tcp, DNS_network_init_server_socket_tcp(address, reuse_port),
+                            SOURCE_TCP_LISTEN)) {
+        DNS_log_error("[ dns_network] Failed to set up the sockets on %s", address);
+        reactor_close(&reactor);
+        return;
+    }
+
+    network_reactor = &reactor;
+    if (network_hooks != NULL && network_hooks->start != NULL && !network_hooks->start()) {
+        DNS_log_error("[ dns_network] Failed to start the event loop on %s", address);
+        network_reactor = NULL;
+        reactor_close(&reactor);
+        return;
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    time_t last_check = time(NULL);
+    while (true) {
+        // Wake up at least once per second to close the idle connections, or earlier for the timers of the hooks
+        int timeout = 1000;
+        if (network_hooks != NULL) {
+            int hooks_timeout = network_hooks->timeout();
+            if (hooks_timeout >= 0 && hooks_timeout < timeout) {
+                timeout = hooks_timeout;
+            }
+        }
+
+        int count = epoll_wait(reactor.epoll, events, MAX_EVENTS, timeout);
+        if (count < 0 && errno != EINTR) {
+            DNS_log_error("[ dns_network] Failed to wait for events: %s", strerror(errno));
+            network_reactor = NULL;
+            reactor_close(&reactor);
+            return;
+        }
+
+        for (int i = 0; i < count; i++) {
+            reactor_source_t *source = (reactor_source_t *) events[i].data.ptr;
+            if (source->kind == SOURCE_UDP) {
+                // Handle one batch of datagrams, so the TCP connections will not be starved
+                DNS_network_handle_queries_udp(source->fd, handler, UDP_BATCH_SIZE);
+            }
+            else if (source->kind == SOURCE_TCP_LISTEN) {
+                reactor_accept(&reactor);
+            }
+            else if (source->kind == SOURCE_WATCH) {
+                network_hooks->readable(source->fd);
+            }
+            else {
+                tcp_connection_t *conn = (tcp_connection_t *) source;
+                conn->last_active = time(NULL);
+
+                bool keep = true;
+                if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                    keep = false;
+                }
+                else if (conn->events & EPOLLOUT) {
+                    // Send the rest of the response, then handle the messages already received
+                    keep = reactor_flush_connection(&reactor, conn) &&
+                           reactor_process_connection(&reactor, conn) &&
+                           reactor_read_connection(&reactor, conn);
+                }
+                else {
+                    keep = reactor_read_connection(&reactor, conn);
+                }
+
+                if (!keep) {
+                    reactor_close_connection(&reactor, conn);
+                }
+            }
+        }
+
+        if (network_hooks != NULL) {
+            network_hooks->expire();
+        }
+        reactor_send_ready(&reactor);
+        DNS_latency_poll();
+
+        time_t now = time(NULL);
+        if (now != last_check) {
+            reactor_close_idle(&reactor);
+            last_check = now;
+        }
+    }
+}
+
+void DNS_network_set_loop_hooks(const dns_loop_hooks_t *hooks) {
+    if (hooks == NULL) {
+        network_hooks = NULL;
+        return;
+    }
+    static dns_loop_hooks_t hooks_copy;
+    hooks_copy = *hooks;
+    network_hooks = &hooks_copy;
+}
+
+bool DNS_network_watch(int fd) {
+    if (network_reactor == NULL) {
+        DNS_log_error("[ dns_network] The socket can only be watched in an event loop.");
+        return false;
+    }
+    reactor_source_t *source = (reactor_source_t *) malloc(sizeof(reactor_source_t));
+    if (source == NULL || !reactor_add_source(network_reactor, source, fd, SOURCE_WATCH)) {
+        free(source);
+        return false;
+    }
+    return true;   // The sources live as long as the event loop
+}
+
+dns_reply_t *DNS_network_defer() {
+    if (network_client == NULL) {
+        return NULL;
+    }
+    dns_reply_t *reply = (dns_reply_t *) malloc(sizeof(dns_reply_t));
+    if (reply == NULL) {
+        DNS_log_error("[ dns_network] Failed to defer the response, out of memory.");
         return NULL;
     }
+    reply->client = *network_client;
+    reply->tcp = network_client->connection != NULL;
+    reply->start = network_response_start;
+    reply->type = network_query_type;
+    if (reply->tcp) {
+        network_client->connection->pending = reply;   // The following messages wait for this response
+    }
+    network_deferred = true;
+    return reply;
+}
 
-    packet_print(*packet_rec, addr, false);
+void DNS_network_reply(dns_reply_t *reply, dns_packet_t response) {
+    uint8 buf[BUFFER_SIZE + 2];
+    struct dns_buffer buffer;
+    unsigned long encode_start = DNS_latency_start();
+    DNS_buffer_init(&buffer, &buf[2], BUFFER_SIZE);
+    DNS_buffer_write_packet(&buffer, response);
+    DNS_latency_end(LATENCY_ENCODE, encode_start);
+    DNS_metrics_count_query(reply->tcp, reply->type, response.header.rcode);
+    uint32 len = buffer.pos;
 
-    return packet_rec;
+    network_client_t *client = &reply->client;
+    if (!reply->tcp) {
+        packet_print(response, client->peer, true);
+        if (sendto(client->fd, &buf[2], len, 0, (struct sockaddr *) &client->peer, sizeof(client->peer)) < 0) {
+            DNS_log_error("[ dns_network] Failed to send response to the client: %s", strerror(errno));
+        }
+    }
+    else if (client->connection != NULL) {
+        packet_print(response, client->peer, true);
+        tcp_connection_t *conn = client->connection;
+        conn->pending = NULL;
+        buf[0] = (uint8) (len >> 8);
+        buf[1] = (uint8) len;
+        memcpy(conn->out, buf, len + 2);
+        conn->out_length = len + 2;
+        conn->out_pos = 0;
+        conn->last_active = time(NULL);
+
+        // Sent after the events are handled, the connection may still be referred to by the events
+        reactor_t *reactor = client->reactor;
+        conn->ready = true;
+        conn->ready_next = reactor->ready;
+        reactor->ready = conn;
+    }
+    else {
+        DNS_log_trace("[ dns_network] The connection is closed before the response is sent.");
+    }
+    DNS_latency_end(LATENCY_RESOLUTION, reply->start);
+    free(reply);
 }
 
+/**
+ * The arguments of a worker thread
+ */
+typedef struct {
+    const char *address;
+    dns_handler_t handler;
+} network_worker_t;
+
+/**
+ * The entry of a worker thread, runs its own event loop on its own sockets
+ * @param arg The {@code network_worker_t} of the worker
+ */
+void *network_worker_main(void *arg) {
+    network_worker_t *worker = (network_worker_t *) arg;
+    network_run_reactor(worker->address, worker->handler, true);
+    return NULL;
+}
+
+void DNS_network_set_io_uring(bool enabled) {
+    network_use_uring = enabled;
+}
+
+void DNS_network_serve(const char *address, dns_handler_t handler, int workers) {
+    if (workers <= 1) {
+        network_run_reactor(address, handler, false);
+        return;
+    }
+    if (workers > MAX_WORKERS) {
+        DNS_log_warning("[ dns_network] Too many workers, only %d workers are started", MAX_WORKERS);
+        workers = MAX_WORKERS;
+    }
+
+    network_worker_t worker;
+    worker.address = address;
+    worker.handler = handler;
+
+    pthread_t threads[MAX_WORKERS];
+    int started = 0;
+    for (; started < workers; started++) {
+        int ret = pthread_create(&threads[started], NULL, network_worker_main, &worker);
+        if (ret != 0) {
+            DNS_log_error("[ dns_network] Failed to start worker %d: %s", started, strerror(ret));
+            break;
+        }
+    }
+    DNS_log_info("Started %d workers on %s", started, address);
+
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+#endif
+
 dns_packet_t *DNS_network_send_query_tcp(const char *address, char *name, int type) {
     struct sockaddr_in addr;
     addr.sin_family = AF_INET;
@@ -345,9 +1101,10 @@ dns_packet_t *DNS_network_send_query_tcp(const char *address, char *name, int ty
     char send_buf[BUFFER_SIZE] = {0};
     dns_packet_t packet = DNS_query_create_request(name, type);
     packet_print(packet, addr, true);
-    buffer_t buffer = DNS_buffer_from_ptr(send_buf + 2, BUFFER_SIZE - 2);
-    DNS_buffer_write_packet(buffer, packet);
-    uint16 len = (uint16) buffer->pos;
+    struct dns_buffer buffer;
+    DNS_buffer_init(&buffer, send_buf + 2, BUFFER_SIZE - 2);
+    DNS_buffer_write_packet(&buffer, packet);
+    uint16 len = (uint16) buffer.pos;
     *((uint16 *) send_buf) = htons(len);
     if (send(sock, send_buf, len + 2, 0) < 0) {
         DNS_log_error("[ dns_network] Failed to send TCP packet to DNS server: %s", strerror(errno));
@@ -355,31 +1112,31 @@ dns_packet_t *DNS_network_send_query_tcp(const char *address, char *name, int ty
         return NULL;
     }
 
-    dns_packet_t *packet_rec = (dns_packet_t *) malloc(sizeof(dns_packet_t));
+    dns_packet_t *packet_rec = (dns_packet_t *) DNS_alloc(sizeof(dns_packet_t));
     char buf_rec[BUFFER_SIZE] = {0};
-    buffer_t buffer_rec = DNS_buffer_from_ptr(buf_rec + 2, BUFFER_SIZE - 2);
+    struct dns_buffer buffer_rec;
+    DNS_buffer_init(&buffer_rec, buf_rec + 2, BUFFER_SIZE - 2);
     packet_rec->queries = NULL;
     packet_rec->answers = NULL;
     packet_rec->additionals = NULL;
     packet_rec->authorities = NULL;
 
-    struct timeval start, end;
-    gettimeofday(&start, NULL);
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
     if (recv(sock, buf_rec, sizeof(buf_rec), 0) < 0) {
         DNS_log_error("[ dns_network] Failed to receive TCP packet from DNS server: %s", strerror(errno));
-        free(packet_rec);
+        close(sock);
         return NULL;
     }
-    gettimeofday(&end, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
 
-    DNS_log_trace("[ dns_network] Server respond in %f ms.", (float) (end.tv_usec - start.tv_usec) / 1000);
+    DNS_log_trace("[ dns_network] Server respond in %f ms.",
+                  (double) (end.tv_sec - start.tv_sec) * 1000 + (double) (end.tv_nsec - start.tv_nsec) / 1e6);
 
     close(sock);
 
-    if (!DNS_buffer_read_packet(buffer_rec, packet_rec)) {
+    if (!DNS_buffer_read_packet(&buffer_rec, packet_rec)) {
         DNS_log_error("[ dns_network] Failed to decode TCP packet as DNS packet.");
-        DNS_buffer_free(buffer_rec);
-        free(packet_rec);
         return NULL;
     }
 
@@ -9,42 +9,133 @@
 
 // Server-only functions, will be excluded in client
 #ifndef CLIENT
+#include <netinet/in.h>
+#include "dns_view.h"
 
 /**
  * Initialize UDP socket for server
  * @param address The address to listen on
+ * @param reuse_port Whether other sockets can be bound to the same address with {@code SO_REUSEPORT}
  * @return The socket
  */
-int DNS_network_init_server_socket_udp(const char *address);
+int DNS_network_init_server_socket_udp(const char *address, bool reuse_port);
 
 /**
  * Initialize TCP socket for server
  * @param address The address to listen on
+ * @param reuse_port Whether other sockets can be bound to the same address with {@code SO_REUSEPORT}
  * @return The socket
  */
-int DNS_network_init_server_socket_tcp(const char *address);
+int DNS_network_init_server_socket_tcp(const char *address, bool reuse_port);
+
+/**
+ * The function creating the response of a request, like {@code DNS_query_create_response}
+ */
+typedef dns_packet_t (*dns_handler_t)(const dns_packet_view_t *request);
+
+/**
+ * Handle one request: parse it, create the response with the handler and encode the response.
+ * All the memory used during the request is allocated from the arena of the thread
+ * @param request The request packet
+ * @param length The length of the request
+ * @param response The buffer of the response
+ * @param capacity The capacity of the response buffer
+ * @param handler The function creating the response
+ * @param peer The address of the client
+ * @param tcp Whether the request is received over TCP, for the metrics
+ * @return The length of the response
+ */
+int DNS_network_process_request(ptr_t request, int length, ptr_t response, int capacity, dns_handler_t handler,
+                                struct sockaddr_in peer, bool tcp);
 
 /**
  * Handle one single request from the client with UDP
  * @param sock The socket
+ * @param handler The function creating the response
+ * @return True if a request is received, false if there are no requests on a non-blocking socket
  */
-void DNS_network_handle_query_udp(int sock);
+bool DNS_network_handle_query_udp(int sock, dns_handler_t handler);
 
 /**
- * Handle one single request from the client with TCP
+ * Handle a batch of requests from the clients with UDP. The requests already queued on the socket
+ * (at most {@code batch_size}, up to 64) are received with one {@code recvmmsg} into the buffers of
+ * current thread, handled one by one, and all the responses are sent with one {@code sendmmsg}
  * @param sock The socket
+ * @param handler The function creating the response
+ * @param batch_size The maximum number of requests in the batch
+ * @return The number of requests handled, 0 if there are no requests on a non-blocking socket, -1 if failed
  */
-void DNS_network_handle_query_tcp(int sock);
-#endif
+int DNS_network_handle_queries_udp(int sock, dns_handler_t handler, int batch_size);
 
 /**
- * Send a DNS query to the a DNS server with UDP and retrieve the response
- * @param address The address of the server
- * @param name The name to be queried
- * @param type The query type
- * @return The response packet from server, NULL if error occurs in the query
+ * A request whose response is sent later, created with {@code DNS_network_defer}
+ */
+typedef struct dns_reply dns_reply_t;
+
+/**
+ * Defer the response of the request being handled, so the handler can return before the response
+ * is known (the packet returned by the handler is ignored). The connection of a TCP request is not
+ * read until the response is sent. Only the requests handled by the event loop of epoll can be deferred
+ * @return The deferred request, which should be answered with {@code DNS_network_reply},
+ *         NULL if the request cannot be deferred
+ */
+dns_reply_t *DNS_network_defer();
+
+/**
+ * Send the response of a deferred request to the client and release the deferred request. The response
+ * of a TCP request is sent after the events of the current iteration are handled.
+ * Should be called from the event loop that handled the request
+ * @param reply The deferred request
+ * @param response The response
  */
-dns_packet_t *DNS_network_send_query_udp(const char* address, char* name, int type);
+void DNS_network_reply(dns_reply_t *reply, dns_packet_t response);
+
+/**
+ * The functions called by the event loop of each worker thread, so other modules can wait for their
+ * own sockets and timers in the same loop, like the local server waiting for the upstream servers
+ */
+typedef struct {
+    bool (*start)(void);            // Called once in each worker thread before the loop starts, false to stop
+    int (*timeout)(void);           // The milliseconds before the next timer of current thread expires, -1 if none
+    void (*expire)(void);           // Handle the expired timers of current thread, called after each iteration
+    void (*readable)(int fd);       // Handle a readable socket watched with {@code DNS_network_watch}
+} dns_loop_hooks_t;
+
+/**
+ * Set the hooks of the event loops started later, the hooks are copied
+ * @param hooks The hooks, NULL to remove the hooks
+ */
+void DNS_network_set_loop_hooks(const dns_loop_hooks_t *hooks);
+
+/**
+ * Watch the readable events of a socket in the event loop of current thread, the socket is
+ * passed to the {@code readable} hook when readable. Should be called from the hooks
+ * @param fd The socket, should be non-blocking
+ * @return True if success
+ */
+bool DNS_network_watch(int fd);
+
+/**
+ * Choose the backend of the server loops started later, the loops fall back to epoll
+ * if io_uring is not supported by the kernel
+ * @param enabled True to use io_uring, false to use epoll (the default)
+ */
+void DNS_network_set_io_uring(bool enabled);
+
+/**
+ * Serve the requests on both UDP and TCP on the address with an epoll event loop.
+ * Many TCP connections are served concurrently, the messages on them are prefixed with
+ * their lengths, and the complete messages are dispatched to the handler.
+ * With more than one worker, each worker thread runs its own event loop on its own UDP and TCP
+ * sockets bound to the same address with {@code SO_REUSEPORT}, and the kernel spreads the
+ * clients across the workers. The handler is called concurrently from all the workers.
+ * This function only returns if the sockets cannot be set up
+ * @param address The address to listen on
+ * @param handler The function creating the response
+ * @param workers The number of worker threads
+ */
+void DNS_network_serve(const char *address, dns_handler_t handler, int workers);
+#endif
 
 /**
  * Send a DNS query to the a DNS server with TCP and retrieve the response
@@ -6,6 +6,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <arpa/inet.h>
 #include "dns_query.h"
 #include "dns_network.h"
 
@@ -42,6 +43,13 @@ dns_packet_t DNS_query_create_request(char *name, int type) {
 #ifndef CLIENT
 // Some server-only code that we don't expect in the client
 #include "dns_database.h"
+#include "dns_zone.h"
+#include "dns_cache.h"
+#include "dns_resolver.h"
+#include "dns_metrics.h"
+
+// The maximum number of delegation points of one name
+#define MAX_DELEGATIONS 16
 
 const char *table_name;
 
@@ -72,6 +80,52 @@ void DNS_query_set_table_name(const char *name) {
     table_name = name;
 }
 
+/**
+ * Look up the records of the current table. If the zone is loaded into memory
+ * the in-memory index will be used instead of the database.
+ * Note that the returned RRs should be copied before adding to other linked lists
+ */
+dns_rr_t *query_get_record(char *name, int type, int class, bool include_cname) {
+    if (DNS_zone_loaded()) {
+        return DNS_zone_get_record(name, type, class, include_cname);
+    }
+    return DNS_database_get_record(table_name, name, type, class, include_cname);
+}
+
+/**
+ * Find the SOA record of the closest zone of the name in the current table
+ * @return The SOA record, NULL if the name is not in any zone with an SOA record
+ */
+dns_rr_t *query_find_soa(char *name, int class) {
+    for (char *c = name; *c != '\0'; c++) {
+        if (c == name || *(c - 1) == '.') {
+            dns_rr_t *soa = query_get_record(c, TYPE_SOA, class, false);
+            if (soa != NULL) {
+                return soa;
+            }
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Create the query of the question in the request, the name is decompressed from the packet
+ * @return The query, NULL if the name is too long
+ */
+dns_query_t *query_create_from_view(const dns_packet_view_t *request, const dns_question_view_t *question) {
+    dns_query_t *query = DNS_query_create();
+    if (query == NULL) {
+        return NULL;
+    }
+    if (!DNS_view_name(request, question->name, query->name)) {
+        DNS_log_warning("[  dns_query ] The name in the question is longer than %d bytes", RR_STRING_LEN - 1);
+        return NULL;
+    }
+    query->type = question->type;
+    query->class = question->class;
+    return query;
+}
+
 /**
  * Add element to a linked list, used in {@code DNS_query_create_response}
  * and {@code DNS_query_create_response_local}
@@ -86,10 +140,10 @@ void DNS_query_set_table_name(const char *name) {
         linked_list##_last = linked_list##_last->next;       \
     }
 
-dns_packet_t DNS_query_create_response(dns_packet_t request) {
+dns_packet_t DNS_query_create_response(const dns_packet_view_t *request) {
     dns_packet_t response;
 
-    response.header.id = request.header.id;
+    response.header.id = request->header.id;
     response.header.qr = 1;
     response.header.opcode = OP_STANDARD_QUERY;
     response.header.aa = 0;
@@ -107,34 +161,39 @@ dns_packet_t DNS_query_create_response(dns_packet_t request) {
     response.additionals = NULL;
     response.authorities = NULL;
 
-    dns_query_t *query;
+    dns_question_view_t question;
+    uint32 offset = request->questions;
     bool have_invaild_mode = false;
 
-    for (query = request.queries; query != NULL; query = query->next) {
-        ptr_t name_ = query->name;
-        uint16 type = query->type;
-        uint16 class = query->class;
+    for (int i = 0; i < request->header.question_count; i++) {
+        offset = DNS_view_read_question(request, offset, &question);
+        uint16 type = question.type;
+        uint16 class = question.class;
         dns_rr_t *data;
 
         // Check if there are invalid query types and classes
-        if (!strcmp(DNS_type_to_str(query->type), "[UNKNOWN]")) {
+        if (!strcmp(DNS_type_to_str(type), "[UNKNOWN]")) {
             have_invaild_mode = true;
             continue;
         }
 
-        if (!strcmp(DNS_class_to_str(query->class), "[UNKNOWN]")) {
+        if (!strcmp(DNS_class_to_str(class), "[UNKNOWN]")) {
             have_invaild_mode = true;
             continue;
         }
 
         // Append queries
-        dns_query_t *query2 = DNS_query_copy(query);
+        dns_query_t *query2 = query_create_from_view(request, &question);
+        if (query2 == NULL) {
+            continue;
+        }
         DNS_packet_append_query(&response, query2, true);
+        ptr_t name_ = query2->name;
 
         dns_rr_t *cname_pending_first = NULL, *cname_pending_last = NULL;
         dns_rr_t *add_pending_first = NULL, *add_pending_last = NULL;
 
-        data = DNS_database_get_record(table_name, name_, type, class, true);
+        data = query_get_record(name_, type, class, true);
 
         // Search for matching records of given name and type
         // This will also include CNAME records
@@ -159,7 +218,7 @@ dns_packet_t DNS_query_create_response(dns_packet_t request) {
         // For the found CNAME results, get the corresponding records.
         // If any other CNAME is found, then it will also be parsed
         for (dns_rr_t *t = cname_pending_first; t != NULL; t = t->next) {
-            dns_rr_t *data2 = DNS_database_get_record(table_name, t->data, type, class, true);
+            dns_rr_t *data2 = query_get_record(t->rdata.name, type, class, true);
 
             if (data2 != NULL) {
                 dns_rr_t *t4 = DNS_RR_copy(t);
@@ -169,7 +228,7 @@ dns_packet_t DNS_query_create_response(dns_packet_t request) {
                 // CNAME RRs will not be appended to the packet if the query is not CNAME type and the
                 // RR does not have a related RR of the queried type
                 DNS_log_warning("[  dns_query ] Found CNAME record %s but not found its corresponding record.",
-                        t->data);
+                        t->rdata.name);
             }
 
             for (dns_rr_t *tt = data2; tt != NULL; tt = tt->next) {
@@ -190,17 +249,32 @@ dns_packet_t DNS_query_create_response(dns_packet_t request) {
             }
         }
 
-        // Break down the name into pieces and find authoritative name servers.
-        for (ptr_t c = name_; *c != '\0'; c++) {
-            if (*(c - 1) == '.' || c == name_) {
-                data = DNS_database_get_record(table_name, c, TYPE_NS, class, false);
+        // Find the authoritative name servers of the name and its parent names.
+        // With the zone loaded into memory, all of them can be found in one walk of the label trie
+        // and their glue records are already known
+        dns_delegation_t delegations[MAX_DELEGATIONS];
+        int delegation_count = 0;
+        if (DNS_zone_loaded()) {
+            delegation_count = DNS_zone_get_delegations(name_, class, delegations, MAX_DELEGATIONS);
+            for (int i = 0; i < delegation_count; i++) {
+                for (dns_rr_t *t = delegations[i].ns; t != NULL; t = t->next) {
+                    DNS_packet_append_authority(&response, DNS_RR_copy(t), true);
+                }
+            }
+        }
+        else {
+            // Break down the name into pieces and look up each of them
+            for (ptr_t c = name_; *c != '\0'; c++) {
+                if (*(c - 1) == '.' || c == name_) {
+                    data = query_get_record(c, TYPE_NS, class, false);
 
-                for (dns_rr_t *t = data; t != NULL; t = t->next) {
-                    dns_rr_t *t2 = DNS_RR_copy(t);
-                    DNS_packet_append_authority(&response, t2, true);
+                    for (dns_rr_t *t = data; t != NULL; t = t->next) {
+                        dns_rr_t *t2 = DNS_RR_copy(t);
+                        DNS_packet_append_authority(&response, t2, true);
 
-                    dns_rr_t *t3 = DNS_RR_copy(t);
-                    add_to_linked_list(add_pending, t3);
+                        dns_rr_t *t3 = DNS_RR_copy(t);
+                        add_to_linked_list(add_pending, t3);
+                    }
                 }
             }
         }
@@ -208,18 +282,8 @@ dns_packet_t DNS_query_create_response(dns_packet_t request) {
         // Search for the IP address of the domain names in records of type MX and NS
         // Note that we assume that these domain names don't have canonical names
         for (dns_rr_t *t = add_pending_first; t != NULL; t = t->next) {
-            char name[128];
-            if (t->type == TYPE_MX) {
-                int nc;
-                if (sscanf(t->data, "%d,%s", &nc, name) != 2) {
-                    DNS_log_warning("[  dns_query ] Expected preference and name in MX record, but only get name");
-                    strcpy(name, t->data);
-                }
-            }
-            else {
-                strcpy(name, t->data);
-            }
-            dns_rr_t *data2 = DNS_database_get_record(table_name, name, TYPE_A, class, false);
+            ptr_t name = DNS_RR_rdata_name(t);  // The mail exchanger or the name server
+            dns_rr_t *data2 = query_get_record(name, TYPE_A, class, false);
 
             if (data2 == NULL) {
                 DNS_log_warning("[  dns_query ] The IP address of name %s could not be found.", name);
@@ -230,11 +294,25 @@ dns_packet_t DNS_query_create_response(dns_packet_t request) {
                 DNS_packet_append_additional(&response, t2, true);
             }
         }
+
+        for (int i = 0; i < delegation_count; i++) {
+            for (dns_rr_t *t = delegations[i].glue; t != NULL; t = t->next) {
+                DNS_packet_append_additional(&response, DNS_RR_copy(t), true);
+            }
+        }
     }
 
-    // If there is no RRs in the packet, change the response code
-    if (!response.header.answer_count && !response.header.authority_count && !response.header.additional_count )
+    // If there is no RRs in the packet, change the response code. The SOA record of the zone is added to
+    // the authority section, whose minimum TTL tells how long the negative answer can be cached (RFC 2308)
+    if (!response.header.answer_count && !response.header.authority_count && !response.header.additional_count) {
         response.header.rcode = R_NOT_EXIST;
+        for (dns_query_t *q = response.queries; q != NULL; q = q->next) {
+            dns_rr_t *soa = query_find_soa(q->name, q->class);
+            if (soa != NULL) {
+                DNS_packet_append_authority(&response, DNS_RR_copy(soa), true);
+            }
+        }
+    }
 
     if (have_invaild_mode)
         response.header.rcode = R_QUERY_TYPE_UNSUPPORTED;
@@ -242,53 +320,113 @@ dns_packet_t DNS_query_create_response(dns_packet_t request) {
     return response;
 }
 
-dns_packet_t DNS_query_create_response_local(dns_packet_t request) {
-    dns_packet_t response;
-
-    response.header.id = request.header.id;
-    response.header.qr = 1;
-    response.header.opcode = OP_STANDARD_QUERY;
-    response.header.aa = 0;
-    response.header.tc = 0;
-    response.header.rd = 0;
-    response.header.ra = 0;
-    response.header.z = 0;
-    response.header.rcode = R_NO_ERROR;
-    response.header.question_count = 0;
-    response.header.answer_count = 0;
-    response.header.additional_count = 0;
-    response.header.authority_count = 0;
-    response.queries = NULL;
-    response.answers = NULL;
-    response.additionals = NULL;
-    response.authorities = NULL;
+/**
+ * Defer the request when the first record not cached is found, and copy the response created so far
+ * into the arena of the pending request, which becomes the current arena
+ * @param response The response created so far
+ * @return The request waiting for the resolutions, NULL if the request cannot be deferred
+ */
+dns_resolver_request_t *query_defer_response(const dns_packet_t *response) {
+    dns_resolver_request_t *pending = DNS_resolver_request_create();
+    dns_reply_t *reply = pending != NULL ? DNS_network_defer() : NULL;
+    if (reply == NULL) {
+        DNS_log_error("[  dns_query ] Failed to defer the request, the records cannot be resolved");
+        DNS_resolver_request_free(pending);
+        return NULL;
+    }
+    pending->reply = reply;
+
+    dns_packet_t *copy = &pending->response;
+    copy->header = response->header;
+    copy->queries = NULL;
+    copy->answers = NULL;
+    copy->authorities = NULL;
+    copy->additionals = NULL;
+    for (dns_query_t *q = response->queries; q != NULL; q = q->next) {
+        DNS_packet_append_query(copy, DNS_query_copy(q), false);
+    }
+    for (dns_rr_t *t = response->answers; t != NULL; t = t->next) {
+        DNS_packet_append_answer(copy, DNS_RR_copy(t), false);
+    }
+    for (dns_rr_t *t = response->authorities; t != NULL; t = t->next) {
+        DNS_packet_append_authority(copy, DNS_RR_copy(t), false);
+    }
+    for (dns_rr_t *t = response->additionals; t != NULL; t = t->next) {
+        DNS_packet_append_additional(copy, DNS_RR_copy(t), false);
+    }
+    return pending;
+}
 
-    dns_query_t *query;
+/**
+ * Create the response of the local server from the cache. The request is deferred at the first record
+ * not cached, then the rest of the response is created in the arena of the pending request, and the
+ * records not cached are resolved for it. The response is sent when the resolutions finish
+ * @param request The view of the request packet
+ * @param response Returns the response packet, not used if the request is deferred
+ * @param deferred Returns the request waiting for the resolutions, NULL if all the records are cached
+ * @return False if the request should be deferred but cannot be
+ */
+bool query_create_response_local(const dns_packet_view_t *request, dns_packet_t *response,
+                                 dns_resolver_request_t **deferred) {
+    dns_resolver_request_t *pending = NULL;
+    *deferred = NULL;
+    response->header.id = request->header.id;
+    response->header.qr = 1;
+    response->header.opcode = OP_STANDARD_QUERY;
+    response->header.aa = 0;
+    response->header.tc = 0;
+    response->header.rd = 0;
+    response->header.ra = 0;
+    response->header.z = 0;
+    response->header.rcode = R_NO_ERROR;
+    response->header.question_count = 0;
+    response->header.answer_count = 0;
+    response->header.additional_count = 0;
+    response->header.authority_count = 0;
+    response->queries = NULL;
+    response->answers = NULL;
+    response->additionals = NULL;
+    response->authorities = NULL;
+
+    dns_question_view_t question;
+    uint32 offset = request->questions;
     bool have_invaild_mode = false;
+    bool not_exist = false;             // Whether one of the names does not exist
 
-    for (query = request.queries; query != NULL; query = query->next) {
-        ptr_t name = name = query->name;
-        uint16 type = query->type;
-        uint16 class = query->class;
+    for (int i = 0; i < request->header.question_count; i++) {
+        offset = DNS_view_read_question(request, offset, &question);
+        uint16 type = question.type;
+        uint16 class = question.class;
 
-        if (!strcmp(DNS_type_to_str(query->type), "[UNKNOWN]")) {
+        if (!strcmp(DNS_type_to_str(type), "[UNKNOWN]")) {
             have_invaild_mode = true;
             continue;
         }
 
-        if (!strcmp(DNS_class_to_str(query->class), "[UNKNOWN]")) {
+        if (!strcmp(DNS_class_to_str(class), "[UNKNOWN]")) {
             have_invaild_mode = true;
             continue;
         }
 
-        dns_query_t *query2 = DNS_query_copy(query);
-        DNS_packet_append_query(&response, query2, true);
-
-        // Search local cache
-        dns_rr_t *cache = DNS_database_get_cache(name, type, class);
+        dns_query_t *query2 = query_create_from_view(request, &question);
+        if (query2 == NULL) {
+            continue;
+        }
+        DNS_packet_append_query(response, query2, true);
+        ptr_t name = query2->name;
+
+        // Search local cache, the records near expiry or served stale are refreshed in the background
+        bool refresh = false;
+        int negative_rcode;
+        dns_rr_t *soa;
+        dns_rr_t *cache = DNS_cache_lookup(name, type, class, &refresh);
+        if (refresh) {
+            DNS_resolver_prefetch(name, type, class);
+        }
 
-        // Handle the cache
+        // Handle the cache, each question is counted once by the result of looking up its own records
         if (cache != NULL) {
+            DNS_metrics_count_cache_lookup(true);
             DNS_log_trace("[  dns_query ] Record found in local cache: %s %s", DNS_type_to_str(type), name);
 
             dns_rr_t *cname_pending_first = NULL, *cname_pending_last = NULL;
@@ -305,7 +443,7 @@ dns_packet_t DNS_query_create_response_local(dns_packet_t request) {
                 }
                 else {
                     dns_rr_t *tt = DNS_RR_copy(t);
-                    DNS_packet_append_answer(&response, tt, true);
+                    DNS_packet_append_answer(response, tt, true);
                 }
 
                 // If the cache entry have the type MX
@@ -319,14 +457,18 @@ dns_packet_t DNS_query_create_response_local(dns_packet_t request) {
             // Looks up the address of the CNAMEs, recursive CNAMEs will be added to the list
             // during this procedure
             for (dns_rr_t *t = cname_pending_first; t != NULL; t = t->next) {
-                dns_rr_t *data2 = DNS_database_get_cache(t->data, type, class);
+                refresh = false;
+                dns_rr_t *data2 = DNS_cache_lookup(t->rdata.name, type, class, &refresh);
+                if (refresh) {
+                    DNS_resolver_prefetch(t->rdata.name, type, class);
+                }
 
                 if (data2 == NULL) {
                     DNS_log_warning(
                             "[  dns_query ] The cache contains CNAME record %s but the corresponding record cannot be found",
-                            t->data);
+                            t->rdata.name);
                 } else {
-                    DNS_packet_append_answer(&response, DNS_RR_copy(t), true);
+                    DNS_packet_append_answer(response, DNS_RR_copy(t), true);
                     for (dns_rr_t *t2 = data2; t2 != NULL; t2 = t2->next) {
                         // Found recursive CNAME
                         if (t2->type == TYPE_CNAME && type != TYPE_CNAME) {
@@ -334,7 +476,7 @@ dns_packet_t DNS_query_create_response_local(dns_packet_t request) {
                             add_to_linked_list(cname_pending, r);
                         }
                         else {
-                            DNS_packet_append_answer(&response, DNS_RR_copy(t2), true);
+                            DNS_packet_append_answer(response, DNS_RR_copy(t2), true);
                         }
 
                         if (t2->type == TYPE_MX) {
@@ -347,109 +489,79 @@ dns_packet_t DNS_query_create_response_local(dns_packet_t request) {
 
             // Look for the IP addresses for the MX records
             for (dns_rr_t *t = add_pending_first; t != NULL; t = t->next) {
-                char name[128];
-                if (t->type == TYPE_MX) {
-                    int nc;
-                    bool found = false;
-                    if (sscanf(t->data, "%d,%s", &nc, name) != 2) {
-                        DNS_log_warning("[  dns_query ] Expected preference and name in MX record, but only get name");
-                        strcpy(name, t->data);
-                    }
+                ptr_t name = t->rdata.mx.exchange;
+                refresh = false;
+                dns_rr_t *data2 = DNS_cache_lookup(name, TYPE_A, class, &refresh);
+                if (refresh) {
+                    DNS_resolver_prefetch(name, TYPE_A, class);
                 }
-                else {
-                    strcpy(name, t->data);
-                }
-                dns_rr_t *data2 = DNS_database_get_cache(name, TYPE_A, class);
 
                 if (data2 == NULL) {
                     DNS_log_warning(
                             "[  dns_query ] The cache contains MX record %s but the IP address of the MX server cannot be found",
-                            t->data);
+                            name);
                 } else {
                     for (dns_rr_t *t2 = data2; t2 != NULL; t2 = t2->next) {
                         if (t2->type == TYPE_A) {
-                            DNS_packet_append_additional(&response, DNS_RR_copy(t2), true);
+                            DNS_packet_append_additional(response, DNS_RR_copy(t2), true);
                         }
                     }
                 }
             }
         }
+        else if ((soa = DNS_cache_get_negative(name, type, class, &negative_rcode)) != NULL) {
+            // The upstream servers answered that the records do not exist not long ago
+            DNS_metrics_count_negative_hit();
+            DNS_log_trace("[  dns_query ] Negative answer found in local cache: %s %s", DNS_type_to_str(type), name);
+            DNS_packet_append_authority(response, soa, true);
+            if (negative_rcode == R_NOT_EXIST) {
+                not_exist = true;
+                if (pending != NULL) {
+                    pending->not_exist = true;
+                }
+            }
+        }
         else {
-            // Not found in the cache, should start iterative query
-            DNS_log_warning("[  dns_query ] Record not found in local cache, start iterative query...");
-
-            // The name servers to be queried
-            dns_rr_t *ns_pending_first = NULL, *ns_pending_last = NULL;
-
-            // Adds the root name server to the list of name servers
-            ns_pending_first = DNS_RR_create();
-            strcpy(ns_pending_first->name, "root.local");
-            strcpy(ns_pending_first->data, ROOT_DNS_IP);
-            ns_pending_first->class = CLASS_IN;
-            ns_pending_first->type = type;
-            ns_pending_first->next = NULL;
-            ns_pending_last = ns_pending_first;
-
-            // Make requests to each of the name servers. Additional name servers found
-            // will be added to the name servers list
-            for (dns_rr_t *ns = ns_pending_first; ns != NULL; ns = ns->next) {
-                DNS_log_trace("[  dns_query ] Sending query request to %s (%s)", ns->name ,ns->data);
-                dns_packet_t *ns_res = DNS_network_send_query_udp(ns->data, name, type);
-
-                if (ns_res != NULL) {
-                    for (dns_rr_t *t = ns_res->answers; t != NULL; t = t->next) {
-                        dns_rr_t *tt = DNS_RR_copy(t);
-                        DNS_packet_append_answer(&response, tt, true);
-                        DNS_database_put_cache(*t);
-
-                        if (t->type == TYPE_MX) {
-                            char name[128];
-                            int nc;
-                            bool found = false;
-                            if (sscanf(t->data, "%d,%s", &nc, name) != 2) {
-                                DNS_log_warning("[  dns_query ] Expected preference and name in MX record, but only get name");
-                                strcpy(name, t->data);
-                            }
-
-                            for (dns_rr_t *t2 = ns_res->additionals; t2 != NULL; t2 = t2->next) {
-                                if (!strcmp(t2->name, name)) {
-                                    dns_rr_t *ttt = DNS_RR_copy(t2);
-                                    DNS_packet_append_additional(&response, ttt, true);
-                                    DNS_database_put_cache(*t2);
-                                    found = true;
-                                }
-                            }
-
-                            if (!found)
-                                DNS_log_warning("[   dns_query ] The IP address of the MX record %s cannot be found.", name);
-                        }
-                    }
-
-                    // Next level of name servers
-                    for (dns_rr_t *t = ns_res->authorities; t != NULL; t = t->next) {
-                        bool found = false;
-                        for (dns_rr_t *t2 = ns_res->additionals; t2 != NULL; t2 = t2->next) {
-                            if (!strcmp(t->data, t2->name) && t2->type == TYPE_A) {
-                                found = true;
-                                ns_pending_last->next = DNS_RR_copy(t2);
-                                ns_pending_last = ns_pending_last->next;
-                            }
-                        }
-                        if (!found)
-                            DNS_log_warning("[  dns_query ] In the response of server %s, the address of %s is not given",
-                                    ns->data, t->data);
-                    }
+            DNS_metrics_count_cache_lookup(false);
+            if (pending == NULL) {
+                if ((pending = query_defer_response(response)) == NULL) {
+                    return false;
                 }
+                pending->not_exist = not_exist;
+                response = &pending->response;
+                *deferred = pending;
             }
+            // Not found in the cache, the records are resolved without blocking the other clients
+            DNS_log_warning("[  dns_query ] Record not found in local cache, start iterative query...");
+            DNS_resolver_resolve(pending, name, type, class);
         }
     }
 
-    if (!response.header.answer_count && !response.header.authority_count && !response.header.additional_count )
-        response.header.rcode = R_NOT_EXIST;
+    // The rcode of a pending request is decided when its resolutions finish. The authority section
+    // only holds the SOA records of the negative answers
+    if (pending == NULL && !response->header.answer_count && !response->header.additional_count &&
+        (!response->header.authority_count || not_exist))
+        response->header.rcode = R_NOT_EXIST;
 
     if (have_invaild_mode)
-        response.header.rcode = R_QUERY_TYPE_UNSUPPORTED;
+        response->header.rcode = R_QUERY_TYPE_UNSUPPORTED;
 
+    return true;
+}
+
+dns_packet_t DNS_query_create_response_local(const dns_packet_view_t *request) {
+    dns_packet_t response;
+    dns_resolver_request_t *pending;
+    if (!query_create_response_local(request, &response, &pending)) {
+        response = DNS_query_create_fail_response(R_SERVER_FAILURE);
+        response.header.id = request->header.id;
+        return response;
+    }
+
+    // Some records are not cached, the response is sent by the resolver later
+    if (pending != NULL) {
+        DNS_resolver_request_submit(pending);
+    }
     return response;
 }
 
@@ -8,6 +8,7 @@
 
 #include "dns_common.h"
 #include "dns_io.h"
+#include "dns_view.h"
 
 /**
  * Creates a DNS request packet
@@ -36,20 +37,21 @@ void DNS_query_set_table_name(const char* name);
 /**
  * Process the queries in the request packet and create
  * the DNS response packet according to the result.
- * @param request The request packet
+ * @param request The view of the request packet
  * @return The response packet
  */
-dns_packet_t DNS_query_create_response(dns_packet_t request);
+dns_packet_t DNS_query_create_response(const dns_packet_view_t *request);
 
 /**
  * Process the queries in the request packet and create
  * the DNS response packet according to the result.
- * Used in local server, cache will be looked up and iterative
- * queries might be made to other servers.
- * @param request The request packet
+ * Used in local server, cache will be looked up. The records not cached are resolved
+ * iteratively by the resolver of the event loop, and the response is sent when they are
+ * resolved, in which case the returned packet is ignored.
+ * @param request The view of the request packet
  * @return The response packet
  */
-dns_packet_t DNS_query_create_response_local(dns_packet_t request);
+dns_packet_t DNS_query_create_response_local(const dns_packet_view_t *request);
 #endif
 
 #endif //PROJECT_DNS_DNS_QUERY_H
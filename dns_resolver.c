@@ -0,0 +1,1054 @@
+//
+// dns_resolver.c -- Implementation of the non-blocking iterative resolver
+// Created on 10/15/26.
+//
+
+#define _POSIX_C_SOURCE 200809L   // For clock_gettime
+
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/random.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "dns_resolver.h"
+#include "dns_common.h"
+#include "dns_cache.h"
+#include "dns_query.h"
+#include "dns_view.h"
+#include "dns_upstream.h"
+#include "dns_latency.h"
+#include "dns_metrics.h"
+
+#define BUFFER_SIZE 1024
+#define TASK_ARENA_CHUNK_SIZE 8192
+#define REQUEST_ARENA_CHUNK_SIZE 4096
+#define QUERY_BUCKETS 4096           // The number of buckets of the outstanding queries, a power of 2
+#define TASK_BUCKETS 4096            // The number of buckets of the resolutions in flight, a power of 2
+#define MAX_SERVERS 16               // The maximum number of servers of a zone
+#define MAX_REFERRALS 16             // The maximum number of referrals followed by a resolution
+#define ZONE_ATTEMPTS 3              // The number of rounds the servers of a zone are tried
+#define RECV_BATCH_SIZE 64           // The maximum number of responses received for one readable event
+#define UPSTREAM_SOCKETS 8           // The number of sockets to the upstream servers of each worker thread
+#define BIND_ATTEMPTS 16             // The number of random source ports tried for each socket
+#define RANDOM_BUFFER_SIZE 256       // The number of random numbers read from the kernel at once
+#define STALE_ANSWER_TIMEOUT 1800    // The milliseconds before the clients are answered with the stale records (RFC 8767)
+
+/**
+ * A client request waiting for a resolution
+ */
+typedef struct resolver_waiter {
+    dns_resolver_request_t *request;
+    struct resolver_waiter *next;
+} resolver_waiter_t;
+
+/**
+ * The state of a resolution. The resolution starts at the root server and follows the referrals,
+ * only one query of it is outstanding at any time
+ */
+typedef struct resolver_task {
+    char name[RR_STRING_LEN];
+    char key[RR_STRING_LEN];            // The lowercased name, sent to the upstream servers
+    uint16 type;
+    uint16 class;
+    uint32 hash;
+    struct resolver_task *task_next;    // Links the resolutions in the same bucket
+
+    dns_arena_t *arena;                 // Owns the records found by the resolution
+    dns_rr_t *answers;
+    dns_rr_t *additionals;
+    dns_rr_t *authorities;              // The SOA record of a negative answer
+
+    // The servers of the deepest zone known so far, "" for the root zone
+    char zone[RR_STRING_LEN];
+    uint32 servers[MAX_SERVERS];
+    int server_count;
+    uint32 tried;                       // The bit mask of the servers tried in the current round
+    int attempts;                       // The number of rounds finished
+    int referrals;
+    bool cached_zone;                   // Whether the servers are found in the delegation cache
+
+    // The outstanding query, tracked by the socket, the server, the ID and the question
+    bool outstanding;
+    int sock;
+    uint32 server;
+    uint16 id;
+    long sent;
+    unsigned long timed;                // The time the query was sent for the latency, 0 if not timed
+    long deadline;
+    int timer_index;
+    struct resolver_task *bucket_next;
+
+    resolver_waiter_t *waiters;
+
+    // The stale records of the resolution, the waiting clients are answered with them if the resolution
+    // fails or does not finish before the deadline. Only the resolutions with the stale records are queued
+    dns_rr_t *stale;
+    long stale_deadline;
+    bool stale_queued;
+    struct resolver_task *stale_prev;
+    struct resolver_task *stale_next;
+} resolver_task_t;
+
+/**
+ * The resolver of one worker thread
+ */
+typedef struct {
+    // The long-lived sockets shared by the queries, each bound to a random source port
+    int socks[UPSTREAM_SOCKETS];
+    resolver_task_t *buckets[QUERY_BUCKETS];
+
+    // The resolutions in flight keyed by the name, type and class, so the requests
+    // for the same records wait for the same resolution
+    resolver_task_t *tasks[TASK_BUCKETS];
+
+    // The binary min-heap of the outstanding queries ordered by the deadline
+    resolver_task_t **timers;
+    int timer_count;
+    int timer_capacity;
+
+    dns_resolver_request_t *ready;      // The requests finished without resolutions
+
+    // The resolutions waiting to answer with the stale records, ordered by the deadline since
+    // all the deadlines are the same time after the clients start waiting
+    resolver_task_t *stale_first;
+    resolver_task_t *stale_last;
+
+    // The random numbers of the source ports and the IDs, read from the CSPRNG of the kernel
+    // since the queries must not be predictable by the attackers poisoning the cache
+    uint32 random[RANDOM_BUFFER_SIZE];
+    int random_pos;
+} resolver_t;
+
+static __thread resolver_t *resolver = NULL;
+
+// Set by SIGUSR1, the statistics of the upstream servers are printed by the next iteration of an event loop
+static volatile sig_atomic_t resolver_print_requested = 0;
+
+void resolver_handle_sigusr1(int sig) {
+    (void) sig;
+    resolver_print_requested = 1;
+}
+
+/**
+ * Get the current time of the monotonic clock
+ * @return The time in microseconds
+ */
+long resolver_now() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/**
+ * Fill the buffer of the random numbers from the kernel
+ * @return True if success
+ */
+bool resolver_fill_random() {
+    uint8 *buf = (uint8 *) resolver->random;
+    size_t filled = 0;
+    while (filled < sizeof(resolver->random)) {
+        ssize_t ret = getrandom(buf + filled, sizeof(resolver->random) - filled, 0);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            DNS_log_error("[dns_resolver] Failed to get random numbers: %s", strerror(errno));
+            return false;
+        }
+        filled += ret;
+    }
+    resolver->random_pos = 0;
+    return true;
+}
+
+/**
+ * Get the next random number, the buffer is filled again when all the numbers are used
+ */
+uint32 resolver_random() {
+    if (resolver->random_pos >= RANDOM_BUFFER_SIZE && !resolver_fill_random()) {
+        resolver->random_pos = 0;   // Should not happen once the buffer is filled, the numbers are reused
+    }
+    return resolver->random[resolver->random_pos++];
+}
+
+/**
+ * Format an IPv4 address in host byte order, the result is valid until the next call
+ */
+const char *resolver_address_to_str(uint32 address) {
+    static __thread char str[INET_ADDRSTRLEN];
+    struct in_addr addr;
+    addr.s_addr = htonl(address);
+    inet_ntop(AF_INET, &addr, str, sizeof(str));
+    return str;
+}
+
+/**
+ * Check whether the lowercased name is in the lowercased zone, "" is the root zone
+ */
+bool resolver_in_zone(const char *name, const char *zone) {
+    size_t name_len = strlen(name), zone_len = strlen(zone);
+    if (zone_len == 0) {
+        return true;
+    }
+    if (name_len < zone_len || strcmp(name + name_len - zone_len, zone) != 0) {
+        return false;
+    }
+    return name_len == zone_len || name[name_len - zone_len - 1] == '.';
+}
+
+uint32 resolver_bucket(uint32 server, uint16 id) {
+    return (server * 2654435761u ^ id) & (QUERY_BUCKETS - 1);
+}
+
+resolver_task_t *resolver_find_query(uint32 server, uint16 id) {
+    for (resolver_task_t *t = resolver->buckets[resolver_bucket(server, id)]; t != NULL; t = t->bucket_next) {
+        if (t->server == server && t->id == id) {
+            return t;
+        }
+    }
+    return NULL;
+}
+
+void resolver_timer_swap(int i, int j) {
+    resolver_task_t *t = resolver->timers[i];
+    resolver->timers[i] = resolver->timers[j];
+    resolver->timers[j] = t;
+    resolver->timers[i]->timer_index = i;
+    resolver->timers[j]->timer_index = j;
+}
+
+void resolver_timer_sift_up(int i) {
+    while (i > 0 && resolver->timers[(i - 1) / 2]->deadline > resolver->timers[i]->deadline) {
+        resolver_timer_swap(i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+void resolver_timer_sift_down(int i) {
+    while (true) {
+        int smallest = i, left = i * 2 + 1, right = i * 2 + 2;
+        if (left < resolver->timer_count && resolver->timers[left]->deadline < resolver->timers[smallest]->deadline) {
+            smallest = left;
+        }
+        if (right < resolver->timer_count && resolver->timers[right]->deadline < resolver->timers[smallest]->deadline) {
+            smallest = right;
+        }
+        if (smallest == i) {
+            return;
+        }
+        resolver_timer_swap(i, smallest);
+        i = smallest;
+    }
+}
+
+/**
+ * Find the resolution in flight of the records
+ * @return The resolution, NULL if not found
+ */
+resolver_task_t *resolver_find_task(const char *key, uint16 type, uint16 class, uint32 hash) {
+    for (resolver_task_t *t = resolver->tasks[hash & (TASK_BUCKETS - 1)]; t != NULL; t = t->task_next) {
+        if (t->hash == hash && t->type == type && t->class == class && !strcmp(t->key, key)) {
+            return t;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Remove the resolution from the resolutions in flight
+ */
+void resolver_remove_task(resolver_task_t *task) {
+    resolver_task_t **t = &resolver->tasks[task->hash & (TASK_BUCKETS - 1)];
+    while (*t != task) {
+        t = &(*t)->task_next;
+    }
+    *t = task->task_next;
+}
+
+/**
+ * Make sure the heap has room for one more query, so the query of a new task can always be tracked
+ * @return True if success
+ */
+bool resolver_reserve_timer() {
+    if (resolver->timer_count == resolver->timer_capacity) {
+        int capacity = resolver->timer_capacity * 2;
+        resolver_task_t **timers = realloc(resolver->timers, sizeof(resolver_task_t *) * capacity);
+        if (timers == NULL) {
+            return false;
+        }
+        resolver->timers = timers;
+        resolver->timer_capacity = capacity;
+    }
+    return true;
+}
+
+/**
+ * Track the outstanding query of the task by its server and ID, and by its deadline.
+ * Each task has at most one outstanding query, and the room of it is reserved when the task is created
+ */
+void resolver_track_query(resolver_task_t *task) {
+    uint32 bucket = resolver_bucket(task->server, task->id);
+    task->bucket_next = resolver->buckets[bucket];
+    resolver->buckets[bucket] = task;
+
+    task->timer_index = resolver->timer_count++;
+    resolver->timers[task->timer_index] = task;
+    resolver_timer_sift_up(task->timer_index);
+    task->outstanding = true;
+}
+
+/**
+ * Stop tracking the outstanding query of the task
+ */
+void resolver_untrack_query(resolver_task_t *task) {
+    if (!task->outstanding) {
+        return;
+    }
+    task->outstanding = false;
+
+    resolver_task_t **t = &resolver->buckets[resolver_bucket(task->server, task->id)];
+    while (*t != task) {
+        t = &(*t)->bucket_next;
+    }
+    *t = task->bucket_next;
+
+    int i = task->timer_index;
+    resolver->timer_count--;
+    if (i != resolver->timer_count) {
+        resolver_timer_swap(i, resolver->timer_count);
+        resolver_timer_sift_down(i);
+        resolver_timer_sift_up(i);
+    }
+}
+
+/**
+ * Append a copy of the RR to the end of a linked list, the copy is allocated from the current arena
+ */
+void resolver_append_copy(dns_rr_t **list, const dns_rr_t *rr) {
+    dns_rr_t *copy = DNS_RR_copy((dns_rr_t *) rr);
+    if (copy == NULL) {
+        return;
+    }
+    copy->next = NULL;
+    while (*list != NULL) {
+        list = &(*list)->next;
+    }
+    *list = copy;
+}
+
+/**
+ * Send the response of a request whose resolutions are all finished, and release the request
+ */
+void resolver_request_complete(dns_resolver_request_t *request) {
+    DNS_arena_set_current(request->arena);
+    dns_packet_t *response = &request->response;
+    // The authority section only holds the SOA records of the negative answers
+    if (response->header.rcode == R_NO_ERROR && !response->header.answer_count &&
+        !response->header.additional_count && (!response->header.authority_count || request->not_exist)) {
+        response->header.rcode = request->failed ? R_SERVER_FAILURE : R_NOT_EXIST;
+    }
+    DNS_network_reply(request->reply, *response);
+    DNS_arena_set_current(NULL);
+    DNS_arena_free(request->arena);
+}
+
+/**
+ * Wait for the deadline to answer the waiting clients with the stale records of the resolution
+ */
+void resolver_stale_enqueue(resolver_task_t *task) {
+    task->stale_deadline = resolver_now() + STALE_ANSWER_TIMEOUT * 1000L;
+    task->stale_queued = true;
+    task->stale_next = NULL;
+    task->stale_prev = resolver->stale_last;
+    if (resolver->stale_last != NULL) {
+        resolver->stale_last->stale_next = task;
+    }
+    else {
+        resolver->stale_first = task;
+    }
+    resolver->stale_last = task;
+}
+
+/**
+ * Stop waiting for the deadline of the stale records of the resolution
+ */
+void resolver_stale_dequeue(resolver_task_t *task) {
+    if (!task->stale_queued) {
+        return;
+    }
+    task->stale_queued = false;
+    if (task->stale_prev != NULL) {
+        task->stale_prev->stale_next = task->stale_next;
+    }
+    else {
+        resolver->stale_first = task->stale_next;
+    }
+    if (task->stale_next != NULL) {
+        task->stale_next->stale_prev = task->stale_prev;
+    }
+    else {
+        resolver->stale_last = task->stale_prev;
+    }
+}
+
+/**
+ * Copy the records to the responses of the waiting requests and detach the requests from the resolution,
+ * the requests with all their resolutions finished are answered
+ * @param rcode The rcode of the resolution
+ * @param stale Whether the requests are answered with the stale records instead of the records resolved
+ */
+void resolver_task_answer(resolver_task_t *task, int rcode, bool stale) {
+    // The waiters are detached first, since answering a request may handle more requests of the client
+    resolver_waiter_t *waiter = task->waiters;
+    task->waiters = NULL;
+    while (waiter != NULL) {
+        resolver_waiter_t *next = waiter->next;   // The waiter is released with its request
+        dns_resolver_request_t *request = waiter->request;
+
+        DNS_arena_set_current(request->arena);
+        if (stale) {
+            for (dns_rr_t *t = task->stale; t != NULL; t = t->next) {
+                DNS_packet_append_answer(&request->response, DNS_RR_copy(t), true);
+            }
+        }
+        else {
+            for (dns_rr_t *t = task->answers; t != NULL; t = t->next) {
+                DNS_packet_append_answer(&request->response, DNS_RR_copy(t), true);
+            }
+            for (dns_rr_t *t = task->additionals; t != NULL; t = t->next) {
+                DNS_packet_append_additional(&request->response, DNS_RR_copy(t), true);
+            }
+            for (dns_rr_t *t = task->authorities; t != NULL; t = t->next) {
+                DNS_packet_append_authority(&request->response, DNS_RR_copy(t), true);
+            }
+        }
+        if (rcode == R_SERVER_FAILURE) {
+            request->failed = true;
+        }
+        else if (rcode == R_NOT_EXIST) {
+            request->not_exist = true;
+        }
+        if (--request->pending == 0) {
+            resolver_request_complete(request);
+        }
+        waiter = next;
+    }
+    DNS_arena_set_current(NULL);
+}
+
+/**
+ * Finish the resolution, the records are copied to the responses of the waiting requests,
+ * and the requests with all their resolutions finished are answered
+ */
+void resolver_task_finish(resolver_task_t *task, int rcode) {
+    resolver_untrack_query(task);
+    resolver_remove_task(task);
+    resolver_stale_dequeue(task);
+    if (rcode == R_SERVER_FAILURE && task->stale != NULL) {
+        DNS_log_warning("[dns_resolver] Failed to resolve %s %s, answering with the stale records",
+                        DNS_type_to_str(task->type), task->name);
+        resolver_task_answer(task, R_NO_ERROR, true);
+    }
+    else {
+        if (rcode == R_SERVER_FAILURE) {
+            DNS_log_warning("[dns_resolver] Failed to resolve %s %s", DNS_type_to_str(task->type), task->name);
+        }
+        resolver_task_answer(task, rcode, false);
+    }
+
+    DNS_arena_free(task->arena);
+    free(task);
+    DNS_metrics_add_resolutions(-1);
+}
+
+/**
+ * Send the query of the task to the fastest server of the zone not tried in the current round, the
+ * query times out after the RTO of the server. If the query cannot be sent, it times out at once
+ * so another server is tried
+ * @return False if all the servers are tried in all the rounds
+ */
+bool resolver_task_send(resolver_task_t *task) {
+    int index = DNS_upstream_select(task->servers, task->server_count, task->tried);
+    if (index < 0) {
+        if (++task->attempts >= ZONE_ATTEMPTS) {
+            return false;
+        }
+        task->tried = 0;
+        index = DNS_upstream_select(task->servers, task->server_count, task->tried);
+    }
+    task->tried |= 1u << index;
+    task->server = task->servers[index];
+    task->sock = resolver->socks[resolver_random() % UPSTREAM_SOCKETS];
+    do {
+        task->id = (uint16) resolver_random();
+    } while (resolver_find_query(task->server, task->id) != NULL);
+
+    DNS_arena_set_current(task->arena);
+    dns_packet_t packet = DNS_query_create_request(task->key, task->type);
+    packet.header.id = task->id;
+    packet.queries->class = task->class;
+    char buf[BUFFER_SIZE];
+    struct dns_buffer buffer;
+    DNS_buffer_init(&buffer, buf, BUFFER_SIZE);
+    bool encoded = DNS_buffer_write_packet(&buffer, packet);
+    DNS_arena_set_current(NULL);
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(DNS_PORT);
+    addr.sin_addr.s_addr = htonl(task->server);
+
+    DNS_log_trace("[dns_resolver] Sending query for %s %s to %s", DNS_type_to_str(task->type), task->name,
+                  resolver_address_to_str(task->server));
+    task->sent = resolver_now();
+    task->timed = DNS_latency_start();
+    task->deadline = task->sent + DNS_upstream_query(task->server) * 1000L;
+    if (!encoded || sendto(task->sock, buffer.ptr, buffer.pos, 0, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        DNS_log_error("[dns_resolver] Failed to send query to %s: %s", resolver_address_to_str(task->server),
+                      encoded ? strerror(errno) : "the query is too long");
+        task->deadline = task->sent;
+    }
+    resolver_track_query(task);
+    return true;
+}
+
+/**
+ * Add a server to the list of the servers of the task, the duplicated servers are ignored
+ * @param count The number of the servers in the list, increased if the server is added
+ */
+void resolver_task_add_server(resolver_task_t *task, int *count, uint32 address) {
+    for (int i = 0; i < *count; i++) {
+        if (task->servers[i] == address) {
+            return;
+        }
+    }
+    if (*count < MAX_SERVERS) {
+        task->servers[(*count)++] = address;
+    }
+}
+
+/**
+ * Start the resolution at the root zone
+ */
+void resolver_task_start_at_root(resolver_task_t *task) {
+    task->zone[0] = '\0';
+    task->servers[0] = ntohl(inet_addr(ROOT_DNS_IP));
+    task->server_count = 1;
+    task->tried = 0;
+    task->attempts = 0;
+    task->cached_zone = false;
+}
+
+/**
+ * Start the resolution at the deepest zone containing the name whose NS records and glue
+ * records are both cached, or at the root zone if there is no such zone
+ */
+void resolver_task_start_at_closest_zone(resolver_task_t *task) {
+    resolver_task_start_at_root(task);
+
+    DNS_arena_set_current(task->arena);
+    for (const char *zone = task->key; *zone != '\0';) {
+        int count = 0;
+        for (dns_rr_t *ns = DNS_cache_get((char *) zone, TYPE_NS, task->class); ns != NULL; ns = ns->next) {
+            if (ns->type != TYPE_NS) {
+                continue;   // The CNAME records of the name
+            }
+            for (dns_rr_t *glue = DNS_cache_get(ns->rdata.name, TYPE_A, task->class); glue != NULL; glue = glue->next) {
+                if (glue->type == TYPE_A) {
+                    resolver_task_add_server(task, &count, glue->rdata.a);
+                }
+            }
+        }
+        if (count > 0) {
+            DNS_log_trace("[dns_resolver] Start resolving %s at the cached zone %s", task->name, zone);
+            strcpy(task->zone, zone);
+            task->server_count = count;
+            task->cached_zone = true;
+            break;
+        }
+
+        const char *dot = strchr(zone, '.');
+        zone = dot != NULL ? dot + 1 : "";
+    }
+    DNS_arena_set_current(NULL);
+}
+
+/**
+ * Query another server of the zone after the current one failed. If all the servers of a cached zone
+ * failed, the cached delegation may be stale, so the resolution starts over at the root zone
+ */
+void resolver_task_retry(resolver_task_t *task) {
+    resolver_untrack_query(task);
+    if (resolver_task_send(task)) {
+        return;
+    }
+    if (task->cached_zone) {
+        DNS_log_warning("[dns_resolver] All the servers of the cached zone %s failed, start over at the root",
+                        task->zone);
+        resolver_task_start_at_root(task);
+        resolver_task_send(task);
+    }
+    else {
+        resolver_task_finish(task, R_SERVER_FAILURE);
+    }
+}
+
+/**
+ * Follow the referral in the response, the servers of the deepest zone containing the name
+ * and deeper than the current zone are used. The NS records and the glue records of the zone
+ * are added to the cache, so the following resolutions in the zone can start there
+ * @return True if the referral is followed
+ */
+bool resolver_task_follow_referral(resolver_task_t *task, const dns_packet_t *response) {
+    char zone[RR_STRING_LEN], owner[RR_STRING_LEN];
+    zone[0] = '\0';
+    for (dns_rr_t *t = response->authorities; t != NULL; t = t->next) {
+        DNS_name_to_lower(owner, t->name, RR_STRING_LEN);
+        if (t->type == TYPE_NS && strlen(owner) > strlen(zone) && strlen(owner) > strlen(task->zone) &&
+            resolver_in_zone(task->key, owner) && resolver_in_zone(owner, task->zone)) {
+            strcpy(zone, owner);
+        }
+    }
+    if (zone[0] == '\0') {
+        return false;
+    }
+
+    int count = 0;
+    for (dns_rr_t *t = response->authorities; t != NULL; t = t->next) {
+        DNS_name_to_lower(owner, t->name, RR_STRING_LEN);
+        if (t->type != TYPE_NS || strcmp(owner, zone) != 0) {
+            continue;
+        }
+
+        bool found = false;
+        for (dns_rr_t *t2 = response->additionals; t2 != NULL; t2 = t2->next) {
+            if (t2->type == TYPE_A && strcasecmp(t->rdata.name, t2->name) == 0) {
+                found = true;
+                resolver_task_add_server(task, &count, t2->rdata.a);
+                DNS_cache_put(*t2);
+            }
+        }
+        if (found) {
+            DNS_cache_put(*t);
+        }
+        else {
+            DNS_log_warning("[dns_resolver] In the response of server %s, the address of %s is not given",
+                            resolver_address_to_str(task->server), t->rdata.name);
+        }
+    }
+    if (count == 0) {
+        return false;
+    }
+
+    strcpy(task->zone, zone);
+    task->server_count = count;
+    task->tried = 0;
+    task->attempts = 0;
+    task->cached_zone = false;
+    return true;
+}
+
+/**
+ * Cache the negative answer of the resolution if the SOA record of the zone is in the authority
+ * section of the response, the SOA record is also added to the responses of the requests
+ * @param rcode {@code R_NOT_EXIST} if the name does not exist, {@code R_NO_ERROR} if it has no records of the type
+ */
+void resolver_task_cache_negative(resolver_task_t *task, const dns_packet_t *response, int rcode) {
+    char owner[RR_STRING_LEN];
+    for (dns_rr_t *t = response->authorities; t != NULL; t = t->next) {
+        DNS_name_to_lower(owner, t->name, RR_STRING_LEN);
+        if (t->type == TYPE_SOA && resolver_in_zone(task->key, owner) && resolver_in_zone(owner, task->zone)) {
+            DNS_arena_set_current(task->arena);
+            resolver_append_copy(&task->authorities, t);
+            DNS_cache_put_negative(task->key, task->type, task->class, rcode, t);
+            return;
+        }
+    }
+}
+
+/**
+ * Check whether the RR is the first one of its RRset in the list
+ */
+bool resolver_first_of_rrset(const dns_rr_t *list, const dns_rr_t *rr) {
+    for (const dns_rr_t *t = list; t != rr; t = t->next) {
+        if (t->type == rr->type && t->class == rr->class && strcasecmp(t->name, rr->name) == 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Continue the resolution with the response of its outstanding query
+ */
+void resolver_task_process(resolver_task_t *task, const dns_packet_t *response) {
+    resolver_untrack_query(task);
+
+    switch (response->header.rcode) {
+        case R_NO_ERROR:
+            if (response->answers != NULL) {
+                DNS_arena_set_current(task->arena);
+                for (dns_rr_t *t = response->answers; t != NULL; t = t->next) {
+                    resolver_append_copy(&task->answers, t);
+                    if (resolver_first_of_rrset(response->answers, t)) {
+                        // The RRset answered replaces the cached one with all its RRs at once
+                        DNS_cache_replace(t);
+                    }
+
+                    if (t->type == TYPE_MX) {
+                        bool found = false;
+                        for (dns_rr_t *t2 = response->additionals; t2 != NULL; t2 = t2->next) {
+                            if (!strcmp(t2->name, t->rdata.mx.exchange)) {
+                                resolver_append_copy(&task->additionals, t2);
+                                DNS_cache_put(*t2);
+                                found = true;
+                            }
+                        }
+                        if (!found) {
+                            DNS_log_warning("[dns_resolver] The IP address of the MX record %s cannot be found.",
+                                            t->rdata.mx.exchange);
+                        }
+                    }
+                }
+                resolver_task_finish(task, R_NO_ERROR);
+            }
+            else if (resolver_task_follow_referral(task, response)) {
+                if (++task->referrals > MAX_REFERRALS) {
+                    resolver_task_finish(task, R_SERVER_FAILURE);
+                }
+                else {
+                    resolver_task_send(task);
+                }
+            }
+            else {
+                resolver_task_cache_negative(task, response, R_NO_ERROR);
+                resolver_task_finish(task, R_NO_ERROR);
+            }
+            break;
+        case R_NOT_EXIST:
+            resolver_task_cache_negative(task, response, R_NOT_EXIST);
+            resolver_task_finish(task, R_NOT_EXIST);
+            break;
+        default:
+            DNS_log_warning("[dns_resolver] Server %s responds with \"%s\"", resolver_address_to_str(task->server),
+                            DNS_rcode_to_str(response->header.rcode));
+            resolver_task_retry(task);
+            break;
+    }
+}
+
+/**
+ * Handle a datagram received on a socket of the resolver. The datagram is dropped unless it is the
+ * response of an outstanding query, received on the same socket with the same server, ID and question
+ */
+void resolver_handle_response(int sock, ptr_t datagram, int length, const struct sockaddr_in *from) {
+    dns_packet_view_t view;
+    if (from->sin_port != htons(DNS_PORT) || !DNS_view_parse(&view, datagram, length) || !view.header.qr) {
+        return;
+    }
+    uint32 server = ntohl(from->sin_addr.s_addr);
+    resolver_task_t *task = resolver_find_query(server, view.header.id);
+    if (task == NULL || task->sock != sock) {
+        DNS_log_trace("[dns_resolver] Dropped unexpected response from %s", resolver_address_to_str(server));
+        return;
+    }
+
+    dns_question_view_t question;
+    char name[RR_STRING_LEN], key[RR_STRING_LEN];
+    if (view.header.question_count != 1) {
+        return;
+    }
+    DNS_view_read_question(&view, view.questions, &question);
+    if (!DNS_view_name(&view, question.name, name)) {
+        return;
+    }
+    DNS_name_to_lower(key, name, RR_STRING_LEN);
+    if (question.type != task->type || question.class != task->class || strcmp(key, task->key) != 0) {
+        DNS_log_trace("[dns_resolver] Dropped response from %s with mismatched question",
+                      resolver_address_to_str(server));
+        return;
+    }
+    double rtt = (double) (resolver_now() - task->sent) / 1000;
+    DNS_upstream_response(server, rtt);
+    DNS_latency_end(LATENCY_UPSTREAM, task->timed);
+
+    // The response is decoded into the arena of the task, it is released with the task
+    DNS_arena_set_current(task->arena);
+    dns_packet_t response;
+    struct dns_buffer buffer;
+    DNS_buffer_init(&buffer, datagram, length);
+    response.queries = NULL;
+    response.answers = NULL;
+    response.authorities = NULL;
+    response.additionals = NULL;
+    bool decoded = DNS_buffer_read_packet(&buffer, &response);
+    DNS_arena_set_current(NULL);
+    if (!decoded) {
+        DNS_log_error("[dns_resolver] Failed to decode the response from %s", resolver_address_to_str(server));
+        resolver_task_retry(task);
+        return;
+    }
+
+    DNS_log_trace("[dns_resolver] Received response for %s %s from %s in %.3f ms", DNS_type_to_str(task->type),
+                  task->name, resolver_address_to_str(server), rtt);
+    resolver_task_process(task, &response);
+}
+
+/**
+ * Create a socket to the upstream servers. The socket is bound to a random source port, so the responses
+ * cannot be forged by guessing the port, then falls back to the port chosen by the kernel
+ * @return The socket, -1 if failed
+ */
+int resolver_create_socket() {
+    int sock = socket(PF_INET, SOCK_DGRAM, 0);
+    if (sock < 0 || fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK) < 0) {
+        if (sock >= 0) {
+            close(sock);
+        }
+        return -1;
+    }
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    for (int i = 0; i <= BIND_ATTEMPTS; i++) {
+        addr.sin_port = i < BIND_ATTEMPTS ? htons((uint16) (1024 + resolver_random() % (65536 - 1024))) : 0;
+        if (bind(sock, (struct sockaddr *) &addr, sizeof(addr)) == 0) {
+            return sock;
+        }
+    }
+    close(sock);
+    return -1;
+}
+
+bool DNS_resolver_start() {
+    resolver = calloc(1, sizeof(resolver_t));
+    if (resolver == NULL) {
+        return false;
+    }
+    resolver->timer_capacity = 64;
+    resolver->timers = malloc(sizeof(resolver_task_t *) * resolver->timer_capacity);
+    if (resolver->timers == NULL) {
+        return false;
+    }
+
+    if (!resolver_fill_random()) {
+        return false;
+    }
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = resolver_handle_sigusr1;
+    action.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &action, NULL);
+
+    for (int i = 0; i < UPSTREAM_SOCKETS; i++) {
+        resolver->socks[i] = resolver_create_socket();
+        if (resolver->socks[i] < 0 || !DNS_network_watch(resolver->socks[i])) {
+            DNS_log_error("[dns_resolver] Failed to create the sockets to the upstream servers: %s", strerror(errno));
+            return false;
+        }
+    }
+    return true;
+}
+
+int DNS_resolver_timeout() {
+    if (resolver->ready != NULL) {
+        return 0;
+    }
+    if (resolver->timer_count == 0 && resolver->stale_first == NULL) {
+        return -1;
+    }
+    long deadline = resolver->timer_count > 0 ? resolver->timers[0]->deadline : resolver->stale_first->stale_deadline;
+    if (resolver->stale_first != NULL && resolver->stale_first->stale_deadline < deadline) {
+        deadline = resolver->stale_first->stale_deadline;
+    }
+    long timeout = deadline - resolver_now();
+    return timeout > 0 ? (int) ((timeout + 999) / 1000) : 0;
+}
+
+void DNS_resolver_expire() {
+    if (resolver_print_requested) {
+        resolver_print_requested = 0;
+        DNS_upstream_print();
+        if (latency_enabled) {
+            DNS_latency_print();
+        }
+    }
+
+    long now = resolver_now();
+    while (resolver->timer_count > 0 && resolver->timers[0]->deadline <= now) {
+        resolver_task_t *task = resolver->timers[0];
+        DNS_log_warning("[dns_resolver] Server %s does not respond for %s %s", resolver_address_to_str(task->server),
+                        DNS_type_to_str(task->type), task->name);
+        DNS_upstream_timeout(task->server);
+        resolver_task_retry(task);
+    }
+
+    // The clients waiting too long are answered with the stale records, and the resolutions go on
+    // to refresh the cache
+    while (resolver->stale_first != NULL && resolver->stale_first->stale_deadline <= now) {
+        resolver_task_t *task = resolver->stale_first;
+        resolver_stale_dequeue(task);
+        DNS_log_warning("[dns_resolver] %s %s is not resolved in time, answering with the stale records",
+                        DNS_type_to_str(task->type), task->name);
+        resolver_task_answer(task, R_NO_ERROR, true);
+    }
+
+    while (resolver->ready != NULL) {
+        dns_resolver_request_t *request = resolver->ready;
+        resolver->ready = request->next_ready;
+        resolver_request_complete(request);
+    }
+}
+
+void DNS_resolver_readable(int fd) {
+    uint8 datagram[BUFFER_SIZE];
+    struct sockaddr_in from;
+    for (int i = 0; i < RECV_BATCH_SIZE; i++) {
+        socklen_t from_len = sizeof(from);
+        int length = recvfrom(fd, datagram, BUFFER_SIZE, 0, (struct sockaddr *) &from, &from_len);
+        if (length < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                DNS_log_error("[dns_resolver] Failed to receive the response: %s", strerror(errno));
+            }
+            return;
+        }
+        resolver_handle_response(fd, datagram, length, &from);
+    }
+}
+
+dns_resolver_request_t *DNS_resolver_request_create() {
+    dns_arena_t *arena = DNS_arena_create(REQUEST_ARENA_CHUNK_SIZE);
+    if (arena == NULL) {
+        return NULL;
+    }
+    dns_resolver_request_t *request = DNS_arena_alloc(arena, sizeof(dns_resolver_request_t));
+    if (request == NULL) {
+        DNS_arena_free(arena);
+        return NULL;
+    }
+    memset(request, 0, sizeof(dns_resolver_request_t));
+    request->arena = arena;
+    request->previous = DNS_arena_current();
+    DNS_arena_set_current(arena);
+    return request;
+}
+
+void DNS_resolver_request_free(dns_resolver_request_t *request) {
+    if (request == NULL) {
+        return;
+    }
+    DNS_arena_set_current(request->previous);
+    DNS_arena_free(request->arena);
+}
+
+/**
+ * Start a resolution and add it to the resolutions in flight, the current arena is kept
+ * @param key The lowercased name
+ * @param hash The hash of the lowercased name, the type and the class
+ * @return The resolution, NULL if out of memory
+ */
+resolver_task_t *resolver_task_start(const char *name, const char *key, uint16 type, uint16 class, uint32 hash) {
+    resolver_task_t *task = malloc(sizeof(resolver_task_t));
+    dns_arena_t *arena = DNS_arena_create(TASK_ARENA_CHUNK_SIZE);
+    if (task == NULL || arena == NULL || !resolver_reserve_timer()) {
+        DNS_log_error("[dns_resolver] Failed to start resolving %s: out of memory", name);
+        free(task);
+        if (arena != NULL) {
+            DNS_arena_free(arena);
+        }
+        return NULL;
+    }
+
+    memset(task, 0, sizeof(resolver_task_t));
+    strncpy(task->name, name, RR_STRING_LEN - 1);
+    strcpy(task->key, key);
+    task->type = type;
+    task->class = class;
+    task->hash = hash;
+    task->arena = arena;
+    task->task_next = resolver->tasks[hash & (TASK_BUCKETS - 1)];
+    resolver->tasks[hash & (TASK_BUCKETS - 1)] = task;
+    DNS_metrics_add_resolutions(1);
+
+    dns_arena_t *current = DNS_arena_current();
+    DNS_log_trace("[dns_resolver] Start resolving %s %s", DNS_type_to_str(type), name);
+    resolver_task_start_at_closest_zone(task);
+    resolver_task_send(task);
+    DNS_arena_set_current(current);
+    return task;
+}
+
+void DNS_resolver_resolve(dns_resolver_request_t *request, const char *name, uint16 type, uint16 class) {
+    resolver_waiter_t *waiter = DNS_arena_alloc(request->arena, sizeof(resolver_waiter_t));
+    if (waiter == NULL) {
+        DNS_log_error("[dns_resolver] Failed to start resolving %s: out of memory", name);
+        request->failed = true;
+        return;
+    }
+
+    // Wait for the resolution in flight of the same records, or start a new one
+    char key[RR_STRING_LEN];
+    DNS_name_to_lower(key, name, RR_STRING_LEN);
+    uint32 hash = DNS_name_hash(key, type, class);
+    resolver_task_t *task = resolver_find_task(key, type, class, hash);
+    if (task != NULL) {
+        DNS_log_trace("[dns_resolver] Waiting for the resolution of %s %s in flight", DNS_type_to_str(type), name);
+    }
+    else if ((task = resolver_task_start(name, key, type, class, hash)) == NULL) {
+        request->failed = true;
+        return;
+    }
+
+    waiter->request = request;
+    waiter->next = task->waiters;
+    task->waiters = waiter;
+    request->pending++;
+
+    // The records expired within the serve-stale window are only used if they cannot be resolved in time
+    if (!task->stale_queued) {
+        if (task->stale == NULL) {
+            dns_arena_t *current = DNS_arena_current();
+            DNS_arena_set_current(task->arena);
+            task->stale = DNS_cache_get_stale((char *) name, type, class);
+            DNS_arena_set_current(current);
+        }
+        if (task->stale != NULL) {
+            resolver_stale_enqueue(task);
+        }
+    }
+}
+
+void DNS_resolver_prefetch(const char *name, uint16 type, uint16 class) {
+    if (resolver == NULL) {
+        return;   // Not in an event loop with the resolver, like the benchmarks
+    }
+
+    char key[RR_STRING_LEN];
+    DNS_name_to_lower(key, name, RR_STRING_LEN);
+    uint32 hash = DNS_name_hash(key, type, class);
+    if (resolver_find_task(key, type, class, hash) == NULL) {
+        DNS_log_trace("[dns_resolver] Refreshing %s %s in the background", DNS_type_to_str(type), name);
+        resolver_task_start(name, key, type, class, hash);
+    }
+}
+
+void DNS_resolver_request_submit(dns_resolver_request_t *request) {
+    DNS_arena_set_current(request->previous);
+
+    // The response is never sent before the handler returns, since the client may still be in use
+    if (request->pending == 0) {
+        request->next_ready = resolver->ready;
+        resolver->ready = request;
+    }
+}
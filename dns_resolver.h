@@ -0,0 +1,98 @@
+//
+// dns_resolver.h -- Non-blocking iterative resolver of the local server. Each resolution is a state
+//                   machine driven by the event loop of the worker thread: the queries to the upstream
+//                   servers are sent without waiting, and the resolution continues when the response
+//                   arrives or the query times out, so many resolutions are in flight at once. The queries
+//                   share a few long-lived sockets, and the responses are matched by the socket, the
+//                   server, the query ID and the question. The delegations learned from the referrals are
+//                   cached, so each resolution starts at the deepest known zone instead of the root, and the
+//                   requests for the records already being resolved wait for the same resolution. The negative
+//                   answers are cached for the minimum TTL in the SOA record of their zone
+// Created on 10/15/26.
+//
+
+#ifndef PROJECT_DNS_DNS_RESOLVER_H
+#define PROJECT_DNS_DNS_RESOLVER_H
+
+#include "dns_io.h"
+#include "dns_arena.h"
+#include "dns_network.h"
+
+/**
+ * A request of a client waiting for resolutions. The response is built in the arena of the request,
+ * the records are appended when the resolutions finish, and the response is sent after the last one
+ */
+typedef struct dns_resolver_request {
+    dns_reply_t *reply;
+    dns_arena_t *arena;                       // Owns the request and its response
+    dns_arena_t *previous;                    // The arena that was current when the request was created
+    dns_packet_t response;
+    int pending;                              // The number of unfinished resolutions
+    bool failed;                              // Whether one of the resolutions failed
+    bool not_exist;                           // Whether one of the names does not exist
+    struct dns_resolver_request *next_ready;  // Links the requests finished without resolutions
+} dns_resolver_request_t;
+
+/**
+ * Set up the resolver of current thread, used as the {@code start} hook of the event loop
+ * @return True if success
+ */
+bool DNS_resolver_start();
+
+/**
+ * Get the time before the next upstream query of current thread times out, used as the {@code timeout} hook
+ * @return The milliseconds, -1 if there are no upstream queries
+ */
+int DNS_resolver_timeout();
+
+/**
+ * Handle the upstream queries timed out, used as the {@code expire} hook of the event loop
+ */
+void DNS_resolver_expire();
+
+/**
+ * Handle the responses from the upstream servers, used as the {@code readable} hook of the event loop
+ * @param fd The readable socket
+ */
+void DNS_resolver_readable(int fd);
+
+/**
+ * Create a request waiting for resolutions. The arena of the request becomes the current arena until
+ * the request is submitted, so the response can be built with the usual functions
+ * @return The request, NULL if out of memory
+ */
+dns_resolver_request_t *DNS_resolver_request_create();
+
+/**
+ * Release a request that is not submitted, and restore the current arena
+ * @param request The request, can be NULL
+ */
+void DNS_resolver_request_free(dns_resolver_request_t *request);
+
+/**
+ * Start resolving the records of the name for the request, the records are appended to the
+ * answer and additional sections of the response when the resolution finishes
+ * @param request The request
+ * @param name The name
+ * @param type The type of the records
+ * @param class The class of the records
+ */
+void DNS_resolver_resolve(dns_resolver_request_t *request, const char *name, uint16 type, uint16 class);
+
+/**
+ * Resolve the records of the name in the background without a client waiting for them, the records
+ * are only added to the cache. Nothing is done if the records are already being resolved
+ * @param name The name
+ * @param type The type of the records
+ * @param class The class of the records
+ */
+void DNS_resolver_prefetch(const char *name, uint16 type, uint16 class);
+
+/**
+ * Finish creating the request and restore the current arena. The response is sent to the client with
+ * {@code DNS_network_reply} from the event loop when all the resolutions of the request finish
+ * @param request The request, its reply should be set
+ */
+void DNS_resolver_request_submit(dns_resolver_request_t *request);
+
+#endif //PROJECT_DNS_DNS_RESOLVER_H
@@ -5,70 +5,178 @@
 //
 
 #include <string.h>
+#include <stdlib.h>
 #include "dns_common.h"
 #include "dns_network.h"
 #include "dns_query.h"
+#include "dns_zone.h"
+#include "dns_cache.h"
+#include "dns_resolver.h"
+#include "dns_latency.h"
+#include "dns_metrics.h"
+#include "dns_log.h"
+
+// Whether the authoritative servers should load their records into memory at startup
+bool memory_zone = false;
+
+// The memory limit of the cache of the local server, in megabytes
+unsigned long cache_size_mb = 64;
+
+// Whether the cache of the local server should also be written to the database
+bool persist_cache = false;
+
+// The number of worker threads serving the requests
+int worker_count = 1;
+
+// The TCP port or the unix socket serving the metrics, NULL if the metrics are not served
+const char *metrics_listen = NULL;
+
+// The file the log level is read from on SIGHUP, NULL if SIGHUP turns the trace messages on and off
+const char *log_level_path = NULL;
 
 /**
- * Start the local DNS server (using the TCP protocol)
+ * Start the local DNS server (using both UDP and TCP protocols)
  */
 void DNS_server_start_local() {
-    int sock = DNS_network_init_server_socket_tcp(LOCAL_DNS_IP);
-    if (sock > 0) {
-        while (true) {
-            DNS_network_handle_query_tcp(sock);
-        }
+    if (!DNS_cache_init(cache_size_mb * 1024 * 1024, persist_cache)) {
+        return;
     }
+    if (metrics_listen != NULL && !DNS_metrics_start(LOCAL_DNS_IP, metrics_listen)) {
+        return;
+    }
+
+    // The queries to the upstream servers are sent and waited for by the event loop of each worker
+    dns_loop_hooks_t hooks = {DNS_resolver_start, DNS_resolver_timeout, DNS_resolver_expire, DNS_resolver_readable};
+    DNS_network_set_loop_hooks(&hooks);
+    DNS_network_serve(LOCAL_DNS_IP, DNS_query_create_response_local, worker_count);
 }
 
 /**
- * Start UDP DNS server on the specified IP
+ * Start DNS server on the specified IP (using both UDP and TCP protocols)
+ * @param table The database table containing the records of this server
  * @param ip The IP address to start the server on
  */
-void DNS_server_start(const char* ip) {
-    int sock = DNS_network_init_server_socket_udp(ip);
-    if (sock > 0) {
-        while (true) {
-            DNS_network_handle_query_udp(sock);
-        }
+void DNS_server_start(const char* table, const char* ip) {
+    DNS_query_set_table_name(table);
+    if (memory_zone && !DNS_zone_load(table)) {
+        DNS_log_error("[ dns_server ] Failed to load the records of %s into memory", table);
+        return;
+    }
+    if (metrics_listen != NULL && !DNS_metrics_start(ip, metrics_listen)) {
+        return;
     }
+
+    DNS_network_serve(ip, DNS_query_create_response, worker_count);
 }
 
 /**
  * Main entry of the DNS server application
  * @param argc Argument count, in this application one argument is used
- * @param argv Argument values as a string array. We only use argv[1] indicating the server mode
+ * @param argv Argument values as a string array. argv[1] indicates the server mode and the
+ *             following arguments are options
  * @return return value of the application
  */
 int main(int argc, char **argv) {
     if (argc < 2) {
-        DNS_log_error("[ dns_server ] Missing server mode argument! Usage: dns_server <mode>\n");
+        DNS_log_error("[ dns_server ] Missing server mode argument! Usage: dns_server <mode> [options]\n");
         return -1;
     }
 
+    for (int i = 2; i < argc; i++) {
+        if (!strcmp(argv[i], "--memory-zone")) {
+            memory_zone = true;
+        }
+        else if (!strcmp(argv[i], "--cache-size") && i + 1 < argc) {
+            cache_size_mb = strtoul(argv[++i], NULL, 10);
+            if (cache_size_mb == 0) {
+                DNS_log_error("[ dns_server ] Invalid cache size '%s', should be a positive number of megabytes.\n",
+                              argv[i]);
+                return -1;
+            }
+        }
+        else if (!strcmp(argv[i], "--cache-persist")) {
+            persist_cache = true;
+        }
+        else if (!strcmp(argv[i], "--prefetch") && i + 1 < argc) {
+            int percent = atoi(argv[++i]);
+            if (percent <= 0 || percent >= 100) {
+                DNS_log_error("[ dns_server ] Invalid prefetch window '%s', should be a percentage of the TTL "
+                              "between 1 and 99.\n", argv[i]);
+                return -1;
+            }
+            DNS_cache_set_prefetch(percent);
+        }
+        else if (!strcmp(argv[i], "--serve-stale") && i + 1 < argc) {
+            int seconds = atoi(argv[++i]);
+            if (seconds <= 0) {
+                DNS_log_error("[ dns_server ] Invalid serve-stale window '%s', should be a positive number of "
+                              "seconds.\n", argv[i]);
+                return -1;
+            }
+            DNS_cache_set_serve_stale(seconds);
+        }
+        else if (!strcmp(argv[i], "--metrics") && i + 1 < argc) {
+            metrics_listen = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--log-level") && i + 1 < argc) {
+            int level = DNS_log_level_from_str(argv[++i]);
+            if (level < 0) {
+                DNS_log_error("[ dns_server ] Invalid log level '%s', should be trace, info, warning or error.\n",
+                              argv[i]);
+                return -1;
+            }
+            log_level = level;
+        }
+        else if (!strcmp(argv[i], "--log-level-file") && i + 1 < argc) {
+            log_level_path = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--latency")) {
+            DNS_latency_set_enabled(true);
+        }
+        else if (!strcmp(argv[i], "--io-uring")) {
+            DNS_network_set_io_uring(true);
+        }
+        else if (!strcmp(argv[i], "--workers") && i + 1 < argc) {
+            worker_count = atoi(argv[++i]);
+            if (worker_count <= 0) {
+                DNS_log_error("[ dns_server ] Invalid worker count '%s', should be a positive number.\n", argv[i]);
+                return -1;
+            }
+        }
+        else {
+            DNS_log_error("[ dns_server ] Unknown option '%s', supported options: --memory-zone, "
+                          "--cache-size <MB>, --cache-persist, --prefetch <percent>, --serve-stale <seconds>, "
+                          "--workers <N>, --io-uring, --latency, --metrics <port|path>, --log-level <level>, "
+                          "--log-level-file <path>.\n", argv[i]);
+            return -1;
+        }
+    }
+
+    // The latency of the stages and the trace messages can be turned on without restarting the server
+    DNS_latency_watch_signal();
+    DNS_log_watch_signal(log_level_path);
+
+    // The messages are printed by another thread from now on
+    DNS_log_start_async();
+
     // Check server mode argument, and start the server with different configuration
     if (!strcmp(argv[1], "local")) {
         DNS_server_start_local();
     }
     else if (!strcmp(argv[1], "root")) {
-        DNS_query_set_table_name("root");
-        DNS_server_start(ROOT_DNS_IP);
+        DNS_server_start("root", ROOT_DNS_IP);
     }
     else if (!strcmp(argv[1], "s1")) {
-        DNS_query_set_table_name("s1");
-        DNS_server_start(DNS_1_IP);
+        DNS_server_start("s1", DNS_1_IP);
     }
     else if (!strcmp(argv[1], "s2")) {
-        DNS_query_set_table_name("s2");
-        DNS_server_start(DNS_2_IP);
+        DNS_server_start("s2", DNS_2_IP);
     }
     else if (!strcmp(argv[1], "s3")) {
-        DNS_query_set_table_name("s3");
-        DNS_server_start(DNS_3_IP);
+        DNS_server_start("s3", DNS_3_IP);
     }
     else if (!strcmp(argv[1], "s4")) {
-        DNS_query_set_table_name("s4");
-        DNS_server_start(DNS_4_IP);
+        DNS_server_start("s4", DNS_4_IP);
     }
     else {
         DNS_log_error("[ dns_server ] Invalid server mode '%s', supported mode: root, local, s1, s2, s3, s4.\n", argv[1]);
@@ -0,0 +1,191 @@
+//
+// dns_udp_bench.c -- Benchmark of the UDP receive and send path of the authoritative servers. The client
+//                    queues a burst of requests on the server socket over the loopback interface, and
+//                    the server handles them either one by one (one recvfrom and one sendto for each
+//                    request) or in batches of different sizes (one recvmmsg and one sendmmsg for each
+//                    batch). Only the time spent by the server is measured
+// Created on 10/15/26.
+//
+
+#define _GNU_SOURCE   // For recvmmsg/sendmmsg
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "dns_common.h"
+#include "dns_network.h"
+#include "dns_query.h"
+#include "dns_zone.h"
+
+#define BUFFER_SIZE 1024
+#define BURST_SIZE 64               // The number of requests queued on the server socket at once
+#define DEFAULT_QUERIES 1000000
+#define SOCKET_BUFFER_SIZE (1024 * 1024)
+
+/**
+ * Get the current time of the monotonic clock
+ * @return The time in nanoseconds
+ */
+double bench_now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double) now.tv_sec * 1e9 + (double) now.tv_nsec;
+}
+
+/**
+ * Create a socket on a random port of the loopback interface
+ * @param addr Returns the address of the socket
+ * @return The socket, -1 if failed
+ */
+int bench_create_socket(struct sockaddr_in *addr) {
+    int sock = socket(PF_INET, SOCK_DGRAM, 0);
+    if (sock < 0) {
+        return -1;
+    }
+
+    // The whole burst of requests or responses should fit in the socket buffer
+    int size = SOCKET_BUFFER_SIZE;
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_port = 0;
+    addr->sin_addr.s_addr = inet_addr("127.0.0.1");
+    socklen_t len = sizeof(*addr);
+    if (bind(sock, (struct sockaddr *) addr, sizeof(*addr)) < 0 ||
+        getsockname(sock, (struct sockaddr *) addr, &len) < 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+/**
+ * Run the benchmark with one mode
+ * @param server_sock The socket of the server
+ * @param client_sock The socket of the client, connected to the server socket
+ * @param request The request sent by the client
+ * @param request_len The length of the request
+ * @param queries The number of the requests
+ * @param batch_size The batch size of the server, 0 to handle the requests one by one
+ * @return The nanoseconds spent by the server on each request, negative if failed
+ */
+double bench_run(int server_sock, int client_sock, ptr_t request, int request_len, unsigned long queries,
+                 int batch_size) {
+    static uint8 responses[BURST_SIZE][BUFFER_SIZE];
+    struct mmsghdr send_messages[BURST_SIZE], recv_messages[BURST_SIZE];
+    struct iovec send_iovecs[BURST_SIZE], recv_iovecs[BURST_SIZE];
+    memset(send_messages, 0, sizeof(send_messages));
+    memset(recv_messages, 0, sizeof(recv_messages));
+    for (int i = 0; i < BURST_SIZE; i++) {
+        send_iovecs[i].iov_base = request;
+        send_iovecs[i].iov_len = request_len;
+        send_messages[i].msg_hdr.msg_iov = &send_iovecs[i];
+        send_messages[i].msg_hdr.msg_iovlen = 1;
+        recv_iovecs[i].iov_base = responses[i];
+        recv_iovecs[i].iov_len = BUFFER_SIZE;
+        recv_messages[i].msg_hdr.msg_iov = &recv_iovecs[i];
+        recv_messages[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    double server_ns = 0;
+    for (unsigned long done = 0; done < queries; done += BURST_SIZE) {
+        if (sendmmsg(client_sock, send_messages, BURST_SIZE, 0) != BURST_SIZE) {
+            DNS_log_error("[ dns_bench  ] Failed to send the requests.");
+            return -1;
+        }
+
+        double start = bench_now_ns();
+        int handled = 0;
+        while (handled < BURST_SIZE) {
+            if (batch_size == 0) {
+                handled += DNS_network_handle_query_udp(server_sock, DNS_query_create_response) ? 1 : 0;
+            }
+            else {
+                int count = DNS_network_handle_queries_udp(server_sock, DNS_query_create_response, batch_size);
+                if (count < 0) {
+                    return -1;
+                }
+                handled += count;
+            }
+        }
+        server_ns += bench_now_ns() - start;
+
+        for (int received = 0; received < BURST_SIZE;) {
+            int count = recvmmsg(client_sock, recv_messages, BURST_SIZE - received, MSG_WAITFORONE, NULL);
+            if (count <= 0) {
+                DNS_log_error("[ dns_bench  ] Failed to receive the responses.");
+                return -1;
+            }
+            received += count;
+        }
+    }
+    return server_ns / (double) queries;
+}
+
+/**
+ * Main entry of the benchmark
+ * Usage: dns_udp_bench [queries] [--memory-zone]
+ */
+int main(int argc, char **argv) {
+    unsigned long queries = DEFAULT_QUERIES;
+    bool memory_zone = false;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--memory-zone")) {
+            memory_zone = true;
+        }
+        else {
+            queries = strtoul(argv[i], NULL, 10);
+        }
+    }
+    if (queries < BURST_SIZE) {
+        queries = BURST_SIZE;
+    }
+
+    DNS_query_set_table_name("s2");
+    if (memory_zone && !DNS_zone_load("s2")) {
+        DNS_log_error("[ dns_bench  ] Failed to load the records into memory.");
+        return -1;
+    }
+
+    struct sockaddr_in server_addr, client_addr;
+    int server_sock = bench_create_socket(&server_addr);
+    int client_sock = bench_create_socket(&client_addr);
+    if (server_sock < 0 || client_sock < 0 ||
+        connect(client_sock, (struct sockaddr *) &server_addr, sizeof(server_addr)) < 0) {
+        DNS_log_error("[ dns_bench  ] Failed to create sockets.");
+        return -1;
+    }
+
+    // The request is encoded once, the response of it contains a CNAME and two A records
+    char request[BUFFER_SIZE];
+    struct dns_buffer buffer;
+    DNS_buffer_init(&buffer, request, BUFFER_SIZE);
+    DNS_buffer_write_packet(&buffer, DNS_query_create_request("www.baidu.com", TYPE_A));
+    int request_len = buffer.pos;
+
+    const int batch_sizes[] = {0, 1, 4, 16, 64};
+    printf("%-12s %8s %12s %12s\n", "mode", "batch", "ns/query", "qps");
+    for (int i = 0; i < (int) (sizeof(batch_sizes) / sizeof(batch_sizes[0])); i++) {
+        double ns = bench_run(server_sock, client_sock, request, request_len, queries, batch_sizes[i]);
+        if (ns < 0) {
+            return -1;
+        }
+        if (batch_sizes[i] == 0) {
+            printf("%-12s %8s %12.0f %12.0f\n", "per-packet", "-", ns, 1e9 / ns);
+        }
+        else {
+            printf("%-12s %8d %12.0f %12.0f\n", "batched", batch_sizes[i], ns, 1e9 / ns);
+        }
+    }
+
+    close(client_sock);
+    close(server_sock);
+    return 0;
+}
@@ -0,0 +1,207 @@
+//
+// dns_upstream.c -- Implementation of the RTT statistics of the upstream servers. Each worker thread keeps
+//                   the statistics of the servers it queries in its own hash table without any lock, the
+//                   tables are linked into a list when they are created and merged when they are read.
+//                   The tables are read while they may be updated, so the statistics read may miss the last
+//                   few queries, which are seen by the next read
+// Created on 10/15/26.
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include "dns_common.h"
+#include "dns_upstream.h"
+
+#define UPSTREAM_CAPACITY 1024   // The maximum number of servers tracked, should be power of 2
+#define RTO_INITIAL 400          // The timeout in milliseconds of the servers never responded
+#define RTO_MIN 50               // The bounds of the timeouts in milliseconds
+#define RTO_MAX 2000
+#define PENALTY_DECAY 0.98       // The penalty of a server decays each time it is ranked but not chosen
+
+/**
+ * The statistics of the servers queried by one thread, or merged from all the threads
+ */
+typedef struct upstream_table {
+    dns_upstream_stats_t entries[UPSTREAM_CAPACITY];
+    int count;
+    struct upstream_table *next;
+} upstream_table_t;
+
+// The tables of all the threads, only added to
+upstream_table_t *upstream_tables = NULL;
+pthread_mutex_t upstream_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread upstream_table_t *upstream_local = NULL;
+
+/**
+ * Get the table of the current thread, it is created when the thread queries a server for the first time
+ * @return The table, NULL if out of memory
+ */
+upstream_table_t *upstream_get_local() {
+    if (upstream_local == NULL) {
+        upstream_table_t *local = (upstream_table_t *) calloc(1, sizeof(upstream_table_t));
+        if (local == NULL) {
+            return NULL;
+        }
+        pthread_mutex_lock(&upstream_lock);
+        local->next = upstream_tables;
+        upstream_tables = local;
+        pthread_mutex_unlock(&upstream_lock);
+        upstream_local = local;
+    }
+    return upstream_local;
+}
+
+/**
+ * Find the statistics of the server in the table
+ * @param create Whether the statistics are created if not found
+ * @return The statistics, NULL if not found or the table is full
+ */
+dns_upstream_stats_t *upstream_find(upstream_table_t *table, uint32 address, bool create) {
+    if (table == NULL) {
+        return NULL;
+    }
+    uint32 i = (address * 2654435761u) & (UPSTREAM_CAPACITY - 1);
+    for (int probe = 0; probe < UPSTREAM_CAPACITY; probe++) {
+        dns_upstream_stats_t *s = &table->entries[(i + probe) & (UPSTREAM_CAPACITY - 1)];
+        if (s->rto != 0 && s->address == address) {
+            return s;
+        }
+        if (s->rto == 0) {
+            // Never removed, so the server is not in the table after an empty slot
+            if (!create || table->count == UPSTREAM_CAPACITY / 2) {
+                return NULL;
+            }
+            memset(s, 0, sizeof(dns_upstream_stats_t));
+            s->address = address;
+            s->rto = RTO_INITIAL;   // Set last, the readers skip the slots with no timeout
+            table->count++;
+            return s;
+        }
+    }
+    return NULL;
+}
+
+int DNS_upstream_select(const uint32 *servers, int count, uint32 tried) {
+    int chosen = -1;
+    double chosen_rank = 0;
+
+    upstream_table_t *local = upstream_get_local();
+    for (int i = 0; i < count; i++) {
+        if (tried & (1u << i)) {
+            continue;
+        }
+        dns_upstream_stats_t *s = upstream_find(local, servers[i], false);
+        double rank = s == NULL ? 0 : (s->responses > 0 ? s->srtt : 0) + s->penalty;
+        if (chosen < 0 || rank < chosen_rank) {
+            chosen = i;
+            chosen_rank = rank;
+        }
+    }
+
+    // The servers passed over recover from their penalties slowly, so they are tried again at last
+    for (int i = 0; i < count; i++) {
+        dns_upstream_stats_t *s;
+        if (i != chosen && !(tried & (1u << i)) && (s = upstream_find(local, servers[i], false)) != NULL) {
+            s->penalty *= PENALTY_DECAY;
+        }
+    }
+    return chosen;
+}
+
+int DNS_upstream_query(uint32 address) {
+    dns_upstream_stats_t *s = upstream_find(upstream_get_local(), address, true);
+    if (s == NULL) {
+        return RTO_INITIAL;
+    }
+    s->queries++;
+    return s->rto;
+}
+
+void DNS_upstream_response(uint32 address, double rtt) {
+    dns_upstream_stats_t *s = upstream_find(upstream_get_local(), address, true);
+    if (s == NULL) {
+        return;
+    }
+    if (s->responses++ == 0) {
+        s->srtt = rtt;
+        s->rttvar = rtt / 2;
+    }
+    else {
+        double delta = s->srtt > rtt ? s->srtt - rtt : rtt - s->srtt;
+        s->rttvar = 0.75 * s->rttvar + 0.25 * delta;
+        s->srtt = 0.875 * s->srtt + 0.125 * rtt;
+    }
+    double rto = s->srtt + 4 * s->rttvar;
+    s->rto = rto < RTO_MIN ? RTO_MIN : rto > RTO_MAX ? RTO_MAX : (int) rto;
+    s->penalty = 0;
+}
+
+void DNS_upstream_timeout(uint32 address) {
+    dns_upstream_stats_t *s = upstream_find(upstream_get_local(), address, true);
+    if (s != NULL) {
+        s->timeouts++;
+        s->penalty += s->rto;
+        s->rto = s->rto * 2 > RTO_MAX ? RTO_MAX : s->rto * 2;
+    }
+}
+
+int DNS_upstream_get_stats(dns_upstream_stats_t *stats, int capacity) {
+    static upstream_table_t merged;
+
+    // The counters are summed, the RTT and its variance are averaged by the responses of each thread,
+    // and the highest timeout and penalty are kept
+    pthread_mutex_lock(&upstream_lock);
+    memset(&merged, 0, sizeof(upstream_table_t));
+    for (upstream_table_t *table = upstream_tables; table != NULL; table = table->next) {
+        for (int i = 0; i < UPSTREAM_CAPACITY; i++) {
+            dns_upstream_stats_t entry = table->entries[i];
+            dns_upstream_stats_t *s;
+            if (entry.rto == 0 || (s = upstream_find(&merged, entry.address, true)) == NULL) {
+                continue;
+            }
+            s->srtt += entry.srtt * entry.responses;
+            s->rttvar += entry.rttvar * entry.responses;
+            s->penalty = entry.penalty > s->penalty ? entry.penalty : s->penalty;
+            s->rto = entry.rto > s->rto || s->queries == 0 ? entry.rto : s->rto;
+            s->queries += entry.queries;
+            s->responses += entry.responses;
+            s->timeouts += entry.timeouts;
+        }
+    }
+
+    int count = 0;
+    for (int i = 0; i < UPSTREAM_CAPACITY && count < capacity; i++) {
+        dns_upstream_stats_t *s = &merged.entries[i];
+        if (s->rto != 0) {
+            if (s->responses > 0) {
+                s->srtt /= s->responses;
+                s->rttvar /= s->responses;
+            }
+            stats[count++] = *s;
+        }
+    }
+    pthread_mutex_unlock(&upstream_lock);
+    return count;
+}
+
+void DNS_upstream_print() {
+    static dns_upstream_stats_t stats[UPSTREAM_CAPACITY];
+    static pthread_mutex_t print_lock = PTHREAD_MUTEX_INITIALIZER;
+
+    pthread_mutex_lock(&print_lock);
+    int count = DNS_upstream_get_stats(stats, UPSTREAM_CAPACITY);
+    DNS_log_info("[dns_upstream] %d upstream servers:", count);
+    for (int i = 0; i < count; i++) {
+        struct in_addr addr;
+        char str[INET_ADDRSTRLEN];
+        addr.s_addr = htonl(stats[i].address);
+        inet_ntop(AF_INET, &addr, str, sizeof(str));
+        DNS_log_info("[dns_upstream] %-15s srtt %.3f ms, rttvar %.3f ms, rto %d ms, penalty %.1f ms, "
+                     "%lu queries, %lu responses, %lu timeouts", str, stats[i].srtt, stats[i].rttvar, stats[i].rto,
+                     stats[i].penalty, stats[i].queries, stats[i].responses, stats[i].timeouts);
+    }
+    pthread_mutex_unlock(&print_lock);
+}
@@ -0,0 +1,74 @@
+//
+// dns_upstream.h -- Round-trip time statistics of the upstream servers queried by the local server.
+//                   The smoothed RTT and its variance are tracked like the retransmission timer of
+//                   TCP (RFC 6298), which gives the timeout of each query and the order in which the
+//                   servers of a zone are tried. Each worker thread measures the servers it queries on its own
+// Created on 10/15/26.
+//
+
+#ifndef PROJECT_DNS_DNS_UPSTREAM_H
+#define PROJECT_DNS_DNS_UPSTREAM_H
+
+#include "dns_io.h"
+
+/**
+ * The statistics of one upstream server
+ */
+typedef struct {
+    uint32 address;                 // The IPv4 address in host byte order
+    double srtt;                    // The smoothed RTT in milliseconds, 0 before the first response
+    double rttvar;                  // The variance of the RTT in milliseconds
+    double penalty;                 // Added to the RTT when the servers are ranked, set by the timeouts
+    int rto;                        // The timeout of the next query in milliseconds
+    unsigned long queries;
+    unsigned long responses;
+    unsigned long timeouts;
+} dns_upstream_stats_t;
+
+/**
+ * Choose the server to query among the servers not tried yet, the server with the lowest RTT
+ * (plus its penalty) measured by the current thread is chosen, and the servers never queried by the
+ * thread are tried first to measure them
+ * @param servers The addresses of the servers in host byte order
+ * @param count The number of the servers
+ * @param tried The bit mask of the servers already tried
+ * @return The index of the chosen server, -1 if all the servers are tried
+ */
+int DNS_upstream_select(const uint32 *servers, int count, uint32 tried);
+
+/**
+ * Record a query sent to the server
+ * @param address The address of the server in host byte order
+ * @return The timeout of the query in milliseconds
+ */
+int DNS_upstream_query(uint32 address);
+
+/**
+ * Record the response of the server and update its RTT estimation
+ * @param address The address of the server in host byte order
+ * @param rtt The round-trip time in milliseconds
+ */
+void DNS_upstream_response(uint32 address, double rtt);
+
+/**
+ * Record a query to the server that timed out, the timeout of the server is doubled and the
+ * server is ranked behind the others until the penalty decays
+ * @param address The address of the server in host byte order
+ */
+void DNS_upstream_timeout(uint32 address);
+
+/**
+ * Get the statistics of all the upstream servers queried so far, merged from all the threads: the counters
+ * are summed, the RTT and its variance are averaged by the responses, and the highest timeout and penalty are kept
+ * @param stats The array to be filled
+ * @param capacity The size of the array
+ * @return The number of the servers filled into the array
+ */
+int DNS_upstream_get_stats(dns_upstream_stats_t *stats, int capacity);
+
+/**
+ * Print the statistics of all the upstream servers queried so far
+ */
+void DNS_upstream_print();
+
+#endif //PROJECT_DNS_DNS_UPSTREAM_H
@@ -0,0 +1,731 @@
+//
+// dns_uring.c -- Implementation of the io_uring backend, with the raw syscalls instead of liburing
+// Created on 10/15/26.
+//
+
+#define _GNU_SOURCE   // For MAP_POPULATE and SO_REUSEPORT, which are not in POSIX
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/io_uring.h>
+#include "dns_common.h"
+#include "dns_uring.h"
+#include "dns_latency.h"
+
+// The multishot operations and the provided buffer rings need the headers of Linux 6.0 or later
+#ifdef IORING_RECV_MULTISHOT
+
+#define BUFFER_SIZE 1024            // The maximum size of the requests and the responses
+
+#define URING_ENTRIES       1024    // The size of the submission queue
+#define URING_BUFFER_COUNT  1024    // The number of buffers provided to the kernel for UDP, should be a power of 2
+#define URING_BUFFER_GROUP  0
+#define URING_SEND_SLOTS    1024    // The maximum number of UDP responses being sent
+
+// A received datagram is stored in a provided buffer with its header and the address of the client
+#define URING_BUFFER_SIZE (sizeof(struct io_uring_recvmsg_out) + sizeof(struct sockaddr_in) + BUFFER_SIZE)
+
+#define MAX_TCP_CONNECTIONS 1024    // The maximum number of concurrent TCP connections
+#define TCP_IDLE_TIMEOUT    10      // The seconds after which the idle TCP connections are closed
+
+/**
+ * The kinds of the operations submitted to the ring
+ */
+enum {
+    OP_UDP_RECV,
+    OP_UDP_SEND,
+    OP_ACCEPT,
+    OP_TCP_RECV,
+    OP_TCP_SEND,
+    OP_TIMEOUT
+};
+
+/**
+ * An operation submitted to the ring, the pointer of it is the user data of the submission
+ */
+typedef struct {
+    int kind;
+    void *owner;
+} uring_op_t;
+
+/**
+ * The buffer of a UDP response, kept until the response is sent
+ */
+typedef struct uring_send_slot {
+    uring_op_t op;
+    struct msghdr message;
+    struct iovec iovec;
+    struct sockaddr_in peer;
+    uint8 data[BUFFER_SIZE];
+    struct uring_send_slot *next_free;
+} uring_send_slot_t;
+
+/**
+ * A TCP connection. Like the event loop of epoll, only one response is buffered, and the
+ * connection is not read while the response is being sent, so at most one of the operations
+ * of a connection is submitted at any time
+ */
+typedef struct uring_connection {
+    uring_op_t recv_op;
+    uring_op_t send_op;
+    int fd;
+    struct sockaddr_in peer;
+    time_t last_active;
+    bool receiving;
+    bool sending;
+    bool closing;                 // The socket is shut down, and it is freed once the operation completes
+
+    uint8 in[BUFFER_SIZE + 2];
+    uint32 in_length;
+    uint8 out[BUFFER_SIZE + 2];
+    uint32 out_length;
+    uint32 out_pos;
+
+    struct uring_connection *prev;
+    struct uring_connection *next;
+} uring_connection_t;
+
+/**
+ * The state of an io_uring loop
+ */
+typedef struct {
+    int fd;
+    dns_handler_t handler;
+    bool unsupported;             // Whether the kernel rejected one of the multishot operations
+
+    // The submission queue
+    void *sq_ptr;
+    size_t sq_size;
+    uint32 *sq_head;
+    uint32 *sq_tail;
+    uint32 *sq_array;
+    uint32 sq_mask;
+    uint32 sq_entries;
+    struct io_uring_sqe *sqes;
+    uint32 to_submit;
+
+    // The completion queue, shares the memory with the submission queue on most kernels
+    void *cq_ptr;
+    size_t cq_size;
+    uint32 *cq_head;
+    uint32 *cq_tail;
+    uint32 cq_mask;
+    struct io_uring_cqe *cqes;
+
+    // The buffers provided to the kernel for receiving the datagrams
+    struct io_uring_buf_ring *buf_ring;
+    uint8 *buffers;
+    uint16 buf_tail;
+
+    int udp;
+    int tcp;
+    struct msghdr recv_message;   // Tells the kernel how to lay out the datagrams in the buffers
+    uring_op_t udp_recv_op;
+    uring_op_t accept_op;
+    uring_op_t timeout_op;
+    struct __kernel_timespec timeout;
+
+    uring_send_slot_t *slots;
+    uring_send_slot_t *free_slots;
+    uring_connection_t *connections;
+    int connection_count;
+} uring_t;
+
+/**
+ * Submit the queued submissions and optionally wait for completions
+ * @param ring The ring
+ * @param wait The number of completions to wait for
+ * @return True if success
+ */
+bool uring_enter(uring_t *ring, uint32 wait) {
+    while (true) {
+        int ret = (int) syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, wait,
+                                wait > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (ret >= 0) {
+            ring->to_submit -= ret;
+            return true;
+        }
+        if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            DNS_log_error("[ dns_uring  ] Failed to enter the ring: %s", strerror(errno));
+            return false;
+        }
+        if (errno != EINTR) {
+            return true;   // The completion queue is full, the completions should be handled first
+        }
+    }
+}
+
+/**
+ * Get an empty submission, the queued submissions are submitted if the queue is full
+ * @param ring The ring
+ * @param op The operation of the submission
+ * @return The submission
+ */
+struct io_uring_sqe *uring_get_sqe(uring_t *ring, uring_op_t *op) {
+    uint32 tail = *ring->sq_tail;
+    while (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries) {
+        uring_enter(ring, 0);
+    }
+
+    uint32 index = tail & ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = (uint64_t) (uintptr_t) op;
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->to_submit++;
+    return sqe;
+}
+
+/**
+ * Give a buffer back to the kernel
+ * @param ring The ring
+ * @param id The ID of the buffer
+ */
+void uring_recycle_buffer(uring_t *ring, uint16 id) {
+    struct io_uring_buf *buf = &ring->buf_ring->bufs[ring->buf_tail & (URING_BUFFER_COUNT - 1)];
+    buf->addr = (uint64_t) (uintptr_t) &ring->buffers[(size_t) id * URING_BUFFER_SIZE];
+    buf->len = URING_BUFFER_SIZE;
+    buf->bid = id;
+    ring->buf_tail++;
+    __atomic_store_n(&ring->buf_ring->tail, ring->buf_tail, __ATOMIC_RELEASE);
+}
+
+/**
+ * Create the ring, map its queues and register the provided buffers
+ * @param ring The ring to be initialized
+ * @return True if success, false if io_uring is not supported
+ */
+bool uring_init(uring_t *ring) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->fd = (int) syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (ring->fd < 0) {
+        DNS_log_warning("[ dns_uring  ] Failed to set up io_uring: %s", strerror(errno));
+        return false;
+    }
+
+    ring->sq_size = params.sq_off.array + params.sq_entries * sizeof(uint32);
+    ring->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->sq_size = ring->sq_size > ring->cq_size ? ring->sq_size : ring->cq_size;
+        ring->cq_size = ring->sq_size;
+    }
+    ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                        IORING_OFF_SQ_RING);
+    if (ring->sq_ptr == MAP_FAILED) {
+        DNS_log_warning("[ dns_uring  ] Failed to map the submission queue: %s", strerror(errno));
+        return false;
+    }
+    ring->cq_ptr = ring->sq_ptr;
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                            IORING_OFF_CQ_RING);
+        if (ring->cq_ptr == MAP_FAILED) {
+            DNS_log_warning("[ dns_uring  ] Failed to map the completion queue: %s", strerror(errno));
+            return false;
+        }
+    }
+    ring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        DNS_log_warning("[ dns_uring  ] Failed to map the submissions: %s", strerror(errno));
+        return false;
+    }
+
+    uint8 *sq = (uint8 *) ring->sq_ptr;
+    ring->sq_head = (uint32 *) (sq + params.sq_off.head);
+    ring->sq_tail = (uint32 *) (sq + params.sq_off.tail);
+    ring->sq_array = (uint32 *) (sq + params.sq_off.array);
+    ring->sq_mask = *(uint32 *) (sq + params.sq_off.ring_mask);
+    ring->sq_entries = params.sq_entries;
+    uint8 *cq = (uint8 *) ring->cq_ptr;
+    ring->cq_head = (uint32 *) (cq + params.cq_off.head);
+    ring->cq_tail = (uint32 *) (cq + params.cq_off.tail);
+    ring->cq_mask = *(uint32 *) (cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+    // The ring of the provided buffers should be aligned to a page
+    ring->buf_ring = mmap(NULL, URING_BUFFER_COUNT * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ring->buffers = (uint8 *) malloc((size_t) URING_BUFFER_COUNT * URING_BUFFER_SIZE);
+    if (ring->buf_ring == MAP_FAILED || ring->buffers == NULL) {
+        ring->buf_ring = NULL;
+        DNS_log_error("[ dns_uring  ] Failed to allocate the buffers.");
+        return false;
+    }
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t) (uintptr_t) ring->buf_ring;
+    reg.ring_entries = URING_BUFFER_COUNT;
+    reg.bgid = URING_BUFFER_GROUP;
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        DNS_log_warning("[ dns_uring  ] Failed to register the provided buffers: %s", strerror(errno));
+        return false;
+    }
+    ring->buf_tail = 0;
+    for (int i = 0; i < URING_BUFFER_COUNT; i++) {
+        uring_recycle_buffer(ring, (uint16) i);
+    }
+
+    ring->slots = (uring_send_slot_t *) malloc(URING_SEND_SLOTS * sizeof(uring_send_slot_t));
+    if (ring->slots == NULL) {
+        DNS_log_error("[ dns_uring  ] Failed to allocate the buffers.");
+        return false;
+    }
+    ring->free_slots = NULL;
+    for (int i = 0; i < URING_SEND_SLOTS; i++) {
+        uring_send_slot_t *slot = &ring->slots[i];
+        slot->op.kind = OP_UDP_SEND;
+        slot->op.owner = slot;
+        memset(&slot->message, 0, sizeof(slot->message));
+        slot->message.msg_name = &slot->peer;
+        slot->message.msg_namelen = sizeof(slot->peer);
+        slot->message.msg_iov = &slot->iovec;
+        slot->message.msg_iovlen = 1;
+        slot->iovec.iov_base = slot->data;
+        slot->next_free = ring->free_slots;
+        ring->free_slots = slot;
+    }
+    return true;
+}
+
+/**
+ * Close the ring and release all its memory, including the connections
+ */
+void uring_free(uring_t *ring) {
+    uring_connection_t *next;
+    for (uring_connection_t *conn = ring->connections; conn != NULL; conn = next) {
+        next = conn->next;
+        close(conn->fd);
+        free(conn);
+    }
+    if (ring->sqes != NULL && ring->sqes != MAP_FAILED) {
+        munmap(ring->sqes, ring->sq_entries * sizeof(struct io_uring_sqe));
+    }
+    if (ring->cq_ptr != NULL && ring->cq_ptr != MAP_FAILED && ring->cq_ptr != ring->sq_ptr) {
+        munmap(ring->cq_ptr, ring->cq_size);
+    }
+    if (ring->sq_ptr != NULL && ring->sq_ptr != MAP_FAILED) {
+        munmap(ring->sq_ptr, ring->sq_size);
+    }
+    if (ring->buf_ring != NULL) {
+        munmap(ring->buf_ring, URING_BUFFER_COUNT * sizeof(struct io_uring_buf));
+    }
+    free(ring->buffers);
+    free(ring->slots);
+    if (ring->fd >= 0) {
+        close(ring->fd);
+    }
+    if (ring->udp >= 0) {
+        close(ring->udp);
+    }
+    if (ring->tcp >= 0) {
+        close(ring->tcp);
+    }
+}
+
+/**
+ * Post the multishot receive on the UDP socket, the datagrams are received into the provided buffers
+ */
+void uring_post_udp_recv(uring_t *ring) {
+    struct io_uring_sqe *sqe = uring_get_sqe(ring, &ring->udp_recv_op);
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = ring->udp;
+    sqe->addr = (uint64_t) (uintptr_t) &ring->recv_message;
+    sqe->len = 1;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+}
+
+/**
+ * Post the multishot accept on the TCP socket
+ */
+void uring_post_accept(uring_t *ring) {
+    struct io_uring_sqe *sqe = uring_get_sqe(ring, &ring->accept_op);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = ring->tcp;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+}
+
+/**
+ * Post the timeout waking up the loop every second, so the idle connections are closed
+ */
+void uring_post_timeout(uring_t *ring) {
+    struct io_uring_sqe *sqe = uring_get_sqe(ring, &ring->timeout_op);
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (uint64_t) (uintptr_t) &ring->timeout;
+    sqe->len = 1;
+}
+
+/**
+ * Receive from the connection into the rest of its buffer
+ */
+void uring_post_tcp_recv(uring_t *ring, uring_connection_t *conn) {
+    struct io_uring_sqe *sqe = uring_get_sqe(ring, &conn->recv_op);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    sqe->addr = (uint64_t) (uintptr_t) &conn->in[conn->in_length];
+    sqe->len = sizeof(conn->in) - conn->in_length;
+    conn->receiving = true;
+}
+
+/**
+ * Send the rest of the buffered response of the connection
+ */
+void uring_post_tcp_send(uring_t *ring, uring_connection_t *conn) {
+    struct io_uring_sqe *sqe = uring_get_sqe(ring, &conn->send_op);
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = conn->fd;
+    sqe->addr = (uint64_t) (uintptr_t) &conn->out[conn->out_pos];
+    sqe->len = conn->out_length - conn->out_pos;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    conn->sending = true;
+}
+
+/**
+ * Close the connection. If one of its operations is submitted, the socket is shut down so the
+ * operation completes soon, and the connection is freed when it completes
+ */
+void uring_close_connection(uring_t *ring, uring_connection_t *conn) {
+    if (conn->receiving || conn->sending) {
+        if (!conn->closing) {
+            conn->closing = true;
+            shutdown(conn->fd, SHUT_RDWR);
+        }
+        return;
+    }
+
+    DNS_log_trace("[ dns_uring  ] Closed connection from %s:%d", inet_ntoa(conn->peer.sin_addr),
+                  ntohs(conn->peer.sin_port));
+    close(conn->fd);
+    if (conn->prev != NULL) {
+        conn->prev->next = conn->next;
+    }
+    else {
+        ring->connections = conn->next;
+    }
+    if (conn->next != NULL) {
+        conn->next->prev = conn->prev;
+    }
+    ring->connection_count--;
+    free(conn);
+}
+
+/**
+ * Handle the complete messages received on the connection until a response is being sent,
+ * then receive more if no response is being sent
+ * @return False if the connection should be closed
+ */
+bool uring_process_connection(uring_t *ring, uring_connection_t *conn) {
+    uint32 pos = 0;
+    while (!conn->sending && conn->in_length - pos >= 2) {
+        uint16 length = (uint16) ((conn->in[pos] << 8) | conn->in[pos + 1]);
+        if (length == 0 || length > BUFFER_SIZE) {
+            DNS_log_error("[ dns_uring  ] Invalid message length %d from the client", length);
+            return false;
+        }
+        if (conn->in_length - pos < (uint32) length + 2) {
+            break;
+        }
+
+        int len = DNS_network_process_request(&conn->in[pos + 2], length, &conn->out[2], BUFFER_SIZE,
+                                              ring->handler, conn->peer, true);
+        conn->out[0] = (uint8) (len >> 8);
+        conn->out[1] = (uint8) len;
+        conn->out_length = (uint32) len + 2;
+        conn->out_pos = 0;
+        pos += (uint32) length + 2;
+        uring_post_tcp_send(ring, conn);
+    }
+
+    // Keep the incomplete message at the beginning of the buffer
+    if (pos > 0) {
+        memmove(conn->in, &conn->in[pos], conn->in_length - pos);
+        conn->in_length -= pos;
+    }
+    if (!conn->sending) {
+        uring_post_tcp_recv(ring, conn);
+    }
+    return true;
+}
+
+/**
+ * Handle a completion of the multishot receive on the UDP socket
+ */
+void uring_complete_udp_recv(uring_t *ring, struct io_uring_cqe *cqe) {
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        uint16 id = (uint16) (cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        uint8 *buf = &ring->buffers[(size_t) id * URING_BUFFER_SIZE];
+        struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out *) buf;
+        uint32 header = sizeof(*out) + ring->recv_message.msg_namelen + ring->recv_message.msg_controllen;
+
+        if (cqe->res >= (int) header && out->namelen >= sizeof(struct sockaddr_in)) {
+            struct sockaddr_in *peer = (struct sockaddr_in *) (buf + sizeof(*out));
+            uring_send_slot_t *slot = ring->free_slots;
+            if (slot != NULL) {
+                ring->free_slots = slot->next_free;
+                slot->peer = *peer;
+                slot->iovec.iov_len = DNS_network_process_request(buf + header, cqe->res - (int) header,
+                                                                  slot->data, BUFFER_SIZE, ring->handler, *peer,
+                                                                  false);
+                struct io_uring_sqe *sqe = uring_get_sqe(ring, &slot->op);
+                sqe->opcode = IORING_OP_SENDMSG;
+                sqe->fd = ring->udp;
+                sqe->addr = (uint64_t) (uintptr_t) &slot->message;
+                sqe->len = 1;
+            }
+            else {
+                // All the slots are in use, send the response directly
+                uint8 data[BUFFER_SIZE];
+                int len = DNS_network_process_request(buf + header, cqe->res - (int) header, data, BUFFER_SIZE,
+                                                      ring->handler, *peer, false);
+                if (sendto(ring->udp, data, len, MSG_DONTWAIT, (struct sockaddr *) peer, sizeof(*peer)) < 0) {
+                    DNS_log_error("[ dns_uring  ] Failed to send response to the client: %s", strerror(errno));
+                }
+            }
+        }
+        uring_recycle_buffer(ring, id);
+    }
+
+    // The multishot receive stops when it fails, like when all the buffers are in use
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        if (cqe->res == -EINVAL) {
+            ring->unsupported = true;
+            return;
+        }
+        if (cqe->res < 0 && cqe->res != -ENOBUFS) {
+            DNS_log_error("[ dns_uring  ] Failed to receive requests from clients: %s", strerror(-cqe->res));
+        }
+        uring_post_udp_recv(ring);
+    }
+}
+
+/**
+ * Handle a completion of the multishot accept on the TCP socket
+ */
+void uring_complete_accept(uring_t *ring, struct io_uring_cqe *cqe) {
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        if (cqe->res == -EINVAL) {
+            ring->unsupported = true;
+            return;
+        }
+        uring_post_accept(ring);
+    }
+    if (cqe->res < 0) {
+        DNS_log_error("[ dns_uring  ] Failed to accept connection from the client: %s", strerror(-cqe->res));
+        return;
+    }
+
+    int sock = cqe->res;
+    struct sockaddr_in peer;
+    socklen_t peer_len = sizeof(peer);
+    memset(&peer, 0, sizeof(peer));
+    getpeername(sock, (struct sockaddr *) &peer, &peer_len);
+    if (ring->connection_count >= MAX_TCP_CONNECTIONS) {
+        DNS_log_warning("[ dns_uring  ] Too many connections, rejected the connection from %s:%d",
+                        inet_ntoa(peer.sin_addr), ntohs(peer.sin_port));
+        close(sock);
+        return;
+    }
+
+    uring_connection_t *conn = (uring_connection_t *) malloc(sizeof(uring_connection_t));
+    if (conn == NULL) {
+        DNS_log_error("[ dns_uring  ] Failed to set up the connection from %s:%d", inet_ntoa(peer.sin_addr),
+                      ntohs(peer.sin_port));
+        close(sock);
+        return;
+    }
+    conn->recv_op.kind = OP_TCP_RECV;
+    conn->recv_op.owner = conn;
+    conn->send_op.kind = OP_TCP_SEND;
+    conn->send_op.owner = conn;
+    conn->fd = sock;
+    conn->peer = peer;
+    conn->last_active = time(NULL);
+    conn->receiving = false;
+    conn->sending = false;
+    conn->closing = false;
+    conn->in_length = 0;
+    conn->out_length = 0;
+    conn->out_pos = 0;
+
+    conn->prev = NULL;
+    conn->next = ring->connections;
+    if (ring->connections != NULL) {
+        ring->connections->prev = conn;
+    }
+    ring->connections = conn;
+    ring->connection_count++;
+
+    DNS_log_trace("[ dns_uring  ] Accepted connection from %s:%d", inet_ntoa(peer.sin_addr), ntohs(peer.sin_port));
+    uring_post_tcp_recv(ring, conn);
+}
+
+/**
+ * Handle a completion of receiving from a connection
+ */
+void uring_complete_tcp_recv(uring_t *ring, uring_connection_t *conn, int res) {
+    conn->receiving = false;
+    if (conn->closing || res <= 0) {
+        if (res < 0 && !conn->closing) {
+            DNS_log_error("[ dns_uring  ] Failed to receive request from client: %s", strerror(-res));
+        }
+        uring_close_connection(ring, conn);   // Closed by the client if nothing is received
+        return;
+    }
+
+    conn->last_active = time(NULL);
+    conn->in_length += res;
+    if (!uring_process_connection(ring, conn)) {
+        uring_close_connection(ring, conn);
+    }
+}
+
+/**
+ * Handle a completion of sending to a connection
+ */
+void uring_complete_tcp_send(uring_t *ring, uring_connection_t *conn, int res) {
+    conn->sending = false;
+    if (conn->closing || res < 0) {
+        if (res < 0 && !conn->closing) {
+            DNS_log_error("[ dns_uring  ] Failed to send response to the client: %s", strerror(-res));
+        }
+        uring_close_connection(ring, conn);
+        return;
+    }
+
+    conn->last_active = time(NULL);
+    conn->out_pos += res;
+    if (conn->out_pos < conn->out_length) {
+        uring_post_tcp_send(ring, conn);
+        return;
+    }
+
+    // Handle the messages already received once the response is sent
+    conn->out_length = 0;
+    conn->out_pos = 0;
+    if (!uring_process_connection(ring, conn)) {
+        uring_close_connection(ring, conn);
+    }
+}
+
+/**
+ * Close the connections without any activity for {@code TCP_IDLE_TIMEOUT} seconds
+ */
+void uring_close_idle(uring_t *ring) {
+    time_t now = time(NULL);
+    uring_connection_t *next;
+    for (uring_connection_t *conn = ring->connections; conn != NULL; conn = next) {
+        next = conn->next;
+        if (!conn->closing && now - conn->last_active >= TCP_IDLE_TIMEOUT) {
+            uring_close_connection(ring, conn);
+        }
+    }
+}
+
+bool DNS_uring_serve(const char *address, dns_handler_t handler, bool reuse_port) {
+    uring_t ring;
+    memset(&ring, 0, sizeof(ring));
+    ring.fd = -1;
+    ring.udp = -1;
+    ring.tcp = -1;
+    ring.handler = handler;
+    if (!uring_init(&ring)) {
+        uring_free(&ring);
+        return false;
+    }
+
+    ring.udp = DNS_network_init_server_socket_udp(address, reuse_port);
+    ring.tcp = DNS_network_init_server_socket_tcp(address, reuse_port);
+    if (ring.udp < 0 || ring.tcp < 0) {
+        DNS_log_error("[ dns_uring  ] Failed to set up the sockets on %s", address);
+        uring_free(&ring);
+        return true;
+    }
+
+    ring.recv_message.msg_namelen = sizeof(struct sockaddr_in);
+    ring.udp_recv_op.kind = OP_UDP_RECV;
+    ring.accept_op.kind = OP_ACCEPT;
+    ring.timeout_op.kind = OP_TIMEOUT;
+    ring.timeout.tv_sec = 1;
+    uring_post_udp_recv(&ring);
+    uring_post_accept(&ring);
+    uring_post_timeout(&ring);
+
+    time_t last_check = time(NULL);
+    while (!ring.unsupported) {
+        if (!uring_enter(&ring, 1)) {
+            break;
+        }
+
+        // Handle all the completions, the submissions made meanwhile are submitted together
+        uint32 head = *ring.cq_head;
+        while (!ring.unsupported && head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe *cqe = &ring.cqes[head & ring.cq_mask];
+            uring_op_t *op = (uring_op_t *) (uintptr_t) cqe->user_data;
+            switch (op->kind) {
+                case OP_UDP_RECV:
+                    uring_complete_udp_recv(&ring, cqe);
+                    break;
+                case OP_UDP_SEND: {
+                    uring_send_slot_t *slot = (uring_send_slot_t *) op->owner;
+                    if (cqe->res < 0) {
+                        DNS_log_error("[ dns_uring  ] Failed to send response to the client: %s", strerror(-cqe->res));
+                    }
+                    slot->next_free = ring.free_slots;
+                    ring.free_slots = slot;
+                    break;
+                }
+                case OP_ACCEPT:
+                    uring_complete_accept(&ring, cqe);
+                    break;
+                case OP_TCP_RECV:
+                    uring_complete_tcp_recv(&ring, (uring_connection_t *) op->owner, cqe->res);
+                    break;
+                case OP_TCP_SEND:
+                    uring_complete_tcp_send(&ring, (uring_connection_t *) op->owner, cqe->res);
+                    break;
+                case OP_TIMEOUT:
+                    uring_post_timeout(&ring);
+                    break;
+            }
+            head++;
+            __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+        }
+
+        DNS_latency_poll();
+        time_t now = time(NULL);
+        if (now != last_check) {
+            uring_close_idle(&ring);
+            last_check = now;
+        }
+    }
+
+    bool unsupported = ring.unsupported;
+    if (unsupported) {
+        DNS_log_warning("[ dns_uring  ] The multishot operations are not supported by the kernel.");
+    }
+    uring_free(&ring);
+    return !unsupported;
+}
+
+#else
+
+bool DNS_uring_serve(const char *address, dns_handler_t handler, bool reuse_port) {
+    DNS_log_warning("[ dns_uring  ] The server is built without io_uring support.");
+    return false;
+}
+
+#endif
@@ -0,0 +1,26 @@
+//
+// dns_uring.h -- The io_uring backend of the server loops. The requests are received with multishot
+//                operations into the buffers provided to the kernel, and the responses are sent
+//                asynchronously, so many requests are handled with one io_uring_enter syscall
+// Created on 10/15/26.
+//
+
+#ifndef PROJECT_DNS_DNS_URING_H
+#define PROJECT_DNS_DNS_URING_H
+
+#include "dns_network.h"
+
+/**
+ * Serve the requests on both UDP and TCP on the address with io_uring. The UDP socket has a
+ * multishot receive posted on it, the TCP socket has a multishot accept posted on it, and the
+ * datagrams are received into a ring of buffers provided to the kernel.
+ * Everything used by the loop belongs to the calling thread, like the event loop of epoll
+ * @param address The address to listen on
+ * @param handler The function creating the response
+ * @param reuse_port Whether the sockets are shared with other loops by {@code SO_REUSEPORT}
+ * @return False if io_uring (or one of the operations) is not supported by the kernel, so the caller
+ *         can fall back to epoll. Otherwise the function only returns if the sockets cannot be set up
+ */
+bool DNS_uring_serve(const char *address, dns_handler_t handler, bool reuse_port);
+
+#endif //PROJECT_DNS_DNS_URING_H
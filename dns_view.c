@@ -0,0 +1,246 @@
+//
+// dns_view.c -- Implementation of the read-only packet view
+// Created on 10/15/26.
+//
+
+#include <string.h>
+#include <arpa/inet.h>
+#include "dns_common.h"
+#include "dns_view.h"
+
+#define VIEW_MAX_NAME_LEN 255   // The maximum length of a decompressed name in the packet format
+#define VIEW_MAX_QUESTION_LEN RR_STRING_LEN   // Decompressed with the '\0', the name takes one byte less
+
+/**
+ * Read a 16-bit unsigned integer with BIG ENDIAN from the packet
+ */
+uint16 view_u16(const dns_packet_view_t *view, uint32 offset) {
+    return (uint16) ((view->ptr[offset] << 8) | view->ptr[offset + 1]);
+}
+
+/**
+ * Read a 32-bit unsigned integer with BIG ENDIAN from the packet
+ */
+uint32 view_u32(const dns_packet_view_t *view, uint32 offset) {
+    return ((uint32) view->ptr[offset] << 24) | ((uint32) view->ptr[offset + 1] << 16) |
+           ((uint32) view->ptr[offset + 2] << 8) | (uint32) view->ptr[offset + 3];
+}
+
+/**
+ * Check the name at the offset. The pointers should only point backward, so the names
+ * cannot contain loops, and the decompressed name should not be longer than the maximum length
+ * @param view The view of the packet
+ * @param offset The offset of the name
+ * @param max_length The maximum length of the decompressed name in the packet format
+ * @param end Returns the offset after the name (after the first pointer if the name is compressed)
+ * @return True if the name is valid
+ */
+bool view_check_name(const dns_packet_view_t *view, uint32 offset, int max_length, uint32 *end) {
+    bool jumped = false;
+    int length = 0;
+
+    while (offset < view->length) {
+        uint8 length_tag = view->ptr[offset];
+
+        if ((length_tag >> 6) == 0b11) {
+            if (offset + 1 >= view->length) {
+                return false;
+            }
+            uint32 ptr = ((length_tag & 0x3F) << 8) | view->ptr[offset + 1];
+            if (!jumped) {
+                *end = offset + 2;
+                jumped = true;
+            }
+            if (ptr >= offset) {
+                return false;
+            }
+            offset = ptr;
+            continue;
+        }
+
+        // The label types other than normal labels and pointers are not supported
+        if ((length_tag >> 6) != 0) {
+            return false;
+        }
+
+        length += length_tag + 1;
+        if (length > max_length) {
+            return false;
+        }
+        if (length_tag == 0) {
+            if (!jumped) {
+                *end = offset + 1;
+            }
+            return true;
+        }
+        offset += length_tag + 1;
+    }
+
+    return false;
+}
+
+/**
+ * Check the RR at the offset, including the names in its RDATA
+ * @param view The view of the packet
+ * @param offset The offset of the RR
+ * @param end Returns the offset of the next RR
+ * @return True if the RR is valid
+ */
+bool view_check_rr(const dns_packet_view_t *view, uint32 offset, uint32 *end) {
+    uint32 pos;
+    if (!view_check_name(view, offset, VIEW_MAX_NAME_LEN, &pos) || pos + 10 > view->length) {
+        return false;
+    }
+
+    uint16 type = view_u16(view, pos);
+    uint32 rdata = pos + 10;
+    uint32 rdata_end = rdata + view_u16(view, pos + 8);
+    if (rdata_end > view->length) {
+        return false;
+    }
+
+    // The name in the RDATA should end within the RDATA
+    uint32 name_end;
+    if (type == TYPE_MX) {
+        if (rdata + 2 > rdata_end || !view_check_name(view, rdata + 2, VIEW_MAX_NAME_LEN, &name_end) ||
+            name_end > rdata_end) {
+            return false;
+        }
+    }
+    else if (type == TYPE_CNAME || type == TYPE_NS || type == TYPE_PTR) {
+        if (!view_check_name(view, rdata, VIEW_MAX_NAME_LEN, &name_end) || name_end > rdata_end) {
+            return false;
+        }
+    }
+    else if (type == TYPE_SOA) {
+        // The primary server and the mailbox are followed by five 32-bit numbers
+        if (!view_check_name(view, rdata, VIEW_MAX_NAME_LEN, &name_end) || name_end > rdata_end ||
+            !view_check_name(view, name_end, VIEW_MAX_NAME_LEN, &name_end) || name_end + 20 > rdata_end) {
+            return false;
+        }
+    }
+
+    *end = rdata_end;
+    return true;
+}
+
+bool DNS_view_parse(dns_packet_view_t *view, ptr_t ptr, uint32 length) {
+    view->ptr = ptr;
+    view->length = length;
+    if (length < sizeof(dns_header_t)) {
+        return false;
+    }
+
+    memcpy(&view->header, ptr, sizeof(dns_header_t));
+    view->header.id = ntohs(view->header.id);
+    view->header.question_count = ntohs(view->header.question_count);
+    view->header.answer_count = ntohs(view->header.answer_count);
+    view->header.authority_count = ntohs(view->header.authority_count);
+    view->header.additional_count = ntohs(view->header.additional_count);
+
+    uint32 offset = sizeof(dns_header_t);
+    view->questions = offset;
+    for (int i = 0; i < view->header.question_count; i++) {
+        // The names of the questions are decompressed by the handlers, so they should fit in RR_STRING_LEN bytes
+        if (!view_check_name(view, offset, VIEW_MAX_QUESTION_LEN, &offset) || offset + 4 > length) {
+            return false;
+        }
+        offset += 4;
+    }
+
+    view->answers = offset;
+    for (int i = 0; i < view->header.answer_count; i++) {
+        if (!view_check_rr(view, offset, &offset)) {
+            return false;
+        }
+    }
+
+    view->authorities = offset;
+    for (int i = 0; i < view->header.authority_count; i++) {
+        if (!view_check_rr(view, offset, &offset)) {
+            return false;
+        }
+    }
+
+    view->additionals = offset;
+    for (int i = 0; i < view->header.additional_count; i++) {
+        if (!view_check_rr(view, offset, &offset)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Skip the name at the offset, the name should have been checked
+ * @return The offset after the name
+ */
+uint32 view_skip_name(const dns_packet_view_t *view, uint32 offset) {
+    while (view->ptr[offset] != 0) {
+        if ((view->ptr[offset] >> 6) == 0b11) {
+            return offset + 2;
+        }
+        offset += view->ptr[offset] + 1;
+    }
+    return offset + 1;
+}
+
+uint32 DNS_view_read_question(const dns_packet_view_t *view, uint32 offset, dns_question_view_t *question) {
+    question->name = offset;
+    offset = view_skip_name(view, offset);
+    question->type = view_u16(view, offset);
+    question->class = view_u16(view, offset + 2);
+    return offset + 4;
+}
+
+uint32 DNS_view_read_rr(const dns_packet_view_t *view, uint32 offset, dns_rr_view_t *rr) {
+    rr->name = offset;
+    offset = view_skip_name(view, offset);
+    rr->type = view_u16(view, offset);
+    rr->class = view_u16(view, offset + 2);
+    rr->ttl = view_u32(view, offset + 4);
+    rr->rdlength = view_u16(view, offset + 8);
+    rr->rdata = offset + 10;
+    return rr->rdata + rr->rdlength;
+}
+
+bool DNS_view_name(const dns_packet_view_t *view, uint32 offset, char *name) {
+    int length = 0;
+
+    for (uint8 length_tag = view->ptr[offset]; length_tag != 0; length_tag = view->ptr[offset]) {
+        if ((length_tag >> 6) == 0b11) {
+            offset = ((length_tag & 0x3F) << 8) | view->ptr[offset + 1];
+            continue;
+        }
+
+        if (length + length_tag + 1 >= RR_STRING_LEN) {
+            name[0] = '\0';
+            return false;
+        }
+        memcpy(&name[length], &view->ptr[offset + 1], length_tag);
+        length += length_tag;
+        name[length++] = '.';
+        offset += length_tag + 1;
+    }
+
+    name[length > 0 ? length - 1 : 0] = '\0';  // Remove the last dot
+    return true;
+}
+
+bool DNS_view_rdata_a(const dns_packet_view_t *view, const dns_rr_view_t *rr, uint32 *address) {
+    if (rr->type != TYPE_A || rr->rdlength != 4) {
+        return false;
+    }
+    *address = view_u32(view, rr->rdata);
+    return true;
+}
+
+bool DNS_view_rdata_mx(const dns_packet_view_t *view, const dns_rr_view_t *rr, uint16 *preference, uint32 *exchange) {
+    if (rr->type != TYPE_MX) {
+        return false;
+    }
+    *preference = view_u16(view, rr->rdata);
+    *exchange = rr->rdata + 2;
+    return true;
+}
@@ -0,0 +1,107 @@
+//
+// dns_view.h -- Read-only view of a received DNS packet. The packet is validated once, and the
+//               questions and RRs are exposed as offsets into the original buffer, so parsing a
+//               packet takes no memory allocation and no string formatting
+// Created on 10/15/26.
+//
+
+#ifndef PROJECT_DNS_DNS_VIEW_H
+#define PROJECT_DNS_DNS_VIEW_H
+
+#include "dns_io.h"
+
+/**
+ * The view of a packet. The buffer is not copied, so it should be kept unchanged
+ * while the view is used
+ */
+typedef struct dns_packet_view {
+    ptr_t ptr;
+    uint32 length;
+    dns_header_t header;
+
+    // The offsets of the sections in the buffer
+    uint32 questions;
+    uint32 answers;
+    uint32 authorities;
+    uint32 additionals;
+} dns_packet_view_t;
+
+/**
+ * The view of a question, the name is the offset of the name in the buffer
+ */
+typedef struct {
+    uint32 name;
+    uint16 type;
+    uint16 class;
+} dns_question_view_t;
+
+/**
+ * The view of an RR, the name and RDATA are the offsets in the buffer
+ */
+typedef struct {
+    uint32 name;
+    uint16 type;
+    uint16 class;
+    uint32 ttl;
+    uint16 rdlength;
+    uint32 rdata;
+} dns_rr_view_t;
+
+/**
+ * Validate the packet and create the view of it. All the names (including the pointers in them)
+ * and the lengths of the RRs are checked, so the other functions don't need to check again.
+ * The names of the questions should fit in {@code RR_STRING_LEN} bytes when decompressed
+ * @param view The view to be initialized
+ * @param ptr The packet, starting with the DNS header
+ * @param length The length of the packet
+ * @return True if the packet is valid
+ */
+bool DNS_view_parse(dns_packet_view_t *view, ptr_t ptr, uint32 length);
+
+/**
+ * Read the question at the offset of the packet
+ * @param view The view of the packet
+ * @param offset The offset of the question, {@code view->questions} for the first question
+ * @param question The question
+ * @return The offset of the next question (or the answers section after the last question)
+ */
+uint32 DNS_view_read_question(const dns_packet_view_t *view, uint32 offset, dns_question_view_t *question);
+
+/**
+ * Read the RR at the offset of the packet
+ * @param view The view of the packet
+ * @param offset The offset of the RR, like {@code view->answers} for the first answer
+ * @param rr The RR
+ * @return The offset of the next RR
+ */
+uint32 DNS_view_read_rr(const dns_packet_view_t *view, uint32 offset, dns_rr_view_t *rr);
+
+/**
+ * Decompress the name at the offset and convert it to human readable format, like 'www.baidu.com'
+ * @param view The view of the packet
+ * @param offset The offset of the name
+ * @param name The name, should be able to hold {@code RR_STRING_LEN} bytes
+ * @return True if the name fits in {@code RR_STRING_LEN} bytes
+ */
+bool DNS_view_name(const dns_packet_view_t *view, uint32 offset, char *name);
+
+/**
+ * Get the address in the RDATA of an RR of type A
+ * @param view The view of the packet
+ * @param rr The RR
+ * @param address The IPv4 address in host byte order
+ * @return True if the RR has an address
+ */
+bool DNS_view_rdata_a(const dns_packet_view_t *view, const dns_rr_view_t *rr, uint32 *address);
+
+/**
+ * Get the preference and the offset of the exchange name in the RDATA of an RR of type MX
+ * @param view The view of the packet
+ * @param rr The RR
+ * @param preference The preference
+ * @param exchange The offset of the exchange name, can be converted with {@code DNS_view_name}
+ * @return True if the RR has a preference and a name
+ */
+bool DNS_view_rdata_mx(const dns_packet_view_t *view, const dns_rr_view_t *rr, uint16 *preference, uint32 *exchange);
+
+#endif //PROJECT_DNS_DNS_VIEW_H
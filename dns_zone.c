@@ -0,0 +1,369 @@
+//
+// dns_zone.c -- Implementation of the in-memory zone index. The RRs of the server table are
+//               loaded once and grouped into RRsets, which are stored in a hash table keyed
+//               by (lowercased name, type, class). The NS records are also indexed in a label
+//               trie so that all the delegation points of a name can be found in one walk
+// Created on 10/15/26.
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include "dns_common.h"
+#include "dns_database.h"
+#include "dns_zone.h"
+
+#define ZONE_NAME_LEN 256   // The maximum length of the names in the index
+#define MAX_LABELS    128   // The maximum number of labels in a name
+
+/**
+ * One RRset in the index, the entries of the same bucket are stored as linked list
+ */
+typedef struct zone_entry {
+    char *name;          // The lowercased owner name
+    uint16 type;
+    uint16 class;
+    dns_rr_t *rrset;     // The RRs of this set, linked with their next field
+    dns_rr_t *last;
+
+    struct zone_entry *next;
+} zone_entry_t;
+
+/**
+ * Node of the delegation trie. The labels of the names are stored in reverse order
+ * (com -> baidu -> www), and the chains of nodes without delegation and with only one
+ * child are compressed into one edge with multiple labels
+ */
+typedef struct trie_node {
+    char **labels;                  // The labels of the edge from the parent node, in reverse order
+    int label_count;
+    struct trie_node **children;    // The child nodes, sorted by their first label
+    int child_count;
+
+    dns_rr_t *ns;                   // The NS records if this node is a delegation point
+    dns_rr_t *glue;                 // The A records of the name servers
+} trie_node_t;
+
+zone_entry_t **zone_buckets = NULL;
+uint32 zone_bucket_count = 0;
+trie_node_t zone_trie_root;
+
+/**
+ * Find the RRset in the index
+ * @param name The lowercased name
+ * @return The entry, NULL if not found
+ */
+zone_entry_t *zone_find(const char *name, uint16 type, uint16 class) {
+    zone_entry_t *e = zone_buckets[DNS_name_hash(name, type, class) & (zone_bucket_count - 1)];
+    for (; e != NULL; e = e->next) {
+        if (e->type == type && e->class == class && !strcmp(e->name, name)) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Add one RR to its RRset, the set will be created if it does not exist
+ * @param rr The RR, its next field will be overwritten
+ * @return True if success
+ */
+bool zone_insert(dns_rr_t *rr) {
+    char name[ZONE_NAME_LEN];
+    DNS_name_to_lower(name, rr->name, ZONE_NAME_LEN);
+
+    rr->next = NULL;
+    zone_entry_t *e = zone_find(name, rr->type, rr->class);
+    if (e == NULL) {
+        e = (zone_entry_t *) malloc(sizeof(zone_entry_t));
+        if (e == NULL) {
+            DNS_log_error("[  dns_zone  ] Cannot create zone entry, out of memory.");
+            return false;
+        }
+        e->name = (char *) malloc(strlen(name) + 1);
+        strcpy(e->name, name);
+        e->type = rr->type;
+        e->class = rr->class;
+        e->rrset = rr;
+        e->last = rr;
+
+        uint32 index = DNS_name_hash(name, rr->type, rr->class) & (zone_bucket_count - 1);
+        e->next = zone_buckets[index];
+        zone_buckets[index] = e;
+    }
+    else {
+        e->last->next = rr;
+        e->last = rr;
+    }
+    return true;
+}
+
+/**
+ * Split a name into lowercased labels in reverse order
+ * @param name The name, like www.baidu.com
+ * @param buf The buffer to store the labels, should have at least ZONE_NAME_LEN bytes
+ * @param labels The labels, like {"com", "baidu", "www"}
+ * @return The number of labels
+ */
+int trie_split_labels(const char *name, char *buf, char **labels) {
+    char *forward[MAX_LABELS];
+    int count = 0;
+
+    DNS_name_to_lower(buf, name, ZONE_NAME_LEN);
+    for (char *c = buf; *c != '\0' && count < MAX_LABELS; ) {
+        forward[count++] = c;
+        while (*c != '\0' && *c != '.') {
+            c++;
+        }
+        if (*c == '.') {
+            *c++ = '\0';
+        }
+    }
+
+    for (int i = 0; i < count; i++) {
+        labels[i] = forward[count - 1 - i];
+    }
+    return count;
+}
+
+/**
+ * Find the child whose edge begins with the label with binary search
+ * @param node The parent node
+ * @param label The first label of the edge
+ * @param index The index of the child, or the position where it should be inserted if not found
+ * @return The child node, NULL if not found
+ */
+trie_node_t *trie_find_child(trie_node_t *node, const char *label, int *index) {
+    int low = 0, high = node->child_count - 1;
+    while (low <= high) {
+        int mid = (low + high) / 2;
+        int cmp = strcmp(node->children[mid]->labels[0], label);
+        if (cmp == 0) {
+            *index = mid;
+            return node->children[mid];
+        }
+        else if (cmp < 0) {
+            low = mid + 1;
+        }
+        else {
+            high = mid - 1;
+        }
+    }
+    *index = low;
+    return NULL;
+}
+
+/**
+ * Create a trie node with the labels of the edge copied
+ */
+trie_node_t *trie_create_node(char **labels, int label_count) {
+    trie_node_t *node = (trie_node_t *) calloc(1, sizeof(trie_node_t));
+    node->labels = (char **) malloc(sizeof(char *) * label_count);
+    node->label_count = label_count;
+    for (int i = 0; i < label_count; i++) {
+        node->labels[i] = (char *) malloc(strlen(labels[i]) + 1);
+        strcpy(node->labels[i], labels[i]);
+    }
+    return node;
+}
+
+/**
+ * Insert the child at the given position of the children array
+ */
+void trie_insert_child(trie_node_t *node, trie_node_t *child, int index) {
+    node->children = (trie_node_t **) realloc(node->children, sizeof(trie_node_t *) * (node->child_count + 1));
+    memmove(&node->children[index + 1], &node->children[index], sizeof(trie_node_t *) * (node->child_count - index));
+    node->children[index] = child;
+    node->child_count++;
+}
+
+/**
+ * Add a delegation point to the trie
+ * @param name The delegated name
+ * @param ns The NS records of the name
+ */
+void trie_insert(const char *name, dns_rr_t *ns) {
+    char buf[ZONE_NAME_LEN];
+    char *labels[MAX_LABELS];
+    int count = trie_split_labels(name, buf, labels);
+
+    trie_node_t *node = &zone_trie_root;
+    int i = 0;
+    while (i < count) {
+        int index;
+        trie_node_t *child = trie_find_child(node, labels[i], &index);
+        if (child == NULL) {
+            child = trie_create_node(&labels[i], count - i);
+            trie_insert_child(node, child, index);
+            node = child;
+            break;
+        }
+
+        // Find the common labels of the edge and the name
+        int k = 1;
+        while (k < child->label_count && i + k < count && !strcmp(child->labels[k], labels[i + k])) {
+            k++;
+        }
+
+        if (k < child->label_count) {
+            // The name ends or differs in the middle of the edge, split the edge
+            trie_node_t *middle = trie_create_node(child->labels, k);
+            for (int j = 0; j < k; j++) {
+                free(child->labels[j]);
+            }
+            memmove(child->labels, &child->labels[k], sizeof(char *) * (child->label_count - k));
+            child->label_count -= k;
+            trie_insert_child(middle, child, 0);
+            node->children[index] = middle;
+            child = middle;
+        }
+
+        node = child;
+        i += k;
+    }
+
+    node->ns = ns;
+}
+
+/**
+ * Find the A records of the name servers for all the delegation points of the trie
+ */
+void trie_build_glue(trie_node_t *node) {
+    dns_rr_t *last = NULL;
+    for (dns_rr_t *t = node->ns; t != NULL; t = t->next) {
+        dns_rr_t *addr = DNS_zone_get_record(t->rdata.name, TYPE_A, t->class, false);
+        if (addr == NULL) {
+            DNS_log_warning("[  dns_zone  ] The IP address of name server %s could not be found.", t->rdata.name);
+        }
+
+        for (; addr != NULL; addr = addr->next) {
+            dns_rr_t *copy = DNS_RR_copy(addr);
+            if (last == NULL) {
+                node->glue = copy;
+            }
+            else {
+                last->next = copy;
+            }
+            last = copy;
+        }
+    }
+
+    for (int i = 0; i < node->child_count; i++) {
+        trie_build_glue(node->children[i]);
+    }
+}
+
+bool DNS_zone_load(const char *table_name) {
+    dns_rr_t *records = DNS_database_get_all_records(table_name);
+    uint32 count = 0;
+    for (dns_rr_t *t = records; t != NULL; t = t->next) {
+        count++;
+    }
+
+    // Keep the load factor under 0.5, the bucket count should be power of 2
+    zone_bucket_count = 16;
+    while (zone_bucket_count < count * 2) {
+        zone_bucket_count <<= 1;
+    }
+    zone_buckets = (zone_entry_t **) calloc(zone_bucket_count, sizeof(zone_entry_t *));
+    if (zone_buckets == NULL) {
+        DNS_log_error("[  dns_zone  ] Cannot create zone index, out of memory.");
+        return false;
+    }
+
+    dns_rr_t *next;
+    for (dns_rr_t *t = records; t != NULL; t = next) {
+        next = t->next;
+
+        // The records are static, so they are encoded only once and copied to the responses
+        if (!DNS_RR_encode_wire(t)) {
+            DNS_log_warning("[  dns_zone  ] Cannot encode record %s %s", t->name, DNS_type_to_str(t->type));
+        }
+
+        if (!zone_insert(t)) {
+            return false;
+        }
+    }
+
+    // Only the IN class is supported, so the trie only contains the NS records of this class
+    for (uint32 i = 0; i < zone_bucket_count; i++) {
+        for (zone_entry_t *e = zone_buckets[i]; e != NULL; e = e->next) {
+            if (e->type == TYPE_NS && e->class == CLASS_IN) {
+                trie_insert(e->name, e->rrset);
+            }
+        }
+    }
+    trie_build_glue(&zone_trie_root);
+
+    DNS_log_info("Loaded %d records of table %s into memory", count, table_name);
+    return true;
+}
+
+bool DNS_zone_loaded() {
+    return zone_buckets != NULL;
+}
+
+dns_rr_t *DNS_zone_get_record(char *name, int type, int class, bool include_cname) {
+    char lower[ZONE_NAME_LEN];
+    DNS_name_to_lower(lower, name, ZONE_NAME_LEN);
+
+    zone_entry_t *e = zone_find(lower, (uint16) type, (uint16) class);
+    if (e != NULL) {
+        return e->rrset;
+    }
+
+    // A name with CNAME record should not have records of other types,
+    // so the CNAME records are only looked up when the type is not found
+    if (include_cname && type != TYPE_CNAME) {
+        e = zone_find(lower, TYPE_CNAME, (uint16) class);
+        if (e != NULL) {
+            return e->rrset;
+        }
+    }
+
+    return NULL;
+}
+
+int DNS_zone_get_delegations(char *name, int class, dns_delegation_t *delegations, int max) {
+    char buf[ZONE_NAME_LEN];
+    char *labels[MAX_LABELS];
+    dns_delegation_t found[MAX_LABELS];
+    int found_count = 0;
+
+    if (class != CLASS_IN) {
+        return 0;
+    }
+
+    int count = trie_split_labels(name, buf, labels);
+    trie_node_t *node = &zone_trie_root;
+    int i = 0;
+    while (i < count) {
+        int index;
+        node = trie_find_child(node, labels[i], &index);
+        if (node == NULL || i + node->label_count > count) {
+            break;
+        }
+
+        // The whole edge should be matched
+        int k = 1;
+        while (k < node->label_count && !strcmp(node->labels[k], labels[i + k])) {
+            k++;
+        }
+        if (k < node->label_count) {
+            break;
+        }
+        i += k;
+
+        if (node->ns != NULL) {
+            found[found_count].ns = node->ns;
+            found[found_count].glue = node->glue;
+            found_count++;
+        }
+    }
+
+    // The delegations are found from the shortest name, reverse them
+    int n = 0;
+    for (int j = found_count - 1; j >= 0 && n < max; j--) {
+        delegations[n++] = found[j];
+    }
+    return n;
+}
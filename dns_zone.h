@@ -0,0 +1,62 @@
+//
+// dns_zone.h -- In-memory index of the Resource Records served by an authoritative server
+// Created on 10/15/26.
+//
+
+#ifndef PROJECT_DNS_DNS_ZONE_H
+#define PROJECT_DNS_DNS_ZONE_H
+
+#include "dns_io.h"
+
+/**
+ * Load all the Resource Records of the table into the in-memory index.
+ * After loading, the lookups of the authoritative server will be answered
+ * from the index and the database will not be used anymore
+ * @param table_name The table name, should be the same as the server mode name
+ * @return True if the table is successfully loaded
+ */
+bool DNS_zone_load(const char *table_name);
+
+/**
+ * Check whether the zone index is loaded
+ * @return True if {@code DNS_zone_load} have succeeded
+ */
+bool DNS_zone_loaded();
+
+/**
+ * Look up the RRset of the given name, type and class from the index.
+ * The name is matched case-insensitively.
+ * The returned RRs are owned by the index and should be copied before
+ * they are added to a packet
+ * @param name The name to be looked up
+ * @param type The type of the records
+ * @param class The class of the records
+ * @param include_cname If there are no records of the type, return the CNAME records of the name
+ * @return The linked list of the RRs, NULL if not found
+ */
+dns_rr_t *DNS_zone_get_record(char *name, int type, int class, bool include_cname);
+
+/**
+ * A delegation point in the zone: the NS records of a name and
+ * the A records (glue) of the name servers
+ */
+typedef struct {
+    dns_rr_t *ns;
+    dns_rr_t *glue;
+} dns_delegation_t;
+
+/**
+ * Find all the delegation points along the name with one walk of the label trie.
+ * For example, for www.baidu.com the NS records of www.baidu.com, baidu.com and com
+ * will be found if they exist.
+ * The returned RRs are owned by the index and should be copied before
+ * they are added to a packet
+ * @param name The name to be looked up
+ * @param class The class of the records
+ * @param delegations The found delegations, ordered from the longest name to the shortest name
+ * @param max The capacity of the delegations array
+ * @return The number of delegations found
+ */
+int DNS_zone_get_delegations(char *name, int class, dns_delegation_t *delegations, int max);
+
+#endif //PROJECT_DNS_DNS_ZONE_H